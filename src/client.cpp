@@ -65,7 +65,8 @@ static std::string getMediaCacheDir()
 QueuedMeshUpdate::QueuedMeshUpdate():
 	p(-1337,-1337,-1337),
 	data(NULL),
-	ack_block_to_server(false)
+	ack_block_to_server(false),
+	priority(0)
 {
 }
 
@@ -79,7 +80,8 @@ QueuedMeshUpdate::~QueuedMeshUpdate()
 	MeshUpdateQueue
 */
 	
-MeshUpdateQueue::MeshUpdateQueue()
+MeshUpdateQueue::MeshUpdateQueue():
+	m_camera_block(0,0,0)
 {
 	m_mutex.Init();
 }
@@ -88,15 +90,21 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	for(std::map<v3s16, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
+		QueuedMeshUpdate *q = i->second;
 		delete q;
 	}
 }
 
+u32 MeshUpdateQueue::getPriority(v3s16 p)
+{
+	v3s16 d = p - m_camera_block;
+	return d.X * d.X + d.Y * d.Y + d.Z * d.Z;
+}
+
 /*
 	peer_id=0 adds with nobody to send to
 */
@@ -115,20 +123,16 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 		Find if block is already in queue.
 		If it is, update the data and quit.
 	*/
-	for(std::vector<QueuedMeshUpdate*>::iterator
-			i = m_queue.begin();
-			i != m_queue.end(); i++)
-	{
-		QueuedMeshUpdate *q = *i;
-		if(q->p == p)
-		{
-			if(q->data)
-				delete q->data;
-			q->data = data;
-			if(ack_block_to_server)
-				q->ack_block_to_server = true;
-			return;
-		}
+	std::map<v3s16, QueuedMeshUpdate*>::iterator i = m_queue.find(p);
+	if(i != m_queue.end())
+	{
+		QueuedMeshUpdate *q = i->second;
+		if(q->data)
+			delete q->data;
+		q->data = data;
+		if(ack_block_to_server)
+			q->ack_block_to_server = true;
+		return;
 	}
 	
 	/*
@@ -138,28 +142,82 @@ void MeshUpdateQueue::addBlock(v3s16 p, MeshMakeData *data, bool ack_block_to_se
 	q->p = p;
 	q->data = data;
 	q->ack_block_to_server = ack_block_to_server;
-	m_queue.push_back(q);
+	q->priority = getPriority(p);
+	m_queue[p] = q;
+	m_order.insert(std::make_pair(q->priority, p));
 }
 
-// Returned pointer must be deleted
-// Returns NULL if queue is empty
+// Returned pointer must be deleted, and done() called for its position
+// Returns NULL if no block is ready to be meshed
 QueuedMeshUpdate * MeshUpdateQueue::pop()
 {
 	JMutexAutoLock lock(m_mutex);
 
-	bool must_be_urgent = !m_urgents.empty();
-	for(std::vector<QueuedMeshUpdate*>::iterator
+	QueuedMeshUpdate *q = NULL;
+
+	// Urgent blocks go first
+	for(std::set<v3s16>::iterator
+			i = m_urgents.begin();
+			i != m_urgents.end(); i++)
+	{
+		if(m_in_progress.count(*i) != 0)
+			continue;
+		std::map<v3s16, QueuedMeshUpdate*>::iterator j = m_queue.find(*i);
+		if(j == m_queue.end())
+			continue;
+		q = j->second;
+		break;
+	}
+
+	// Then the ones nearest to the camera
+	if(q == NULL)
+	{
+		for(std::set<std::pair<u32, v3s16> >::iterator
+				i = m_order.begin();
+				i != m_order.end(); i++)
+		{
+			if(m_in_progress.count(i->second) != 0)
+				continue;
+			q = m_queue[i->second];
+			break;
+		}
+	}
+
+	if(q == NULL)
+		return NULL;
+
+	m_queue.erase(q->p);
+	m_order.erase(std::make_pair(q->priority, q->p));
+	m_urgents.erase(q->p);
+	m_in_progress.insert(q->p);
+	return q;
+}
+
+void MeshUpdateQueue::done(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	m_in_progress.erase(p);
+}
+
+void MeshUpdateQueue::setCameraBlock(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(blockpos == m_camera_block)
+		return;
+	m_camera_block = blockpos;
+
+	// Re-sort the queue for the new position
+	m_order.clear();
+	for(std::map<v3s16, QueuedMeshUpdate*>::iterator
 			i = m_queue.begin();
 			i != m_queue.end(); i++)
 	{
-		QueuedMeshUpdate *q = *i;
-		if(must_be_urgent && m_urgents.count(q->p) == 0)
-			continue;
-		m_queue.erase(i);
-		m_urgents.erase(q->p);
-		return q;
+		QueuedMeshUpdate *q = i->second;
+		q->priority = getPriority(q->p);
+		m_order.insert(std::make_pair(q->priority, q->p));
 	}
-	return NULL;
 }
 
 /*
@@ -178,16 +236,7 @@ void * MeshUpdateThread::Thread()
 
 	while(getRun())
 	{
-		/*// Wait for output queue to flush.
-		// Allow 2 in queue, this makes less frametime jitter.
-		// Umm actually, there is no much difference
-		if(m_queue_out.size() >= 2)
-		{
-			sleep_ms(3);
-			continue;
-		}*/
-
-		QueuedMeshUpdate *q = m_queue_in.pop();
+		QueuedMeshUpdate *q = m_queue_in->pop();
 		if(q == NULL)
 		{
 			sleep_ms(3);
@@ -212,7 +261,10 @@ void * MeshUpdateThread::Thread()
 				<<"("<<q->p.X<<","<<q->p.Y<<","<<q->p.Z<<")"
 				<<std::endl;*/
 
-		m_queue_out.push_back(r);
+		m_queue_out->push_back(r);
+
+		// Only now another thread may start on the same block
+		m_queue_in->done(q->p);
 
 		delete q;
 	}
@@ -222,6 +274,70 @@ void * MeshUpdateThread::Thread()
 	return NULL;
 }
 
+/*
+	MeshUpdateManager
+*/
+
+MeshUpdateManager::MeshUpdateManager()
+{
+}
+
+MeshUpdateManager::~MeshUpdateManager()
+{
+	stop();
+	while(!m_queue_out.empty()) {
+		MeshUpdateResult r = m_queue_out.pop_front();
+		delete r.mesh;
+	}
+}
+
+void MeshUpdateManager::start()
+{
+	assert(m_threads.empty());
+
+	int nthreads;
+	if (g_settings->get("mesh_generation_threads").empty()) {
+		int nprocs = porting::getNumberOfProcessors();
+		// leave a proc for the main thread and one for the network
+		nthreads = (nprocs > 2) ? nprocs - 2 : 1;
+	} else {
+		nthreads = g_settings->getU16("mesh_generation_threads");
+	}
+	if (nthreads < 1)
+		nthreads = 1;
+
+	infostream<<"MeshUpdateManager: using "<<nthreads<<" threads"<<std::endl;
+
+	for(int i = 0; i < nthreads; i++)
+	{
+		MeshUpdateThread *thread = new MeshUpdateThread(&m_queue_in,
+				&m_queue_out);
+		m_threads.push_back(thread);
+		thread->Start();
+	}
+}
+
+void MeshUpdateManager::stop()
+{
+	for(std::vector<MeshUpdateThread*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); i++)
+		(*i)->setRun(false);
+	for(std::vector<MeshUpdateThread*>::iterator
+			i = m_threads.begin();
+			i != m_threads.end(); i++)
+	{
+		(*i)->stop();
+		delete *i;
+	}
+	m_threads.clear();
+}
+
+bool MeshUpdateManager::isRunning()
+{
+	return !m_threads.empty();
+}
+
 void * MediaFetchThread::Thread()
 {
 	ThreadStarted();
@@ -281,7 +397,6 @@ Client::Client(
 	m_nodedef(nodedef),
 	m_sound(sound),
 	m_event(event),
-	m_mesh_update_thread(this),
 	m_env(
 		new ClientMap(this, this, control,
 			device->getSceneManager()->getRootSceneNode(),
@@ -343,11 +458,9 @@ Client::~Client()
 		m_con.Disconnect();
 	}
 
-	m_mesh_update_thread.setRun(false);
-	while(m_mesh_update_thread.IsRunning())
-		sleep_ms(100);
-	while(!m_mesh_update_thread.m_queue_out.empty()) {
-		MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+	m_mesh_update_manager.stop();
+	while(!m_mesh_update_manager.m_queue_out.empty()) {
+		MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 		delete r.mesh;
 	}
 
@@ -730,6 +843,16 @@ void Client::step(float dtime)
 		}
 	}
 
+	/*
+		Mesh blocks near the player first
+	*/
+	{
+		LocalPlayer *player = m_env.getLocalPlayer();
+		if(player != NULL)
+			m_mesh_update_manager.m_queue_in.setCameraBlock(
+					getNodeBlockPos(floatToInt(player->getPosition(), BS)));
+	}
+
 	/*
 		Replace updated meshes
 	*/
@@ -740,14 +863,14 @@ void Client::step(float dtime)
 		// 0ms
 		
 		/*infostream<<"Mesh update result queue size is "
-				<<m_mesh_update_thread.m_queue_out.size()
+				<<m_mesh_update_manager.m_queue_out.size()
 				<<std::endl;*/
 		
 		int num_processed_meshes = 0;
-		while(!m_mesh_update_thread.m_queue_out.empty())
+		while(!m_mesh_update_manager.m_queue_out.empty())
 		{
 			num_processed_meshes++;
-			MeshUpdateResult r = m_mesh_update_thread.m_queue_out.pop_front();
+			MeshUpdateResult r = m_mesh_update_manager.m_queue_out.pop_front();
 			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(r.p);
 			if(block)
 			{
@@ -1079,13 +1202,10 @@ void Client::ReceiveAll()
 			break;
 		
 		try{
-			Receive();
+			if(!Receive())
+				break;
 			g_profiler->graphAdd("client_received_packets", 1);
 		}
-		catch(con::NoIncomingDataException &e)
-		{
-			break;
-		}
 		catch(con::InvalidIncomingDataException &e)
 		{
 			infostream<<"Client::ReceiveAll(): "
@@ -1095,19 +1215,21 @@ void Client::ReceiveAll()
 	}
 }
 
-void Client::Receive()
+// Returns false if there was no incoming data
+bool Client::Receive()
 {
 	DSTACK(__FUNCTION_NAME);
 	SharedBuffer<u8> data;
 	u16 sender_peer_id;
-	u32 datasize;
 	{
 		//TimeTaker t1("con mutex and receive", m_device);
 		//JMutexAutoLock lock(m_con_mutex); //bulk comment-out
-		datasize = m_con.Receive(sender_peer_id, data);
+		if(!m_con.ReceiveNoEx(sender_peer_id, data))
+			return false;
 	}
 	//TimeTaker t1("ProcessData", m_device);
-	ProcessData(*data, datasize, sender_peer_id);
+	ProcessData(*data, data.getSize(), sender_peer_id);
+	return true;
 }
 
 /*
@@ -1593,6 +1715,59 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		u16 breath = readU16(is);
 		player->setBreath(breath) ;
 	}
+	else if(command == TOCLIENT_NODEMETA_CHANGED)
+	{
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::ostringstream tmp_os;
+		decompressZlib(tmp_is, tmp_os);
+		std::istringstream tmp_is2(tmp_os.str(), std::ios::binary);
+
+		/*
+			Node metadata isn't drawn, so the blocks are only updated
+			and not remeshed
+		*/
+		u16 count = readU16(tmp_is2);
+		for(u16 i=0; i<count; i++)
+		{
+			v3s16 p = readV3S16(tmp_is2);
+			bool exists = readU8(tmp_is2);
+			MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(
+					getNodeBlockPos(p));
+			if(exists)
+			{
+				NodeMetadata *meta = new NodeMetadata(this);
+				meta->deSerialize(tmp_is2);
+				if(block)
+					m_env.getMap().setNodeMetadata(p, meta);
+				else
+					delete meta;
+			}
+			else if(block)
+			{
+				m_env.getMap().removeNodeMetadata(p);
+			}
+		}
+	}
+	else if(command == TOCLIENT_INVENTORY_DELTA)
+	{
+		// A delta is relative to the last inventory got from the server
+		if(m_inventory_from_server == NULL)
+			return;
+
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+
+		Player *player = m_env.getLocalPlayer();
+		assert(player != NULL);
+
+		m_inventory_from_server->deSerializeChanges(is);
+		// This also drops local predictions the server didn't accept
+		player->inventory = *m_inventory_from_server;
+		m_inventory_updated = true;
+		m_inventory_from_server_age = 0.0;
+	}
 	else if(command == TOCLIENT_MOVE_PLAYER)
 	{
 		std::string datastring((char*)&data[2], datasize-2);
@@ -1655,7 +1830,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		int num_files = readU16(is);
 		
@@ -1784,7 +1959,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		for(u32 i=0; i<num_files; i++){
 			assert(m_media_received_count < m_media_count);
@@ -1841,7 +2016,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress node definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -1866,7 +2041,7 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 
 		// Mesh update thread must be stopped while
 		// updating content definitions
-		assert(!m_mesh_update_thread.IsRunning());
+		assert(!m_mesh_update_manager.isRunning());
 
 		// Decompress item definitions
 		std::string datastring((char*)&data[2], datasize-2);
@@ -2790,13 +2965,13 @@ void Client::addUpdateMeshTask(v3s16 p, bool ack_to_server, bool urgent)
 	}
 
 	// Debug wait
-	//while(m_mesh_update_thread.m_queue_in.size() > 0) sleep_ms(10);
+	//while(m_mesh_update_manager.m_queue_in.size() > 0) sleep_ms(10);
 	
 	// Add task to queue
-	m_mesh_update_thread.m_queue_in.addBlock(p, data, ack_to_server, urgent);
+	m_mesh_update_manager.m_queue_in.addBlock(p, data, ack_to_server, urgent);
 
 	/*infostream<<"Mesh update input queue size is "
-			<<m_mesh_update_thread.m_queue_in.size()
+			<<m_mesh_update_manager.m_queue_in.size()
 			<<std::endl;*/
 }
 
@@ -2931,9 +3106,9 @@ void Client::afterContentReceived(IrrlichtDevice *device, gui::IGUIFont* font)
 		delete[] text;
 	}
 
-	// Start mesh update thread after setting up content definitions
-	infostream<<"- Starting mesh update thread"<<std::endl;
-	m_mesh_update_thread.Start();
+	// Start mesh update threads after setting up content definitions
+	infostream<<"- Starting mesh update threads"<<std::endl;
+	m_mesh_update_manager.start();
 	
 	infostream<<"Client::afterContentReceived() done"<<std::endl;
 }
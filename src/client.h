@@ -63,6 +63,8 @@ struct QueuedMeshUpdate
 	v3s16 p;
 	MeshMakeData *data;
 	bool ack_block_to_server;
+	// Squared distance to the camera block when it was last sorted
+	u32 priority;
 
 	QueuedMeshUpdate();
 	~QueuedMeshUpdate();
@@ -70,6 +72,11 @@ struct QueuedMeshUpdate
 
 /*
 	A thread-safe queue of mesh update tasks
+
+	Blocks are looked up by position and handed out nearest to the camera
+	first, urgent ones before all others. A block that is being meshed by
+	one thread is not handed to another thread until done() is called, so
+	the meshes of a block are finished in the order they were queued.
 */
 class MeshUpdateQueue
 {
@@ -84,10 +91,16 @@ class MeshUpdateQueue
 	void addBlock(v3s16 p, MeshMakeData *data,
 			bool ack_block_to_server, bool urgent);
 
-	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
+	// Returned pointer must be deleted, and done() called for its position
+	// Returns NULL if no block is ready to be meshed
 	QueuedMeshUpdate * pop();
 
+	// Marks the block popped at p as finished
+	void done(v3s16 p);
+
+	// Sets the block that priorities are measured from
+	void setCameraBlock(v3s16 blockpos);
+
 	u32 size()
 	{
 		JMutexAutoLock lock(m_mutex);
@@ -95,8 +108,16 @@ class MeshUpdateQueue
 	}
 	
 private:
-	std::vector<QueuedMeshUpdate*> m_queue;
+	u32 getPriority(v3s16 p);
+
+	// Queued blocks by position
+	std::map<v3s16, QueuedMeshUpdate*> m_queue;
+	// Queued blocks ordered by (priority, position)
+	std::set<std::pair<u32, v3s16> > m_order;
 	std::set<v3s16> m_urgents;
+	// Blocks that are currently being meshed
+	std::set<v3s16> m_in_progress;
+	v3s16 m_camera_block;
 	JMutex m_mutex;
 };
 
@@ -118,18 +139,41 @@ class MeshUpdateThread : public SimpleThread
 {
 public:
 
-	MeshUpdateThread(IGameDef *gamedef):
-		m_gamedef(gamedef)
+	MeshUpdateThread(MeshUpdateQueue *queue_in,
+			MutexedQueue<MeshUpdateResult> *queue_out):
+		m_queue_in(queue_in),
+		m_queue_out(queue_out)
 	{
 	}
 
 	void * Thread();
 
+	MeshUpdateQueue *m_queue_in;
+
+	MutexedQueue<MeshUpdateResult> *m_queue_out;
+};
+
+/*
+	The mesh update threads and their shared input and output queues.
+	The number of threads is given by the mesh_generation_threads setting.
+*/
+class MeshUpdateManager
+{
+public:
+	MeshUpdateManager();
+	~MeshUpdateManager();
+
+	void start();
+	void stop();
+
+	bool isRunning();
+
 	MeshUpdateQueue m_queue_in;
 
 	MutexedQueue<MeshUpdateResult> m_queue_out;
 
-	IGameDef *m_gamedef;
+private:
+	std::vector<MeshUpdateThread*> m_threads;
 };
 
 class MediaFetchThread : public SimpleThread
@@ -467,7 +511,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void deletingPeer(con::Peer *peer, bool timeout);
 	
 	void ReceiveAll();
-	void Receive();
+	bool Receive();
 	
 	void sendPlayerPos();
 	// Send the item number 'item' as player item to the server
@@ -487,7 +531,7 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	ISoundManager *m_sound;
 	MtEventManager *m_event;
 
-	MeshUpdateThread m_mesh_update_thread;
+	MeshUpdateManager m_mesh_update_manager;
 	std::list<MediaFetchThread*> m_media_fetch_threads;
 	ClientEnvironment m_env;
 	con::Connection m_con;
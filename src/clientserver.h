@@ -100,9 +100,12 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 		version, heat and humidity transfer in MapBock
 		automatic_face_movement_dir and automatic_face_movement_dir_offset
 			added to object properties
+	PROTOCOL_VERSION 22:
+		TOCLIENT_NODEMETA_CHANGED
+		TOCLIENT_INVENTORY_DELTA
 */
 
-#define LATEST_PROTOCOL_VERSION 21
+#define LATEST_PROTOCOL_VERSION 22
 
 // Server's supported network protocol range
 #define SERVER_PROTOCOL_VERSION_MIN 13
@@ -499,6 +502,50 @@ enum ToClientCommand
 		u16 command
 		u16 breath
 	*/
+
+	TOCLIENT_NODEMETA_CHANGED = 0x4f,
+	/*
+		u16 command
+		u32 length of the next item
+		zlib-compressed data:
+			u16 count
+			for each count:
+				v3s16 node position
+				u8 1 if the node has metadata, 0 if it was removed
+				if 1: serialized NodeMetadata
+	*/
+
+	TOCLIENT_INVENTORY_DELTA = 0x50,
+	/*
+		Changes to the player inventory since the last
+		TOCLIENT_INVENTORY or TOCLIENT_INVENTORY_DELTA.
+		May contain no lists; the client then only drops its local
+		changes, e.g. after a rejected inventory action.
+
+		u16 command
+		u16 list count
+		for each list:
+			u16 len
+			u8[len] list name
+			u32 list size
+			u32 list width
+			u8 1 if all slots follow, 0 if only the changed ones
+			if 1:
+				for each slot: item
+			if 0:
+				u16 count
+				for each count:
+					u16 slot index
+					item
+		item:
+			u16 len
+			u8[len] item name (empty for an empty slot)
+			if not empty:
+				u16 count
+				u16 wear
+				u32 len
+				u8[len] metadata
+	*/
 };
 
 enum ToServerCommand
@@ -167,7 +167,7 @@ int axisAlignedCollision(
 // Helper function:
 // Checks if moving the movingbox up by the given distance would hit a ceiling.
 bool wouldCollideWithCeiling(
-		const std::vector<aabb3f> &staticboxes,
+		const std::vector<NearbyCollisionInfo> &cinfo,
 		const aabb3f &movingbox,
 		f32 y_increase, f32 d)
 {
@@ -175,11 +175,11 @@ bool wouldCollideWithCeiling(
 
 	assert(y_increase >= 0);
 
-	for(std::vector<aabb3f>::const_iterator
-			i = staticboxes.begin();
-			i != staticboxes.end(); i++)
+	for(std::vector<NearbyCollisionInfo>::const_iterator
+			i = cinfo.begin();
+			i != cinfo.end(); i++)
 	{
-		const aabb3f& staticbox = *i;
+		const aabb3f& staticbox = i->box;
 		if((movingbox.MaxEdge.Y - d <= staticbox.MinEdge.Y) &&
 				(movingbox.MaxEdge.Y + y_increase > staticbox.MinEdge.Y) &&
 				(movingbox.MinEdge.X < staticbox.MaxEdge.X) &&
@@ -227,12 +227,11 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	/*
 		Collect node boxes in movement range
 	*/
-	std::vector<aabb3f> cboxes;
-	std::vector<bool> is_unloaded;
-	std::vector<bool> is_step_up;
-	std::vector<bool> is_object;
-	std::vector<int> bouncy_values;
-	std::vector<v3s16> node_positions;
+	// The environment keeps this buffer between calls so that its memory
+	// is reused
+	std::vector<NearbyCollisionInfo> &cinfo = env->getCollisionBuffer();
+	cinfo.clear();
+	INodeDefManager *ndef = gamedef->getNodeDefManager();
 	{
 	//TimeTaker tt2("collisionMoveSimple collect boxes");
     ScopeProfiler sp(g_profiler, "collisionMoveSimple collect boxes avg", SPT_AVG);
@@ -251,40 +250,33 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	for(s16 z = min_z; z <= max_z; z++)
 	{
 		v3s16 p(x,y,z);
-		try{
+
+		bool is_valid_position;
+		MapNode n = map->getNodeNoEx(p, &is_valid_position);
+		if(is_valid_position)
+		{
 			// Object collides into walkable nodes
-			MapNode n = map->getNode(p);
-			const ContentFeatures &f = gamedef->getNodeDefManager()->get(n);
+			const ContentFeatures &f = ndef->get(n);
 			if(f.walkable == false)
 				continue;
-			int n_bouncy_value = itemgroup_get(f.groups, "bouncy");
 
-			std::vector<aabb3f> nodeboxes = n.getNodeBoxes(gamedef->ndef());
-			for(std::vector<aabb3f>::iterator
-					i = nodeboxes.begin();
-					i != nodeboxes.end(); i++)
+			const aabb3f *nodeboxes;
+			u32 nodebox_count = f.getCollisionBoxes(n.getParam2(), &nodeboxes);
+			v3f offset = v3f(x, y, z)*BS;
+			for(u32 i = 0; i < nodebox_count; i++)
 			{
-				aabb3f box = *i;
-				box.MinEdge += v3f(x, y, z)*BS;
-				box.MaxEdge += v3f(x, y, z)*BS;
-				cboxes.push_back(box);
-				is_unloaded.push_back(false);
-				is_step_up.push_back(false);
-				bouncy_values.push_back(n_bouncy_value);
-				node_positions.push_back(p);
-				is_object.push_back(false);
+				aabb3f box = nodeboxes[i];
+				box.MinEdge += offset;
+				box.MaxEdge += offset;
+				cinfo.push_back(NearbyCollisionInfo(box, p, f.bouncy,
+						false, false));
 			}
 		}
-		catch(InvalidPositionException &e)
+		else
 		{
 			// Collide with unloaded nodes
 			aabb3f box = getNodeBox(p, BS);
-			cboxes.push_back(box);
-			is_unloaded.push_back(true);
-			is_step_up.push_back(false);
-			bouncy_values.push_back(0);
-			node_positions.push_back(p);
-			is_object.push_back(false);
+			cinfo.push_back(NearbyCollisionInfo(box, p, 0, true, false));
 		}
 	}
 	} // tt2
@@ -294,7 +286,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		ScopeProfiler sp(g_profiler, "collisionMoveSimple objects avg", SPT_AVG);
 		//TimeTaker tt3("collisionMoveSimple collect object boxes");
 
-		/* add object boxes to cboxes */
+		/* add object boxes to cinfo */
 
 
 		std::list<ActiveObject*> objects;
@@ -340,23 +332,13 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 				if (object->getCollisionBox(&object_collisionbox) &&
 						object->collideWithObjects())
 				{
-					cboxes.push_back(object_collisionbox);
-					is_unloaded.push_back(false);
-					is_step_up.push_back(false);
-					bouncy_values.push_back(0);
-					node_positions.push_back(v3s16(0,0,0));
-					is_object.push_back(true);
+					cinfo.push_back(NearbyCollisionInfo(object_collisionbox,
+							v3s16(0,0,0), 0, false, true));
 				}
 			}
 		}
 	} //tt3
 
-	assert(cboxes.size() == is_unloaded.size());
-	assert(cboxes.size() == is_step_up.size());
-	assert(cboxes.size() == bouncy_values.size());
-	assert(cboxes.size() == node_positions.size());
-	assert(cboxes.size() == is_object.size());
-
 	/*
 		Collision detection
 	*/
@@ -399,16 +381,16 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		/*
 			Go through every nodebox, find nearest collision
 		*/
-		for(u32 boxindex = 0; boxindex < cboxes.size(); boxindex++)
+		for(u32 boxindex = 0; boxindex < cinfo.size(); boxindex++)
 		{
 			// Ignore if already stepped up this nodebox.
-			if(is_step_up[boxindex])
+			if(cinfo[boxindex].is_step_up)
 				continue;
 
 			// Find nearest collision of the two boxes (raytracing-like)
 			f32 dtime_tmp;
 			int collided = axisAlignedCollision(
-					cboxes[boxindex], movingbox, speed_f, d, dtime_tmp);
+					cinfo[boxindex].box, movingbox, speed_f, d, dtime_tmp);
 
 			if(collided == -1 || dtime_tmp >= nearest_dtime)
 				continue;
@@ -428,19 +410,20 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 		{
 			// Otherwise, a collision occurred.
 
-			const aabb3f& cbox = cboxes[nearest_boxindex];
+			NearbyCollisionInfo &nearest_info = cinfo[nearest_boxindex];
+			const aabb3f& cbox = nearest_info.box;
 
 			// Check for stairs.
 			bool step_up = (nearest_collided != 1) && // must not be Y direction
 					(movingbox.MinEdge.Y < cbox.MaxEdge.Y) &&
 					(movingbox.MinEdge.Y + stepheight > cbox.MaxEdge.Y) &&
-					(!wouldCollideWithCeiling(cboxes, movingbox,
+					(!wouldCollideWithCeiling(cinfo, movingbox,
 							cbox.MaxEdge.Y - movingbox.MinEdge.Y,
 							d));
 
 			// Get bounce multiplier
-			bool bouncy = (bouncy_values[nearest_boxindex] >= 1);
-			float bounce = -(float)bouncy_values[nearest_boxindex] / 100.0;
+			bool bouncy = (nearest_info.bouncy >= 1);
+			float bounce = -(float)nearest_info.bouncy / 100.0;
 
 			// Move to the point of collision and reduce dtime by nearest_dtime
 			if(nearest_dtime < 0)
@@ -463,17 +446,17 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			}
 			
 			bool is_collision = true;
-			if(is_unloaded[nearest_boxindex])
+			if(nearest_info.is_unloaded)
 				is_collision = false;
 
 			CollisionInfo info;
-			if (is_object[nearest_boxindex]) {
+			if (nearest_info.is_object) {
 				info.type = COLLISION_OBJECT;
 			}
 			else {
 				info.type = COLLISION_NODE;
 			}
-			info.node_p = node_positions[nearest_boxindex];
+			info.node_p = nearest_info.position;
 			info.bouncy = bouncy;
 			info.old_speed = speed_f;
 
@@ -481,7 +464,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			if(step_up)
 			{
 				// Special case: Handle stairs
-				is_step_up[nearest_boxindex] = true;
+				nearest_info.is_step_up = true;
 				is_collision = false;
 			}
 			else if(nearest_collided == 0) // X
@@ -527,9 +510,10 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 	aabb3f box = box_0;
 	box.MinEdge += pos_f;
 	box.MaxEdge += pos_f;
-	for(u32 boxindex = 0; boxindex < cboxes.size(); boxindex++)
+	for(u32 boxindex = 0; boxindex < cinfo.size(); boxindex++)
 	{
-		const aabb3f& cbox = cboxes[boxindex];
+		const NearbyCollisionInfo &box_info = cinfo[boxindex];
+		const aabb3f& cbox = box_info.box;
 
 		/*
 			See if the object is touching ground.
@@ -546,7 +530,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 				cbox.MaxEdge.Z-d > box.MinEdge.Z &&
 				cbox.MinEdge.Z+d < box.MaxEdge.Z
 		){
-			if(is_step_up[boxindex])
+			if(box_info.is_step_up)
 			{
 				pos_f.Y += (cbox.MaxEdge.Y - box.MinEdge.Y);
 				box = box_0;
@@ -556,7 +540,7 @@ collisionMoveResult collisionMoveSimple(Environment *env, IGameDef *gamedef,
 			if(fabs(cbox.MaxEdge.Y-box.MinEdge.Y) < 0.15*BS)
 			{
 				result.touching_ground = true;
-				if(is_unloaded[boxindex])
+				if(box_info.is_unloaded)
 					result.standing_on_unloaded = true;
 			}
 		}
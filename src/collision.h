@@ -51,6 +51,27 @@ struct CollisionInfo
 	{}
 };
 
+// A static box in the range of a collisionMoveSimple() sweep
+struct NearbyCollisionInfo
+{
+	aabb3f box;
+	v3s16 position; // COLLISION_NODE
+	int bouncy;
+	bool is_unloaded;
+	bool is_step_up;
+	bool is_object;
+
+	NearbyCollisionInfo(const aabb3f &box_, const v3s16 &position_,
+			int bouncy_, bool is_unloaded_, bool is_object_):
+		box(box_),
+		position(position_),
+		bouncy(bouncy_),
+		is_unloaded(is_unloaded_),
+		is_step_up(false),
+		is_object(is_object_)
+	{}
+};
+
 struct collisionMoveResult
 {
 	bool touching_ground;
@@ -95,7 +116,7 @@ int axisAlignedCollision(
 // Helper function:
 // Checks if moving the movingbox up by the given distance would hit a ceiling.
 bool wouldCollideWithCeiling(
-		const std::vector<aabb3f> &staticboxes,
+		const std::vector<NearbyCollisionInfo> &cinfo,
 		const aabb3f &movingbox,
 		f32 y_increase, f32 d);
 
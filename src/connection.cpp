@@ -170,71 +170,90 @@ SharedBuffer<u8> makeReliablePacket(
 	ReliablePacketBuffer
 */
 
-ReliablePacketBuffer::ReliablePacketBuffer(): m_list_size(0) {}
+ReliablePacketBuffer::ReliablePacketBuffer():
+	m_first(0),
+	m_last(0),
+	m_count(0)
+{
+}
+
+ReliablePacketBuffer::~ReliablePacketBuffer()
+{
+	for(u32 i=0; i<m_slots.size(); i++)
+		delete m_slots[i];
+}
 
 void ReliablePacketBuffer::print()
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end();
-		++i)
+	if(empty())
+		return;
+	for(u16 s = m_first; ; s++)
 	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		dout_con<<s<<" ";
+		if(slot(s) != NULL)
+			dout_con<<s<<" ";
+		if(s == m_last)
+			break;
 	}
 }
 bool ReliablePacketBuffer::empty()
 {
-	return m_list.empty();
+	return m_count == 0;
 }
 u32 ReliablePacketBuffer::size()
 {
-	return m_list_size;
+	return m_count;
 }
-RPBSearchResult ReliablePacketBuffer::findPacket(u16 seqnum)
+bool ReliablePacketBuffer::contains(u16 seqnum)
 {
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	for(; i != m_list.end(); ++i)
-	{
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		/*dout_con<<"findPacket(): finding seqnum="<<seqnum
-				<<", comparing to s="<<s<<std::endl;*/
-		if(s == seqnum)
-			break;
-	}
-	return i;
+	if(empty())
+		return false;
+	if(seqnum_higher(m_first, seqnum) || seqnum_higher(seqnum, m_last))
+		return false;
+	return slot(seqnum) != NULL;
 }
-RPBSearchResult ReliablePacketBuffer::notFound()
+bool ReliablePacketBuffer::canInsert(u16 seqnum)
 {
-	return m_list.end();
+	if(empty())
+		return true;
+	u16 first = seqnum_higher(m_first, seqnum) ? seqnum : m_first;
+	u16 last = seqnum_higher(seqnum, m_last) ? seqnum : m_last;
+	return (u16)(last - first) < RELIABLE_BUFFER_SIZE;
 }
 bool ReliablePacketBuffer::getFirstSeqnum(u16 *result)
 {
 	if(empty())
 		return false;
-	BufferedPacket p = *m_list.begin();
-	*result = readU16(&p.data[BASE_HEADER_SIZE+1]);
+	*result = m_first;
 	return true;
 }
 BufferedPacket ReliablePacketBuffer::popFirst()
 {
 	if(empty())
 		throw NotFoundException("Buffer is empty");
-	BufferedPacket p = *m_list.begin();
-	m_list.erase(m_list.begin());
-	--m_list_size;
-	return p;
+	return popSeqnum(m_first);
 }
 BufferedPacket ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
-	RPBSearchResult r = findPacket(seqnum);
-	if(r == notFound()){
+	if(!contains(seqnum)){
 		dout_con<<"Not found"<<std::endl;
 		throw NotFoundException("seqnum not found in buffer");
 	}
-	BufferedPacket p = *r;
-	m_list.erase(r);
-	--m_list_size;
-	return p;
+	BufferedPacket *p = slot(seqnum);
+	slot(seqnum) = NULL;
+	--m_count;
+	// Move the ends of the buffer to the remaining packets
+	if(m_count != 0)
+	{
+		if(seqnum == m_first)
+			while(slot(m_first) == NULL)
+				m_first++;
+		if(seqnum == m_last)
+			while(slot(m_last) == NULL)
+				m_last--;
+	}
+	BufferedPacket result = *p;
+	delete p;
+	return result;
 }
 void ReliablePacketBuffer::insert(BufferedPacket &p)
 {
@@ -243,68 +262,72 @@ void ReliablePacketBuffer::insert(BufferedPacket &p)
 	assert(type == TYPE_RELIABLE);
 	u16 seqnum = readU16(&p.data[BASE_HEADER_SIZE+1]);
 
-	++m_list_size;
-	// Find the right place for the packet and insert it there
+	if(contains(seqnum))
+		throw AlreadyExistsException("Same seqnum in list");
+	if(!canInsert(seqnum))
+		throw BaseException("ReliablePacketBuffer: seqnum out of range");
 
-	// If list is empty, just add it
-	if(m_list.empty())
+	if(m_slots.empty())
+		m_slots.resize(RELIABLE_BUFFER_SIZE, NULL);
+
+	if(empty())
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
-	}
-	// Otherwise find the right place
-	std::list<BufferedPacket>::iterator i = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	for(; i != m_list.end(); ++i){
-		u16 s = readU16(&(i->data[BASE_HEADER_SIZE+1]));
-		if(s == seqnum){
-			--m_list_size;
-			throw AlreadyExistsException("Same seqnum in list");
-		}
-		if(seqnum_higher(s, seqnum)){
-			break;
-		}
+		m_first = seqnum;
+		m_last = seqnum;
 	}
-	// If we're at the end of the list, add the packet to the
-	// end of the list
-	if(i == m_list.end())
+	else
 	{
-		m_list.push_back(p);
-		// Done.
-		return;
+		if(seqnum_higher(m_first, seqnum))
+			m_first = seqnum;
+		if(seqnum_higher(seqnum, m_last))
+			m_last = seqnum;
 	}
-	// Insert before i
-	m_list.insert(i, p);
+	slot(seqnum) = new BufferedPacket(p);
+	++m_count;
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return;
+	for(u16 s = m_first; ; s++)
 	{
-		i->time += dtime;
-		i->totaltime += dtime;
+		BufferedPacket *p = slot(s);
+		if(p != NULL)
+		{
+			p->time += dtime;
+			p->totaltime += dtime;
+		}
+		if(s == m_last)
+			break;
 	}
 }
 
 void ReliablePacketBuffer::resetTimedOuts(float timeout)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return;
+	for(u16 s = m_first; ; s++)
 	{
-		if(i->time >= timeout)
-			i->time = 0.0;
+		BufferedPacket *p = slot(s);
+		if(p != NULL && p->time >= timeout)
+			p->time = 0.0;
+		if(s == m_last)
+			break;
 	}
 }
 
 bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 {
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return false;
+	for(u16 s = m_first; ; s++)
 	{
-		if(i->totaltime >= timeout)
+		BufferedPacket *p = slot(s);
+		if(p != NULL && p->totaltime >= timeout)
 			return true;
+		if(s == m_last)
+			break;
 	}
 	return false;
 }
@@ -312,11 +335,15 @@ bool ReliablePacketBuffer::anyTotaltimeReached(float timeout)
 std::list<BufferedPacket> ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	std::list<BufferedPacket> timed_outs;
-	for(std::list<BufferedPacket>::iterator i = m_list.begin();
-		i != m_list.end(); ++i)
+	if(empty())
+		return timed_outs;
+	for(u16 s = m_first; ; s++)
 	{
-		if(i->time >= timeout)
-			timed_outs.push_back(*i);
+		BufferedPacket *p = slot(s);
+		if(p != NULL && p->time >= timeout)
+			timed_outs.push_back(*p);
+		if(s == m_last)
+			break;
 	}
 	return timed_outs;
 }
@@ -446,11 +473,43 @@ Channel::Channel()
 	next_outgoing_seqnum = SEQNUM_INITIAL;
 	next_incoming_seqnum = SEQNUM_INITIAL;
 	next_outgoing_split_seqnum = SEQNUM_INITIAL;
+	window_size = RELIABLE_WINDOW_MIN;
 }
 Channel::~Channel()
 {
 }
 
+u16 Channel::getPacketsInFlight()
+{
+	u16 first;
+	if(!outgoing_reliables.getFirstSeqnum(&first))
+		return 0;
+	return next_outgoing_seqnum - first;
+}
+
+void Channel::reportAck(float rtt, float min_rtt, float aim_rtt,
+		float max_window)
+{
+	// Grow fast while the packets don't pile up in queues on the way
+	if(rtt - min_rtt < aim_rtt)
+		window_size += 1;
+	else
+		window_size += 1 / window_size;
+	if(window_size > max_window)
+		window_size = max_window;
+	if(window_size > RELIABLE_BUFFER_SIZE - 1)
+		window_size = RELIABLE_BUFFER_SIZE - 1;
+	if(window_size < RELIABLE_WINDOW_MIN)
+		window_size = RELIABLE_WINDOW_MIN;
+}
+
+void Channel::reportLoss()
+{
+	window_size /= 2;
+	if(window_size < RELIABLE_WINDOW_MIN)
+		window_size = RELIABLE_WINDOW_MIN;
+}
+
 /*
 	Peer
 */
@@ -462,14 +521,17 @@ Peer::Peer(u16 a_id, Address a_address):
 	ping_timer(0.0),
 	resend_timeout(0.5),
 	avg_rtt(-1.0),
+	min_rtt(-1.0),
 	has_sent_with_id(false),
 	m_sendtime_accu(0),
 	m_max_packets_per_second(10),
 	m_num_sent(0),
 	m_max_num_sent(0),
+	m_next_send_channel(0),
 	congestion_control_aim_rtt(0.2),
 	congestion_control_max_rate(400),
-	congestion_control_min_rate(10)
+	congestion_control_min_rate(10),
+	congestion_control_max_window(RELIABLE_WINDOW_MIN)
 {
 }
 Peer::~Peer()
@@ -479,10 +541,15 @@ Peer::~Peer()
 void Peer::reportRTT(float rtt)
 {
 	if(rtt >= 0.0){
-		if(rtt < 0.01){
+		if(min_rtt < 0.0 || rtt < min_rtt)
+			min_rtt = rtt;
+		// Only the time on top of the shortest round trip tells about
+		// congestion; a distant peer isn't congested just for being far
+		float delay = rtt - min_rtt;
+		if(delay < 0.01){
 			if(m_max_packets_per_second < congestion_control_max_rate)
 				m_max_packets_per_second += 10;
-		} else if(rtt < congestion_control_aim_rtt){
+		} else if(delay < congestion_control_aim_rtt){
 			if(m_max_packets_per_second < congestion_control_max_rate)
 				m_max_packets_per_second += 2;
 		} else {
@@ -517,6 +584,52 @@ void Peer::reportRTT(float rtt)
 	resend_timeout = timeout;
 }
 				
+/*
+	ConnectionReceiveThread
+*/
+
+class ConnectionReceiveThread : public SimpleThread
+{
+public:
+	ConnectionReceiveThread(Connection *con):
+		SimpleThread(),
+		m_con(con)
+	{
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+		log_register_thread("ConnectionReceive");
+
+		dout_con<<"Connection receive thread started"<<std::endl;
+
+		while(getRun())
+		{
+			BEGIN_DEBUG_EXCEPTION_HANDLER
+
+			// Wait for data without blocking the sending thread
+			if(m_con->m_socket.WaitData(50) == false)
+				continue;
+
+			{
+				JMutexAutoLock peerlock(m_con->m_peers_mutex);
+				m_con->receive();
+			}
+
+			// ACKs may have made room for more packets to be sent
+			m_con->wakeSendThread();
+
+			END_DEBUG_EXCEPTION_HANDLER(derr_con);
+		}
+
+		return NULL;
+	}
+
+private:
+	Connection *m_con;
+};
+
 /*
 	Connection
 */
@@ -532,9 +645,7 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_bc_receive_timeout(0),
 	m_indentation(0)
 {
-	m_socket.setTimeoutMs(5);
-
-	Start();
+	init();
 }
 
 Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
@@ -548,14 +659,29 @@ Connection::Connection(u32 protocol_id, u32 max_packet_size, float timeout,
 	m_bc_receive_timeout(0),
 	m_indentation(0)
 {
+	init();
+}
+
+void Connection::init()
+{
+	m_peers_mutex.Init();
+	m_send_wake_mutex.Init();
+	m_send_wake_pending = false;
+
 	m_socket.setTimeoutMs(5);
 
 	Start();
+	m_receive_thread = new ConnectionReceiveThread(this);
+	m_receive_thread->Start();
 }
 
 
 Connection::~Connection()
 {
+	m_receive_thread->stop();
+	delete m_receive_thread;
+	setRun(false);
+	wakeSendThread();
 	stop();
 	// Delete peers
 	for(std::map<u16, Peer*>::iterator
@@ -590,16 +716,26 @@ void * Connection::Thread()
 		if(dtime < 0.0)
 			dtime = 0.0;
 		
-		runTimeouts(dtime);
+		bool packets_left;
+		{
+			JMutexAutoLock peerlock(m_peers_mutex);
 
-		while(!m_command_queue.empty()){
-			ConnectionCommand c = m_command_queue.pop_front();
-			processCommand(c);
-		}
+			runTimeouts(dtime);
+
+			while(!m_command_queue.empty()){
+				ConnectionCommand c = m_command_queue.pop_front();
+				processCommand(c);
+			}
 
-		send(dtime);
+			packets_left = send(dtime);
+		}
 
-		receive();
+		{
+			JMutexAutoLock lock(m_send_wake_mutex);
+			m_send_wake_pending = false;
+		}
+		// Come back soon if the send rate is what holds packets back
+		m_send_event.wait(packets_left ? 1 : 5);
 		
 		END_DEBUG_EXCEPTION_HANDLER(derr_con);
 	}
@@ -647,8 +783,16 @@ void Connection::processCommand(ConnectionCommand &c)
 	}
 }
 
-void Connection::send(float dtime)
+/*
+	Sends the queued packets of the peers as far as their send rates and
+	reliable packet windows allow. The peers take turns one packet at a
+	time, so that a long queue of one peer doesn't hold up the others.
+	Returns true if packets were left in the queues.
+*/
+bool Connection::send(float dtime)
 {
+	std::list<Peer*> sending_peers;
+	bool packets_left = false;
 	for(std::map<u16, Peer*>::iterator
 			j = m_peers.begin();
 			j != m_peers.end(); ++j)
@@ -658,26 +802,19 @@ void Connection::send(float dtime)
 		peer->m_num_sent = 0;
 		peer->m_max_num_sent = peer->m_sendtime_accu *
 				peer->m_max_packets_per_second;
+		sending_peers.push_back(peer);
 	}
-	Queue<OutgoingPacket> postponed_packets;
-	while(!m_outgoing_queue.empty()){
-		OutgoingPacket packet = m_outgoing_queue.pop_front();
-		Peer *peer = getPeerNoEx(packet.peer_id);
-		if(!peer)
-			continue;
-		if(peer->channels[packet.channelnum].outgoing_reliables.size() >= 5){
-			postponed_packets.push_back(packet);
-		} else if(peer->m_num_sent < peer->m_max_num_sent){
-			rawSendAsPacket(packet.peer_id, packet.channelnum,
-					packet.data, packet.reliable);
-			peer->m_num_sent++;
-		} else {
-			postponed_packets.push_back(packet);
+	while(!sending_peers.empty()){
+		for(std::list<Peer*>::iterator
+				j = sending_peers.begin();
+				j != sending_peers.end();)
+		{
+			if(sendQueued(*j))
+				++j;
+			else
+				j = sending_peers.erase(j);
 		}
 	}
-	while(!postponed_packets.empty()){
-		m_outgoing_queue.push_back(postponed_packets.pop_front());
-	}
 	for(std::map<u16, Peer*>::iterator
 			j = m_peers.begin();
 			j != m_peers.end(); ++j)
@@ -687,7 +824,46 @@ void Connection::send(float dtime)
 				peer->m_max_packets_per_second;
 		if(peer->m_sendtime_accu > 10. / peer->m_max_packets_per_second)
 			peer->m_sendtime_accu = 10. / peer->m_max_packets_per_second;
+		for(u16 i=0; i<CHANNEL_COUNT; i++)
+		{
+			if(!peer->channels[i].queued_outgoing.empty())
+				packets_left = true;
+		}
+	}
+	return packets_left;
+}
+
+bool Connection::sendQueued(Peer *peer)
+{
+	if(peer->m_num_sent >= peer->m_max_num_sent)
+		return false;
+	// The channels take turns too
+	for(u16 i=0; i<CHANNEL_COUNT; i++)
+	{
+		u8 channelnum = (peer->m_next_send_channel + i) % CHANNEL_COUNT;
+		Channel *channel = &peer->channels[channelnum];
+		if(channel->queued_outgoing.empty())
+			continue;
+		if(channel->getPacketsInFlight() >= (u16)channel->window_size)
+			continue;
+		OutgoingPacket packet = channel->queued_outgoing.front();
+		channel->queued_outgoing.pop_front();
+		rawSendAsPacket(peer->id, channelnum, packet.data, packet.reliable);
+		peer->m_num_sent++;
+		peer->m_next_send_channel = (channelnum + 1) % CHANNEL_COUNT;
+		return true;
 	}
+	return false;
+}
+
+void Connection::wakeSendThread()
+{
+	JMutexAutoLock lock(m_send_wake_mutex);
+	// One pending signal is enough to make the thread run a round
+	if(m_send_wake_pending)
+		return;
+	m_send_wake_pending = true;
+	m_send_event.signal();
 }
 
 // Receive packets from the network and buffers and create ConnectionEvents
@@ -708,11 +884,13 @@ void Connection::receive()
 		{
 			u16 peer_id;
 			SharedBuffer<u8> resultdata;
-			bool got = getFromBuffers(peer_id, resultdata);
-			if(got){
-				ConnectionEvent e;
-				e.dataReceived(peer_id, resultdata);
-				putEvent(e);
+			bool got_data = false;
+			if(getFromBuffers(peer_id, resultdata, got_data)){
+				if(got_data){
+					ConnectionEvent e;
+					e.dataReceived(peer_id, resultdata);
+					putEvent(e);
+				}
 				continue;
 			}
 		}
@@ -739,7 +917,7 @@ void Connection::receive()
 		if(channelnum > CHANNEL_COUNT-1){
 			PrintInfo(derr_con);
 			derr_con<<"Receive(): Invalid channel "<<channelnum<<std::endl;
-			throw InvalidIncomingDataException("Channel doesn't exist");
+			continue;
 		}
 
 		if(peer_id == PEER_ID_INEXISTENT)
@@ -847,7 +1025,7 @@ void Connection::receive()
 			// and it is invalid.
 			PrintInfo(derr_con);
 			derr_con<<"Receive(): Peer not found"<<std::endl;
-			throw InvalidIncomingDataException("Peer not found (possible timeout)");
+			continue;
 		}
 
 		Peer *peer = node->second;
@@ -872,11 +1050,11 @@ void Connection::receive()
 		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
 				strippeddata.getSize());
 		
-		try{
-			// Process it (the result is some data with no headers made by us)
-			SharedBuffer<u8> resultdata = processPacket
-					(channel, strippeddata, peer_id, channelnum, false);
-			
+		// Process it (the result is some data with no headers made by us)
+		SharedBuffer<u8> resultdata;
+		if(processPacket(channel, strippeddata, peer_id, channelnum, false,
+				resultdata))
+		{
 			PrintInfo();
 			dout_con<<"ProcessPacket returned data of size "
 					<<resultdata.getSize()<<std::endl;
@@ -884,13 +1062,9 @@ void Connection::receive()
 			ConnectionEvent e;
 			e.dataReceived(peer_id, resultdata);
 			putEvent(e);
-			continue;
-		}catch(ProcessedSilentlyException &e){
 		}
 	}catch(InvalidIncomingDataException &e){
 	}
-	catch(ProcessedSilentlyException &e){
-	}
 	} // for
 }
 
@@ -902,6 +1076,8 @@ void Connection::runTimeouts(float dtime)
 			= g_settings->getFloat("congestion_control_max_rate");
 	float congestion_control_min_rate
 			= g_settings->getFloat("congestion_control_min_rate");
+	float congestion_control_max_window
+			= g_settings->getFloat("congestion_control_max_window");
 
 	std::list<u16> timeouted_peers;
 	for(std::map<u16, Peer*>::iterator j = m_peers.begin();
@@ -913,6 +1089,7 @@ void Connection::runTimeouts(float dtime)
 		peer->congestion_control_aim_rtt = congestion_control_aim_rtt;
 		peer->congestion_control_max_rate = congestion_control_max_rate;
 		peer->congestion_control_min_rate = congestion_control_min_rate;
+		peer->congestion_control_max_window = congestion_control_max_window;
 		
 		/*
 			Check peer timeout
@@ -965,6 +1142,9 @@ void Connection::runTimeouts(float dtime)
 
 			channel->outgoing_reliables.resetTimedOuts(resend_timeout);
 
+			if(!timed_outs.empty())
+				channel->reportLoss();
+
 			for(std::list<BufferedPacket>::iterator j = timed_outs.begin();
 				j != timed_outs.end(); ++j)
 			{
@@ -1121,8 +1301,11 @@ void Connection::send(u16 peer_id, u8 channelnum,
 void Connection::sendAsPacket(u16 peer_id, u8 channelnum,
 		SharedBuffer<u8> data, bool reliable)
 {
-	OutgoingPacket packet(peer_id, channelnum, data, reliable);
-	m_outgoing_queue.push_back(packet);
+	Peer *peer = getPeerNoEx(peer_id);
+	if(!peer)
+		return;
+	peer->channels[channelnum].queued_outgoing.push_back(
+			OutgoingPacket(data, reliable));
 }
 
 void Connection::rawSendAsPacket(u16 peer_id, u8 channelnum,
@@ -1221,7 +1404,8 @@ std::list<Peer*> Connection::getPeers()
 	return list;
 }
 
-bool Connection::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
+bool Connection::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst,
+		bool &got_data)
 {
 	for(std::map<u16, Peer*>::iterator j = m_peers.begin();
 		j != m_peers.end(); ++j)
@@ -1230,19 +1414,15 @@ bool Connection::getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst)
 		for(u16 i=0; i<CHANNEL_COUNT; i++)
 		{
 			Channel *channel = &peer->channels[i];
-			SharedBuffer<u8> resultdata;
-			bool got = checkIncomingBuffers(channel, peer_id, resultdata);
-			if(got){
-				dst = resultdata;
+			if(checkIncomingBuffers(channel, peer_id, dst, got_data))
 				return true;
-			}
 		}
 	}
 	return false;
 }
 
 bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
-		SharedBuffer<u8> &dst)
+		SharedBuffer<u8> &dst, bool &got_data)
 {
 	u16 firstseqnum = 0;
 	// Clear old packets from start of buffer
@@ -1281,16 +1461,18 @@ bool Connection::checkIncomingBuffers(Channel *channel, u16 &peer_id,
 			SharedBuffer<u8> payload(p.data.getSize() - headers_size);
 			memcpy(*payload, &p.data[headers_size], payload.getSize());
 
-			dst = processPacket(channel, payload, peer_id, channelnum, true);
+			// The peer may be gone after this, so return right away
+			got_data = processPacket(channel, payload, peer_id, channelnum,
+					true, dst);
 			return true;
 		}
 	}
 	return false;
 }
 
-SharedBuffer<u8> Connection::processPacket(Channel *channel,
+bool Connection::processPacket(Channel *channel,
 		SharedBuffer<u8> packetdata, u16 peer_id,
-		u8 channelnum, bool reliable)
+		u8 channelnum, bool reliable, SharedBuffer<u8> &dst)
 {
 	IndentationRaiser iraiser(&(m_indentation));
 
@@ -1318,7 +1500,35 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 					<<((int)channelnum&0xff)<<", peer_id="<<peer_id
 					<<", seqnum="<<seqnum<<std::endl;
 
-			try{
+			// Selective acknowledgement: drop whatever else the peer
+			// says it has, so that it isn't re-sent if its ACK got lost
+			if(packetdata.getSize() >= 10)
+			{
+				u16 next_seqnum = readU16(&packetdata[4]);
+				u32 received = readU32(&packetdata[6]);
+				u16 first;
+				if(channel->outgoing_reliables.getFirstSeqnum(&first))
+				{
+					// The acked packet itself is kept for the RTT below
+					for(u16 s=first; seqnum_higher(next_seqnum, s)
+							&& (u16)(s - first) < RELIABLE_BUFFER_SIZE; s++)
+					{
+						if(s != seqnum
+								&& channel->outgoing_reliables.contains(s))
+							channel->outgoing_reliables.popSeqnum(s);
+					}
+				}
+				for(u16 i=0; i<32; i++)
+				{
+					u16 s = next_seqnum + 1 + i;
+					if((received & ((u32)1 << i)) && s != seqnum
+							&& channel->outgoing_reliables.contains(s))
+						channel->outgoing_reliables.popSeqnum(s);
+				}
+			}
+
+			if(channel->outgoing_reliables.contains(seqnum))
+			{
 				BufferedPacket p = channel->outgoing_reliables.popSeqnum(seqnum);
 				// Get round trip time
 				float rtt = p.totaltime;
@@ -1327,6 +1537,9 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				// (avg_rtt and resend_timeout)
 				Peer *peer = getPeer(peer_id);
 				peer->reportRTT(rtt);
+				channel->reportAck(rtt, peer->min_rtt,
+						peer->congestion_control_aim_rtt,
+						peer->congestion_control_max_window);
 
 				//PrintInfo(dout_con);
 				//dout_con<<"RTT = "<<rtt<<std::endl;
@@ -1336,14 +1549,14 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				channel->outgoing_reliables.print();
 				dout_con<<std::endl;*/
 			}
-			catch(NotFoundException &e){
-				PrintInfo(derr_con);
-				derr_con<<"WARNING: ACKed packet not "
-						"in outgoing queue"
-						<<std::endl;
+			else
+			{
+				// Also happens when a selective ACK already removed it
+				PrintInfo();
+				dout_con<<"ACKed packet not in outgoing queue"<<std::endl;
 			}
 
-			throw ProcessedSilentlyException("Got an ACK");
+			return false;
 		}
 		else if(controltype == CONTROLTYPE_SET_PEER_ID)
 		{
@@ -1365,7 +1578,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				dout_con<<"changing."<<std::endl;
 				SetPeerID(peer_id_new);
 			}
-			throw ProcessedSilentlyException("Got a SET_PEER_ID");
+			return false;
 		}
 		else if(controltype == CONTROLTYPE_PING)
 		{
@@ -1373,7 +1586,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			// the timeout counter
 			PrintInfo();
 			dout_con<<"PING"<<std::endl;
-			throw ProcessedSilentlyException("Got a PING");
+			return false;
 		}
 		else if(controltype == CONTROLTYPE_DISCO)
 		{
@@ -1388,7 +1601,7 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 				derr_con<<"DISCO: Peer not found"<<std::endl;
 			}
 
-			throw ProcessedSilentlyException("Got a DISCO");
+			return false;
 		}
 		else{
 			PrintInfo(derr_con);
@@ -1408,7 +1621,8 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		// Get the inside packet out and return it
 		SharedBuffer<u8> payload(packetdata.getSize() - ORIGINAL_HEADER_SIZE);
 		memcpy(*payload, &packetdata[ORIGINAL_HEADER_SIZE], payload.getSize());
-		return payload;
+		dst = payload;
+		return true;
 	}
 	else if(type == TYPE_SPLIT)
 	{
@@ -1427,11 +1641,12 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 			PrintInfo();
 			dout_con<<"RETURNING TYPE_SPLIT: Constructed full data, "
 					<<"size="<<data.getSize()<<std::endl;
-			return data;
+			dst = data;
+			return true;
 		}
 		PrintInfo();
 		dout_con<<"BUFFERED TYPE_SPLIT"<<std::endl;
-		throw ProcessedSilentlyException("Buffered a split packet chunk");
+		return false;
 	}
 	else if(type == TYPE_RELIABLE)
 	{
@@ -1464,16 +1679,15 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 		//DEBUG
 		//assert(channel->incoming_reliables.size() < 100);
 
-		// Send a CONTROLTYPE_ACK
-		SharedBuffer<u8> reply(4);
-		writeU8(&reply[0], TYPE_CONTROL);
-		writeU8(&reply[1], CONTROLTYPE_ACK);
-		writeU16(&reply[2], seqnum);
-		rawSendAsPacket(peer_id, channelnum, reply, false);
-
 		//if(seqnum_higher(seqnum, channel->next_incoming_seqnum))
 		if(is_future_packet)
 		{
+			// Not acknowledged, so the peer will send it again later
+			if(!channel->incoming_reliables.canInsert(seqnum) ||
+					(u16)(seqnum - channel->next_incoming_seqnum)
+					>= RELIABLE_BUFFER_SIZE)
+				return false;
+
 			/*PrintInfo();
 			dout_con<<"Buffering reliable packet (seqnum="
 					<<seqnum<<")"<<std::endl;*/
@@ -1487,34 +1701,35 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 					GetProtocolID(),
 					peer_id,
 					channelnum);
-			try{
+			// It may have been re-sent because our ACK got lost
+			if(!channel->incoming_reliables.contains(seqnum))
 				channel->incoming_reliables.insert(packet);
-				
-				/*PrintInfo();
-				dout_con<<"INCOMING: ";
-				channel->incoming_reliables.print();
-				dout_con<<std::endl;*/
-			}
-			catch(AlreadyExistsException &e)
-			{
-			}
 
-			throw ProcessedSilentlyException("Buffered future reliable packet");
+			/*PrintInfo();
+			dout_con<<"INCOMING: ";
+			channel->incoming_reliables.print();
+			dout_con<<std::endl;*/
+
+			sendAck(peer_id, channelnum, channel, seqnum);
+			return false;
 		}
 		//else if(seqnum_higher(channel->next_incoming_seqnum, seqnum))
 		else if(is_old_packet)
 		{
+			// An old packet; the ACK probably got lost, so send it again
+			sendAck(peer_id, channelnum, channel, seqnum);
 			// An old packet, dump it
-			throw InvalidIncomingDataException("Got an old reliable packet");
+			return false;
 		}
 
 		channel->next_incoming_seqnum++;
+		sendAck(peer_id, channelnum, channel, seqnum);
 
 		// Get out the inside packet and re-process it
 		SharedBuffer<u8> payload(packetdata.getSize() - RELIABLE_HEADER_SIZE);
 		memcpy(*payload, &packetdata[RELIABLE_HEADER_SIZE], payload.getSize());
 
-		return processPacket(channel, payload, peer_id, channelnum, true);
+		return processPacket(channel, payload, peer_id, channelnum, true, dst);
 	}
 	else
 	{
@@ -1527,7 +1742,27 @@ SharedBuffer<u8> Connection::processPacket(Channel *channel,
 	// If you get here, add an exception or a return to some of the
 	// above conditionals.
 	assert(0);
-	throw BaseException("Error in Channel::ProcessPacket()");
+	return false;
+}
+
+void Connection::sendAck(u16 peer_id, u8 channelnum, Channel *channel,
+		u16 seqnum)
+{
+	u16 next_seqnum = channel->next_incoming_seqnum;
+	u32 received = 0;
+	for(u16 i=0; i<32; i++)
+	{
+		if(channel->incoming_reliables.contains(next_seqnum + 1 + i))
+			received |= (u32)1 << i;
+	}
+
+	SharedBuffer<u8> reply(10);
+	writeU8(&reply[0], TYPE_CONTROL);
+	writeU8(&reply[1], CONTROLTYPE_ACK);
+	writeU16(&reply[2], seqnum);
+	writeU16(&reply[4], next_seqnum);
+	writeU32(&reply[6], received);
+	rawSendAsPacket(peer_id, channelnum, reply, false);
 }
 
 bool Connection::deletePeer(u16 peer_id, bool timeout)
@@ -1561,18 +1796,16 @@ ConnectionEvent Connection::getEvent()
 
 ConnectionEvent Connection::waitEvent(u32 timeout_ms)
 {
-	try{
-		return m_event_queue.pop_front(timeout_ms);
-	} catch(ItemNotFoundException &ex){
-		ConnectionEvent e;
+	ConnectionEvent e;
+	if(!m_event_queue.pop_frontNoEx(e, timeout_ms))
 		e.type = CONNEVENT_NONE;
-		return e;
-	}
+	return e;
 }
 
 void Connection::putCommand(ConnectionCommand &c)
 {
 	m_command_queue.push_back(c);
+	wakeSendThread();
 }
 
 void Connection::Serve(unsigned short port)
@@ -1614,6 +1847,13 @@ void Connection::Disconnect()
 }
 
 u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
+{
+	if(!ReceiveNoEx(peer_id, data))
+		throw NoIncomingDataException("No incoming data");
+	return data.getSize();
+}
+
+bool Connection::ReceiveNoEx(u16 &peer_id, SharedBuffer<u8> &data)
 {
 	for(;;){
 		ConnectionEvent e = waitEvent(m_bc_receive_timeout);
@@ -1622,11 +1862,11 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 					<<e.describe()<<std::endl;
 		switch(e.type){
 		case CONNEVENT_NONE:
-			throw NoIncomingDataException("No incoming data");
+			return false;
 		case CONNEVENT_DATA_RECEIVED:
 			peer_id = e.peer_id;
 			data = SharedBuffer<u8>(e.data);
-			return e.data.getSize();
+			return true;
 		case CONNEVENT_PEER_ADDED: {
 			Peer tmp(e.peer_id, e.address);
 			if(m_bc_peerhandler)
@@ -1642,7 +1882,7 @@ u32 Connection::Receive(u16 &peer_id, SharedBuffer<u8> &data)
 					"(port already in use?)");
 		}
 	}
-	throw NoIncomingDataException("No incoming data");
+	return false;
 }
 
 void Connection::SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable)
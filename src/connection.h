@@ -31,6 +31,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include <list>
 #include <map>
+#include <vector>
 
 namespace con
 {
@@ -102,14 +103,6 @@ class NoIncomingDataException : public BaseException
 	{}
 };
 
-class ProcessedSilentlyException : public BaseException
-{
-public:
-	ProcessedSilentlyException(const char *s):
-		BaseException(s)
-	{}
-};
-
 #define SEQNUM_MAX 65535
 inline bool seqnum_higher(u16 higher, u16 lower)
 {
@@ -211,6 +204,9 @@ CONTROL: This is a packet used by the protocol.
 controltype and data description:
 	CONTROLTYPE_ACK
 		[2] u16 seqnum
+		Optional selective acknowledgement, ignored by older peers:
+		[4] u16 next_seqnum: every packet before this one has arrived
+		[6] u32 received: bit n is set if next_seqnum+1+n has arrived
 	CONTROLTYPE_SET_PEER_ID
 		[2] u16 peer_id_new
 	CONTROLTYPE_PING
@@ -265,21 +261,32 @@ with a buffer in the receiving and transmitting end.
 #define SEQNUM_INITIAL 65500
 
 /*
-	A buffer which stores reliable packets and sorts them internally
-	for fast access to the smallest one.
+	Limits of the number of reliable packets of a channel that can be
+	on the way at once. The window starts at the minimum and adapts to
+	the round trip time, see Channel.
 */
+#define RELIABLE_WINDOW_MIN 5
+// Must be a power of two
+#define RELIABLE_BUFFER_SIZE 1024
 
-typedef std::list<BufferedPacket>::iterator RPBSearchResult;
+/*
+	A buffer which stores reliable packets in a ring indexed by seqnum,
+	for fast access to any of them and to the smallest one.
+	The seqnums in the buffer must be less than RELIABLE_BUFFER_SIZE
+	apart.
+*/
 
 class ReliablePacketBuffer
 {
 public:
 	ReliablePacketBuffer();
+	~ReliablePacketBuffer();
 	void print();
 	bool empty();
 	u32 size();
-	RPBSearchResult findPacket(u16 seqnum);
-	RPBSearchResult notFound();
+	bool contains(u16 seqnum);
+	// Whether inserting the seqnum would keep the buffer in its size
+	bool canInsert(u16 seqnum);
 	bool getFirstSeqnum(u16 *result);
 	BufferedPacket popFirst();
 	BufferedPacket popSeqnum(u16 seqnum);
@@ -290,8 +297,20 @@ class ReliablePacketBuffer
 	std::list<BufferedPacket> getTimedOuts(float timeout);
 
 private:
-	std::list<BufferedPacket> m_list;
-	u16 m_list_size;
+	ReliablePacketBuffer(const ReliablePacketBuffer &);
+	ReliablePacketBuffer & operator=(const ReliablePacketBuffer &);
+
+	BufferedPacket * & slot(u16 seqnum)
+	{
+		return m_slots[seqnum & (RELIABLE_BUFFER_SIZE - 1)];
+	}
+
+	// Allocated on first insert; NULL for empty slots
+	std::vector<BufferedPacket*> m_slots;
+	// Smallest and largest seqnum in the buffer, if it isn't empty
+	u16 m_first;
+	u16 m_last;
+	u32 m_count;
 };
 
 /*
@@ -317,6 +336,18 @@ class IncomingSplitBuffer
 
 class Connection;
 
+struct OutgoingPacket
+{
+	SharedBuffer<u8> data;
+	bool reliable;
+
+	OutgoingPacket(SharedBuffer<u8> data_, bool reliable_):
+		data(data_),
+		reliable(reliable_)
+	{
+	}
+};
+
 struct Channel
 {
 	Channel();
@@ -334,6 +365,20 @@ struct Channel
 	ReliablePacketBuffer outgoing_reliables;
 
 	IncomingSplitBuffer incoming_splits;
+
+	/*
+		Number of reliable packets that may be on the way at once.
+		It grows as ACKs come in without the round trip time going
+		up, and is halved when packets have to be re-sent.
+	*/
+	float window_size;
+	// Number of reliable packets sent and not yet acknowledged
+	u16 getPacketsInFlight();
+	void reportAck(float rtt, float min_rtt, float aim_rtt, float max_window);
+	void reportLoss();
+
+	// Packets waiting for their turn to be sent, see Connection::send()
+	std::list<OutgoingPacket> queued_outgoing;
 };
 
 class Peer;
@@ -388,6 +433,9 @@ class Peer
 	float resend_timeout;
 	// Updated when an ACK is received
 	float avg_rtt;
+	// Shortest round trip time seen; the time above this is spent
+	// in queues
+	float min_rtt;
 	// This is set to true when the peer has actually sent something
 	// with the id we have given to it
 	bool has_sent_with_id;
@@ -396,11 +444,14 @@ class Peer
 	float m_max_packets_per_second;
 	int m_num_sent;
 	int m_max_num_sent;
+	// The channel that gets to send first on the next turn
+	u8 m_next_send_channel;
 
 	// Updated from configuration by Connection
 	float congestion_control_aim_rtt;
 	float congestion_control_max_rate;
 	float congestion_control_min_rate;
+	float congestion_control_max_window;
 private:
 };
 
@@ -408,23 +459,6 @@ class Peer
 	Connection
 */
 
-struct OutgoingPacket
-{
-	u16 peer_id;
-	u8 channelnum;
-	SharedBuffer<u8> data;
-	bool reliable;
-
-	OutgoingPacket(u16 peer_id_, u8 channelnum_, SharedBuffer<u8> data_,
-			bool reliable_):
-		peer_id(peer_id_),
-		channelnum(channelnum_),
-		data(data_),
-		reliable(reliable_)
-	{
-	}
-};
-
 enum ConnectionEventType{
 	CONNEVENT_NONE,
 	CONNEVENT_DATA_RECEIVED,
@@ -544,6 +578,13 @@ struct ConnectionCommand
 	}
 };
 
+class ConnectionReceiveThread;
+
+/*
+	The Connection thread itself runs the timeouts and the commands and
+	sends the queued packets; a ConnectionReceiveThread receives.
+	Both keep m_peers_mutex locked while touching the peers.
+*/
 class Connection: public SimpleThread
 {
 public:
@@ -564,7 +605,10 @@ class Connection: public SimpleThread
 	void Connect(Address address);
 	bool Connected();
 	void Disconnect();
+	// Throws NoIncomingDataException if nothing arrives in time
 	u32 Receive(u16 &peer_id, SharedBuffer<u8> &data);
+	// Returns false if nothing arrives in time
+	bool ReceiveNoEx(u16 &peer_id, SharedBuffer<u8> &data);
 	void SendToAll(u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void Send(u16 peer_id, u8 channelnum, SharedBuffer<u8> data, bool reliable);
 	void RunTimeouts(float dtime); // dummy
@@ -575,8 +619,9 @@ class Connection: public SimpleThread
 	
 private:
 	void putEvent(ConnectionEvent &e);
+	void init();
 	void processCommand(ConnectionCommand &c);
-	void send(float dtime);
+	bool send(float dtime);
 	void receive();
 	void runTimeouts(float dtime);
 	void serve(u16 port);
@@ -592,12 +637,13 @@ class Connection: public SimpleThread
 	Peer* getPeer(u16 peer_id);
 	Peer* getPeerNoEx(u16 peer_id);
 	std::list<Peer*> getPeers();
-	bool getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst);
-	// Returns next data from a buffer if possible
+	bool getFromBuffers(u16 &peer_id, SharedBuffer<u8> &dst,
+			bool &got_data);
+	// Processes the next packet from a buffer if possible
 	// If found, returns true; if not, false.
-	// If found, sets peer_id and dst
+	// If found, sets peer_id, and got_data tells if dst was set
 	bool checkIncomingBuffers(Channel *channel, u16 &peer_id,
-			SharedBuffer<u8> &dst);
+			SharedBuffer<u8> &dst, bool &got_data);
 	/*
 		Processes a packet with the basic header stripped out.
 		Parameters:
@@ -605,13 +651,30 @@ class Connection: public SimpleThread
 			peer_id: peer id of the sender of the packet in question
 			channelnum: channel on which the packet was sent
 			reliable: true if recursing into a reliable packet
+			dst: set to the data for the user, if there is any
+		Returns false if the packet was processed silently (ACKs, pings,
+		buffered chunks...). Throws InvalidIncomingDataException only on
+		malformed data.
 	*/
-	SharedBuffer<u8> processPacket(Channel *channel,
+	bool processPacket(Channel *channel,
 			SharedBuffer<u8> packetdata, u16 peer_id,
-			u8 channelnum, bool reliable);
+			u8 channelnum, bool reliable, SharedBuffer<u8> &dst);
 	bool deletePeer(u16 peer_id, bool timeout);
-	
-	Queue<OutgoingPacket> m_outgoing_queue;
+	// Sends the next queued packet of the peer if it is allowed to.
+	// Returns false if nothing could be sent.
+	bool sendQueued(Peer *peer);
+	// Makes the sending thread run a round without waiting for the timeout
+	void wakeSendThread();
+	// Acknowledges a reliable packet, along with the state of the channel
+	void sendAck(u16 peer_id, u8 channelnum, Channel *channel, u16 seqnum);
+
+	friend class ConnectionReceiveThread;
+	ConnectionReceiveThread *m_receive_thread;
+	// Signaled by wakeSendThread()
+	Event m_send_event;
+	bool m_send_wake_pending;
+	JMutex m_send_wake_mutex;
+
 	MutexedQueue<ConnectionEvent> m_event_queue;
 	MutexedQueue<ConnectionCommand> m_command_queue;
 	
@@ -71,13 +71,27 @@ void Database_Dummy::saveBlock(MapBlock *block)
 	// Write basic data
 	block->serialize(o, version, true);
 	// Write block to database
-	std::string tmp = o.str();
+	saveBlockData(p3d, o.str());
 
-	m_database[getBlockAsInteger(p3d)] = tmp;
 	// We just wrote it to the disk so clear modified flag
 	block->resetModified();
 }
 
+void Database_Dummy::saveBlockData(v3s16 blockpos, const std::string &data)
+{
+	m_database[getBlockAsInteger(blockpos)] = data;
+}
+
+bool Database_Dummy::loadBlockData(v3s16 blockpos, std::string &data)
+{
+	std::map<unsigned long long, std::string>::const_iterator
+			i = m_database.find(getBlockAsInteger(blockpos));
+	if(i == m_database.end())
+		return false;
+	data = i->second;
+	return true;
+}
+
 MapBlock* Database_Dummy::loadBlock(v3s16 blockpos)
 {
 	v2s16 p2d(blockpos.X, blockpos.Z);
@@ -33,7 +33,9 @@ class Database_Dummy : public Database
 	virtual void beginSave();
 	virtual void endSave();
         virtual void saveBlock(MapBlock *block);
+        virtual void saveBlockData(v3s16 blockpos, const std::string &data);
         virtual MapBlock* loadBlock(v3s16 blockpos);
+        virtual bool loadBlockData(v3s16 blockpos, std::string &data);
         virtual void listAllLoadableBlocks(std::list<v3s16> &dst);
         virtual int Initialized(void);
 	~Database_Dummy();
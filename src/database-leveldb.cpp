@@ -79,18 +79,39 @@ void Database_LevelDB::saveBlock(MapBlock *block)
 	// Write basic data
 	block->serialize(o, version, true);
 	// Write block to database
-	std::string tmp = o.str();
-
-	m_database->Put(leveldb::WriteOptions(), i64tos(getBlockAsInteger(p3d)), tmp);
+	saveBlockData(p3d, o.str());
 
 	// We just wrote it to the disk so clear modified flag
 	block->resetModified();
 }
 
+void Database_LevelDB::saveBlockData(v3s16 blockpos, const std::string &data)
+{
+	leveldb::Status status = m_database->Put(leveldb::WriteOptions(),
+			i64tos(getBlockAsInteger(blockpos)), data);
+	if(status.ok())
+		blockSaved(blockpos);
+}
+
+bool Database_LevelDB::loadBlockData(v3s16 blockpos, std::string &data)
+{
+	// Most blocks that are looked up have never been generated
+	if(!blockMayExist(blockpos))
+		return false;
+
+	leveldb::Status s = m_database->Get(leveldb::ReadOptions(),
+			i64tos(getBlockAsInteger(blockpos)), &data);
+	return s.ok();
+}
+
 MapBlock* Database_LevelDB::loadBlock(v3s16 blockpos)
 {
 	v2s16 p2d(blockpos.X, blockpos.Z);
 
+	// Most blocks that are looked up have never been generated
+	if(!blockMayExist(blockpos))
+		return NULL;
+
 	std::string datastr;
 	leveldb::Status s = m_database->Get(leveldb::ReadOptions(), i64tos(getBlockAsInteger(blockpos)), &datastr);
 
@@ -176,8 +176,6 @@ void Database_SQLite3::saveBlock(MapBlock *block)
 		[1] data
 	*/
 	
-	verifyDatabase();
-	
 	std::ostringstream o(std::ios_base::binary);
 	
 	o.write((char*)&version, 1);
@@ -186,29 +184,62 @@ void Database_SQLite3::saveBlock(MapBlock *block)
 	block->serialize(o, version, true);
 	
 	// Write block to database
+	saveBlockData(p3d, o.str());
 	
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
+	// We just wrote it to the disk so clear modified flag
+	block->resetModified();
+}
+
+void Database_SQLite3::saveBlockData(v3s16 blockpos, const std::string &data)
+{
+	verifyDatabase();
 	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
 		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)data.c_str(), data.size(), NULL) != SQLITE_OK)
 		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
 	int written = sqlite3_step(m_database_write);
+	if(written == SQLITE_DONE)
+		blockSaved(blockpos);
 	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
+		infostream<<"WARNING: Block failed to save ("<<blockpos.X<<", "<<blockpos.Y<<", "<<blockpos.Z<<") "
 		<<sqlite3_errmsg(m_database)<<std::endl;
 	// Make ready for later reuse
 	sqlite3_reset(m_database_write);
-	
-	// We just wrote it to the disk so clear modified flag
-	block->resetModified();
+}
+
+bool Database_SQLite3::loadBlockData(v3s16 blockpos, std::string &data)
+{
+	verifyDatabase();
+
+	// Most blocks that are looked up have never been generated
+	if(!blockMayExist(blockpos))
+		return false;
+
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW)
+	{
+		const char *blob = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		data.assign(blob, len);
+		found = true;
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+	return found;
 }
 
 MapBlock* Database_SQLite3::loadBlock(v3s16 blockpos)
 {
 	v2s16 p2d(blockpos.X, blockpos.Z);
         verifyDatabase();
+
+	// Most blocks that are looked up have never been generated
+	if(!blockMayExist(blockpos))
+		return NULL;
         
         if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
                 infostream<<"WARNING: Could not bind block position for load: "
@@ -325,6 +356,7 @@ void Database_SQLite3::listAllLoadableBlocks(std::list<v3s16> &dst)
 		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
 		dst.push_back(p);
 	}
+	sqlite3_reset(m_database_list);
 }
 
 Database_SQLite3::~Database_SQLite3()
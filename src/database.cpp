@@ -19,6 +19,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "database.h"
 #include "irrlichttypes.h"
+#include "log.h"
+#include "jthread/jmutexautolock.h"
+#include <ostream>
+
+// Bits per position and hash functions per position; this gives about
+// 1% of false positives at full capacity
+#define BLOCKPOSFILTER_BITS_PER_POS 10
+#define BLOCKPOSFILTER_NUM_HASHES 7
+// Smallest and largest capacity, in positions
+#define BLOCKPOSFILTER_MIN_CAPACITY 100000
+#define BLOCKPOSFILTER_MAX_CAPACITY 100000000
 
 static s32 unsignedToSigned(s32 i, s32 max_positive)
 {
@@ -50,3 +61,124 @@ v3s16 Database::getIntegerAsBlock(long long i) {
 	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
 	return v3s16(x,y,z);
 }
+
+BlockPosFilter::BlockPosFilter():
+	m_num_bits(0),
+	m_capacity(0)
+{
+}
+
+void BlockPosFilter::reset(u32 num_positions)
+{
+	if(num_positions < BLOCKPOSFILTER_MIN_CAPACITY)
+		num_positions = BLOCKPOSFILTER_MIN_CAPACITY;
+	if(num_positions > BLOCKPOSFILTER_MAX_CAPACITY)
+		num_positions = BLOCKPOSFILTER_MAX_CAPACITY;
+	m_capacity = num_positions;
+	m_num_bits = num_positions * BLOCKPOSFILTER_BITS_PER_POS;
+	m_bits.assign((m_num_bits + 31) / 32, 0);
+}
+
+// Spreads the bits of i over the whole 64-bit result (splitmix64)
+static u64 hashBlockInteger(s64 i)
+{
+	u64 h = (u64)i + 0x9E3779B97F4A7C15ULL;
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+	return h ^ (h >> 31);
+}
+
+void BlockPosFilter::insert(s64 i)
+{
+	if(m_num_bits == 0)
+		return;
+	u64 h = hashBlockInteger(i);
+	u32 h1 = h & 0xffffffff;
+	u32 h2 = (h >> 32) | 1;
+	for(u32 k = 0; k < BLOCKPOSFILTER_NUM_HASHES; k++)
+	{
+		u32 bit = (h1 + k * h2) % m_num_bits;
+		m_bits[bit / 32] |= 1U << (bit % 32);
+	}
+}
+
+bool BlockPosFilter::mayContain(s64 i) const
+{
+	if(m_num_bits == 0)
+		return true;
+	u64 h = hashBlockInteger(i);
+	u32 h1 = h & 0xffffffff;
+	u32 h2 = (h >> 32) | 1;
+	for(u32 k = 0; k < BLOCKPOSFILTER_NUM_HASHES; k++)
+	{
+		u32 bit = (h1 + k * h2) % m_num_bits;
+		if((m_bits[bit / 32] & (1U << (bit % 32))) == 0)
+			return false;
+	}
+	return true;
+}
+
+Database::Database():
+	m_exists_index_built(false),
+	m_exists_index_count(0)
+{
+	m_exists_index_mutex.Init();
+}
+
+void Database::buildExistsIndex()
+{
+	std::list<v3s16> blocks;
+	listAllLoadableBlocks(blocks);
+
+	// Leave room for as many new blocks as there are now
+	m_exists_index.clear();
+	m_exists_index.push_back(BlockPosFilter());
+	BlockPosFilter &filter = m_exists_index.back();
+	filter.reset(blocks.size() * 2);
+	for(std::list<v3s16>::iterator i = blocks.begin();
+			i != blocks.end(); ++i)
+		filter.insert(getBlockAsInteger(*i));
+	m_exists_index_count = blocks.size();
+	m_exists_index_built = true;
+
+	infostream<<"Database: Indexed "<<blocks.size()<<" blocks"<<std::endl;
+}
+
+void Database::blockSaved(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_exists_index_mutex);
+
+	if(!m_exists_index_built)
+		return;
+	/*
+		When the last filter is full, add a twice as large one instead
+		of rebuilding from a scan of the database. Positions saved
+		again are counted again, so this happens a bit early.
+	*/
+	if(m_exists_index_count >= m_exists_index.back().getCapacity())
+	{
+		u32 capacity = m_exists_index.back().getCapacity() * 2;
+		m_exists_index.push_back(BlockPosFilter());
+		m_exists_index.back().reset(capacity);
+		m_exists_index_count = 0;
+	}
+	m_exists_index.back().insert(getBlockAsInteger(blockpos));
+	m_exists_index_count++;
+}
+
+bool Database::blockMayExist(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_exists_index_mutex);
+
+	if(!m_exists_index_built)
+		buildExistsIndex();
+	s64 i = getBlockAsInteger(blockpos);
+	for(std::list<BlockPosFilter>::const_iterator
+			f = m_exists_index.begin();
+			f != m_exists_index.end(); ++f)
+	{
+		if(f->mayContain(i))
+			return true;
+	}
+	return false;
+}
@@ -21,22 +21,86 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define DATABASE_HEADER
 
 #include <list>
+#include <string>
+#include <vector>
 #include "irr_v3d.h"
+#include "irrlichttypes.h"
+#include "jthread/jmutex.h"
 
 class MapBlock;
 
+/*
+	Bloom filter of block positions.
+	It can tell for sure that a position has not been inserted;
+	a position that may have been inserted is occasionally reported
+	for one that hasn't.
+*/
+class BlockPosFilter
+{
+public:
+	BlockPosFilter();
+
+	// Clears the filter and sizes it for about num_positions positions
+	void reset(u32 num_positions);
+	void insert(s64 i);
+	// Returns false if i has surely not been inserted
+	bool mayContain(s64 i) const;
+
+	u32 getCapacity() const
+	{
+		return m_capacity;
+	}
+
+private:
+	std::vector<u32> m_bits;
+	u32 m_num_bits;
+	u32 m_capacity;
+};
+
 class Database
 {
 public:
+	Database();
+
 	virtual void beginSave()=0;
 	virtual void endSave()=0;
 
 	virtual void saveBlock(MapBlock *block)=0;
+	// Writes an already serialized block, including the version byte
+	virtual void saveBlockData(v3s16 blockpos, const std::string &data)=0;
 	virtual MapBlock* loadBlock(v3s16 blockpos)=0;
+	// Reads a block as written by saveBlockData(), without decoding it.
+	// Returns false if the block is not in the database.
+	virtual bool loadBlockData(v3s16 blockpos, std::string &data)=0;
 	long long getBlockAsInteger(const v3s16 pos);
 	v3s16 getIntegerAsBlock(long long i);
 	virtual void listAllLoadableBlocks(std::list<v3s16> &dst)=0;
 	virtual int Initialized(void)=0;
 	virtual ~Database() {};
+
+protected:
+	/*
+		In-memory index of the blocks in the database, so that blocks
+		that were never saved don't have to be looked up.
+		Backends call blockSaved() when saving a block and skip the
+		lookup when blockMayExist() returns false.
+		The index is built with listAllLoadableBlocks() on first use,
+		sized for twice the blocks there are. It is never rebuilt:
+		when it is full, another filter is added for the new blocks.
+		Both methods can be called from any thread.
+	*/
+	void blockSaved(v3s16 blockpos);
+	bool blockMayExist(v3s16 blockpos);
+
+private:
+	void buildExistsIndex();
+
+	// New positions are inserted to the last one
+	std::list<BlockPosFilter> m_exists_index;
+	bool m_exists_index_built;
+	// Number of positions inserted to the last filter
+	u32 m_exists_index_count;
+	// Protects the above
+	JMutex m_exists_index_mutex;
 };
 #endif
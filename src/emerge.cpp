@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "util/container.h"
 #include "util/thread.h"
+#include "util/workerpool.h"
 #include "main.h"
 #include "constants.h"
 #include "voxel.h"
@@ -57,7 +58,6 @@ class EmergeThread : public SimpleThread
 	int id;
 	
 	Event qevent;
-	std::queue<v3s16> blockqueue;
 	
 	EmergeThread(Server *server, int ethreadid):
 		SimpleThread(),
@@ -80,7 +80,6 @@ class EmergeThread : public SimpleThread
 		}
 	}
 
-	bool popBlockEmerge(v3s16 *pos, u8 *flags);
 	bool getBlockOrStartGen(v3s16 p, MapBlock **b,
 			BlockMakeData *data, bool allow_generate);
 };
@@ -131,6 +130,11 @@ EmergeManager::EmergeManager(IGameDef *gamedef) {
 		emergethread.push_back(new EmergeThread((Server *)gamedef, i));
 		
 	infostream << "EmergeManager: using " << nthreads << " threads" << std::endl;
+
+	u16 noise_threads = g_settings->getU16("mapgen_noise_threads");
+	noise_pool = new WorkerPool("MapgenNoise", noise_threads);
+	infostream << "EmergeManager: using " << noise_threads
+		<< " noise threads" << std::endl;
 }
 
 
@@ -143,8 +147,11 @@ EmergeManager::~EmergeManager() {
 		delete mapgen[i];
 	}
 	emergethread.clear();
+	idle_threads.clear();
 	mapgen.clear();
 
+	delete noise_pool;
+
 	for (unsigned int i = 0; i < ores.size(); i++)
 		delete ores[i];
 	ores.clear();
@@ -229,12 +236,30 @@ void EmergeManager::triggerAllThreads() {
 		emergethread[i]->trigger();
 }
 
+// Squared distance from p to the nearest of points, 0 if there are none
+static u32 getEmergePriority(const std::vector<v3s16> &points, v3s16 p) {
+	if (points.empty())
+		return 0;
+
+	u32 nearest = (u32)-1;
+	for (size_t i = 0; i != points.size(); i++) {
+		s32 dx = p.X - points[i].X;
+		s32 dy = p.Y - points[i].Y;
+		s32 dz = p.Z - points[i].Z;
+		u32 d = dx * dx + dy * dy + dz * dz;
+		if (d < nearest)
+			nearest = d;
+	}
+	return nearest;
+}
+
+
 bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate) {
 	std::map<v3s16, BlockEmergeData *>::const_iterator iter;
 	BlockEmergeData *bedata;
+	EmergeThread *idle_thread = NULL;
 	u16 count;
 	u8 flags = 0;
-	int idx = 0;
 	
 	if (allow_generate)
 		flags |= BLOCK_EMERGE_ALLOWGEN;
@@ -261,28 +286,103 @@ bool EmergeManager::enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate
 		bedata = new BlockEmergeData;
 		bedata->flags = flags;
 		bedata->peer_requested = peer_id;
+		bedata->priority = getEmergePriority(interest_points, p);
 		blocks_enqueued.insert(std::make_pair(p, bedata));
 		
 		peer_queue_count[peer_id] = count + 1;
 		
-		// insert into the EmergeThread queue with the least items
-		int lowestitems = emergethread[0]->blockqueue.size();
-		for (unsigned int i = 1; i != emergethread.size(); i++) {
-			int nitems = emergethread[i]->blockqueue.size();
-			if (nitems < lowestitems) {
-				idx = i;
-				lowestitems = nitems;
-			}
+		blockqueue.insert(std::make_pair(bedata->priority, p));
+
+		// The queue is shared, so wake up one idle thread to pick it up.
+		// Busy threads drain the queue before going idle.
+		if (!idle_threads.empty()) {
+			idle_thread = idle_threads.back();
+			idle_threads.pop_back();
 		}
-		
-		emergethread[idx]->blockqueue.push(p);
 	}
-	emergethread[idx]->qevent.signal();
+
+	if (idle_thread)
+		idle_thread->qevent.signal();
 	
 	return true;
 }
 
 
+// If the queue is empty, thread is marked idle and its qevent is
+// signaled once a block is enqueued
+bool EmergeManager::popBlockEmerge(v3s16 *pos, u8 *flags,
+		EmergeThread *thread) {
+	std::map<v3s16, BlockEmergeData *>::iterator iter;
+	JMutexAutoLock queuelock(queuemutex);
+
+	if (blockqueue.empty()) {
+		idle_threads.push_back(thread);
+		return false;
+	}
+	v3s16 p = blockqueue.begin()->second;
+	blockqueue.erase(blockqueue.begin());
+	
+	*pos = p;
+	
+	iter = blocks_enqueued.find(p);
+	if (iter == blocks_enqueued.end()) {
+		idle_threads.push_back(thread);
+		return false; //uh oh, queue and map out of sync!!
+	}
+
+	BlockEmergeData *bedata = iter->second;
+	*flags = bedata->flags;
+	
+	peer_queue_count[bedata->peer_requested]--;
+
+	delete bedata;
+	blocks_enqueued.erase(iter);
+	
+	return true;
+}
+
+
+/*
+	Sets the positions of the players and re-sorts the queue by them.
+	Blocks outside the cube of cancel_distance around every player are
+	dropped, nobody is going to see them anymore.
+*/
+void EmergeManager::updateInterestPoints(const std::vector<v3s16> &points,
+		s16 cancel_distance) {
+	JMutexAutoLock queuelock(queuemutex);
+
+	interest_points = points;
+	// Without players there is nothing to sort or cancel by
+	if (points.empty())
+		return;
+
+	// Clients request blocks in cubic shells, so compare against the
+	// sphere around the cube
+	u32 cancel_d_sq = 3 * (u32)cancel_distance * cancel_distance;
+	u32 ncancelled = 0;
+
+	blockqueue.clear();
+	std::map<v3s16, BlockEmergeData *>::iterator iter = blocks_enqueued.begin();
+	while (iter != blocks_enqueued.end()) {
+		BlockEmergeData *bedata = iter->second;
+		bedata->priority = getEmergePriority(points, iter->first);
+		if (bedata->priority > cancel_d_sq) {
+			peer_queue_count[bedata->peer_requested]--;
+			delete bedata;
+			blocks_enqueued.erase(iter++);
+			ncancelled++;
+			continue;
+		}
+		blockqueue.insert(std::make_pair(bedata->priority, iter->first));
+		++iter;
+	}
+
+	if (ncancelled != 0)
+		verbosestream << "EmergeManager: cancelled " << ncancelled
+			<< " far away blocks" << std::endl;
+}
+
+
 int EmergeManager::getGroundLevelAtPoint(v2s16 p) {
 	if (mapgen.size() == 0 || !mapgen[0]) {
 		errorstream << "EmergeManager: getGroundLevelAtPoint() called"
@@ -384,36 +484,23 @@ void EmergeManager::registerMapgen(std::string mgname, MapgenFactory *mgfactory)
 
 ////////////////////////////// Emerge Thread ////////////////////////////////// 
 
-bool EmergeThread::popBlockEmerge(v3s16 *pos, u8 *flags) {
-	std::map<v3s16, BlockEmergeData *>::iterator iter;
-	JMutexAutoLock queuelock(emerge->queuemutex);
-
-	if (blockqueue.empty())
-		return false;
-	v3s16 p = blockqueue.front();
-	blockqueue.pop();
-	
-	*pos = p;
-	
-	iter = emerge->blocks_enqueued.find(p);
-	if (iter == emerge->blocks_enqueued.end()) 
-		return false; //uh oh, queue and map out of sync!!
-
-	BlockEmergeData *bedata = iter->second;
-	*flags = bedata->flags;
-	
-	emerge->peer_queue_count[bedata->peer_requested]--;
-
-	delete bedata;
-	emerge->blocks_enqueued.erase(iter);
-	
-	return true;
-}
-
-
 bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b, 
 									BlockMakeData *data, bool allow_gen) {
 	v2s16 p2d(p.X, p.Z);
+	MapBlock *block;
+	{
+		JMutexAutoLock envlock(m_server->m_env_mutex);
+		block = map->getBlockNoCreateNoEx(p);
+		if (block && !block->isDummy() && block->isGenerated()) {
+			*b = block;
+			return false;
+		}
+	}
+
+	// Read and decode the block without holding up everything else
+	EMERGE_DBG_OUT("not in memory, attempting to load from disk");
+	MapBlock *loaded = map->loadBlockDetached(p);
+
 	//envlock: usually takes <=1ms, sometimes 90ms or ~400ms to acquire
 	JMutexAutoLock envlock(m_server->m_env_mutex); 
 	
@@ -421,11 +508,13 @@ bool EmergeThread::getBlockOrStartGen(v3s16 p, MapBlock **b,
 	if (map->getSectorNoGenerateNoEx(p2d) == NULL)
 		map->loadSectorMeta(p2d);
 
-	// Attempt to load block
-	MapBlock *block = map->getBlockNoCreateNoEx(p);
-	if (!block || block->isDummy() || !block->isGenerated()) {
-		EMERGE_DBG_OUT("not in memory, attempting to load from disk");
-		block = map->loadBlock(p);
+	if (loaded) {
+		block = map->insertLoadedBlock(loaded);
+	} else {
+		// It may have been generated while the lock was released
+		block = map->getBlockNoCreateNoEx(p);
+		if (!block || block->isDummy() || !block->isGenerated())
+			block = map->loadBlockFromFiles(p);
 	}
 
 	// If could not load and allowed to generate,
@@ -458,7 +547,7 @@ void *EmergeThread::Thread() {
 	
 	while (getRun())
 	try {
-		if (!popBlockEmerge(&p, &flags)) {
+		if (!emerge->popBlockEmerge(&p, &flags, this)) {
 			qevent.wait();
 			continue;
 		}
@@ -21,6 +21,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define EMERGE_HEADER
 
 #include <map>
+#include <set>
+#include <vector>
 #include "irr_v3d.h"
 #include "util/container.h"
 #include "map.h" // for ManualMapVoxelManipulator
@@ -46,6 +48,7 @@ class Decoration;
 class Ore;
 class INodeDefManager;
 class Settings;
+class WorkerPool;
 
 struct BlockMakeData {
 	ManualMapVoxelManipulator *vmanip;
@@ -68,6 +71,8 @@ struct BlockMakeData {
 struct BlockEmergeData {
 	u16 peer_requested;
 	u8 flags;
+	// Squared distance in blocks to the nearest player; lowest goes first
+	u32 priority;
 };
 
 class IBackgroundBlockEmerger
@@ -86,6 +91,8 @@ class EmergeManager : public IBackgroundBlockEmerger {
 	
 	std::vector<Mapgen *> mapgen;
 	std::vector<EmergeThread *> emergethread;
+	// Shared by the mapgens for computing noise octaves concurrently
+	WorkerPool *noise_pool;
 	
 	//settings
 	MapgenParams *params;
@@ -101,7 +108,13 @@ class EmergeManager : public IBackgroundBlockEmerger {
 	//block emerge queue data structures
 	JMutex queuemutex;
 	std::map<v3s16, BlockEmergeData *> blocks_enqueued;
+	// Shared by all emerge threads, ordered by (priority, position)
+	std::set<std::pair<u32, v3s16> > blockqueue;
 	std::map<u16, u16> peer_queue_count;
+	// Block positions of the players, used for the priorities
+	std::vector<v3s16> interest_points;
+	// Emerge threads waiting for the queue to fill up
+	std::vector<EmergeThread *> idle_threads;
 
 	//Mapgen-related structures
 	BiomeDefManager *biomedef;
@@ -118,6 +131,9 @@ class EmergeManager : public IBackgroundBlockEmerger {
 	MapgenParams *createMapgenParams(std::string mgname);
 	void triggerAllThreads();
 	bool enqueueBlockEmerge(u16 peer_id, v3s16 p, bool allow_generate);
+	bool popBlockEmerge(v3s16 *pos, u8 *flags, EmergeThread *thread);
+	void updateInterestPoints(const std::vector<v3s16> &points,
+			s16 cancel_distance);
 	
 	void registerMapgen(std::string name, MapgenFactory *mgfactory);
 	MapgenParams *getParamsFromSettings(Settings *settings);
@@ -42,6 +42,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "emerge.h"
 #include "util/serialize.h"
+#include "playerdatabase.h"
+#include "noise.h"
+#include "util/workerpool.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -303,6 +306,101 @@ void ActiveBlockList::update(std::list<v3s16> &active_positions,
 	}
 }
 
+/*
+	ActiveObjectIndex
+*/
+
+v3s16 ActiveObjectIndex::getBucketPos(v3f pos)
+{
+	// Objects can wander outside the map; clamp so that the conversion
+	// to v3s16 can't overflow. Clamping keeps the mapping monotonic, so
+	// query areas still cover every object that can be in range.
+	f32 limit = MAP_GENERATION_LIMIT * BS;
+	pos.X = rangelim(pos.X, -limit, limit);
+	pos.Y = rangelim(pos.Y, -limit, limit);
+	pos.Z = rangelim(pos.Z, -limit, limit);
+	return getNodeBlockPos(floatToInt(pos, BS));
+}
+
+void ActiveObjectIndex::insert(u16 id, v3f pos)
+{
+	v3s16 bp = getBucketPos(pos);
+	m_object_blocks[id] = bp;
+	m_blocks[bp].insert(id);
+}
+
+void ActiveObjectIndex::remove(u16 id)
+{
+	std::map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if(n == m_object_blocks.end())
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(n->second);
+	if(b != m_blocks.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_blocks.erase(b);
+	}
+	m_object_blocks.erase(n);
+}
+
+void ActiveObjectIndex::update(u16 id, v3f pos)
+{
+	std::map<u16, v3s16>::iterator n = m_object_blocks.find(id);
+	if(n == m_object_blocks.end())
+		return;
+	v3s16 bp = getBucketPos(pos);
+	if(bp == n->second)
+		return;
+	std::map<v3s16, std::set<u16> >::iterator b = m_blocks.find(n->second);
+	if(b != m_blocks.end()){
+		b->second.erase(id);
+		if(b->second.empty())
+			m_blocks.erase(b);
+	}
+	n->second = bp;
+	m_blocks[bp].insert(id);
+}
+
+void ActiveObjectIndex::getObjectsNear(v3f pos, f32 radius,
+		std::vector<u16> &result)
+{
+	v3f r(radius, radius, radius);
+	v3s16 minp = getBucketPos(pos - r);
+	v3s16 maxp = getBucketPos(pos + r);
+
+	/*
+		For huge radii, checking every occupied bucket is cheaper than
+		looking up every bucket position in the area.
+	*/
+	f32 area_volume = (f32)(maxp.X - minp.X + 1)
+			* (f32)(maxp.Y - minp.Y + 1)
+			* (f32)(maxp.Z - minp.Z + 1);
+	if(area_volume > (f32)m_blocks.size())
+	{
+		for(std::map<v3s16, std::set<u16> >::iterator
+				i = m_blocks.begin(); i != m_blocks.end(); ++i)
+		{
+			v3s16 p = i->first;
+			if(p.X < minp.X || p.Y < minp.Y || p.Z < minp.Z ||
+					p.X > maxp.X || p.Y > maxp.Y || p.Z > maxp.Z)
+				continue;
+			result.insert(result.end(), i->second.begin(), i->second.end());
+		}
+		return;
+	}
+
+	v3s16 p;
+	for(p.X = minp.X; p.X <= maxp.X; p.X++)
+	for(p.Y = minp.Y; p.Y <= maxp.Y; p.Y++)
+	for(p.Z = minp.Z; p.Z <= maxp.Z; p.Z++)
+	{
+		std::map<v3s16, std::set<u16> >::iterator i = m_blocks.find(p);
+		if(i == m_blocks.end())
+			continue;
+		result.insert(result.end(), i->second.begin(), i->second.end());
+	}
+}
+
 /*
 	ServerEnvironment
 */
@@ -320,9 +418,18 @@ ServerEnvironment::ServerEnvironment(ServerMap *map,
 	m_game_time(0),
 	m_game_time_fraction_counter(0),
 	m_recommended_send_interval(0.1),
-	m_max_lag_estimate(0.1)
+	m_max_lag_estimate(0.1),
+	m_player_database(NULL),
+	m_dedicated_server_step(g_settings,
+			"dedicated_server_step", &Settings::getFloat),
+	m_active_block_range(g_settings,
+			"active_block_range", &Settings::getS16),
+	m_max_objects_per_block(g_settings,
+			"max_objects_per_block", &Settings::getU16)
 {
 	m_use_weather = g_settings->getBool("weather");
+	m_abm_pool = new WorkerPool("ABMScan",
+			g_settings->getU16("abm_threads"));
 }
 
 ServerEnvironment::~ServerEnvironment()
@@ -337,6 +444,10 @@ ServerEnvironment::~ServerEnvironment()
 	// Drop/delete map
 	m_map->drop();
 
+	delete m_player_database;
+
+	delete m_abm_pool;
+
 	// Delete ActiveBlockModifiers
 	for(std::list<ABMWithState>::iterator
 			i = m_abms.begin(); i != m_abms.end(); ++i){
@@ -378,184 +489,72 @@ bool ServerEnvironment::line_of_sight(v3f pos1, v3f pos2, float stepsize)
 	return true;
 }
 
-void ServerEnvironment::serializePlayers(const std::string &savedir)
+PlayerDatabase * ServerEnvironment::getPlayerDatabase(const std::string &savedir)
 {
-	std::string players_path = savedir + "/players";
-	fs::CreateDir(players_path);
+	if(m_player_database)
+		return m_player_database;
 
-	std::set<Player*> saved_players;
-
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
-	{
-		if(player_files[i].dir || player_files[i].name[0] == '.')
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
-
-		//infostream<<"Checking player file "<<path<<std::endl;
-
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is, player_files[i].name);
-		}
-
-		//infostream<<"Loaded test player with name "<<testplayer.getName()<<std::endl;
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		if(player == NULL)
-		{
-			infostream<<"Didn't find matching player, ignoring file "<<path<<std::endl;
-			continue;
-		}
-
-		//infostream<<"Found matching player, overwriting."<<std::endl;
+	std::string backend = getPlayerDatabaseBackend(savedir);
+	m_player_database = createPlayerDatabase(backend, savedir, m_gamedef);
+	if(m_player_database == NULL)
+		throw BaseException("Unknown player backend");
+	return m_player_database;
+}
 
-		// OK, found. Save player there.
-		if(player->checkModified())
-		{
-			// Open file and serialize
-			std::ostringstream ss(std::ios_base::binary);
-			player->serialize(ss);
-			if(!fs::safeWriteToFile(path, ss.str()))
-			{
-				infostream<<"Failed to write "<<path<<std::endl;
-				continue;
-			}
-			saved_players.insert(player);
-		} else {
-			saved_players.insert(player);
-		}
-	}
+void ServerEnvironment::serializePlayers(const std::string &savedir)
+{
+	PlayerDatabase *db = getPlayerDatabase(savedir);
 
+	db->beginSave();
 	for(std::list<Player*>::iterator i = m_players.begin();
 			i != m_players.end(); ++i)
 	{
 		Player *player = *i;
-		if(saved_players.find(player) != saved_players.end())
-		{
-			/*infostream<<"Player "<<player->getName()
-					<<" was already saved."<<std::endl;*/
-			continue;
-		}
 		std::string playername = player->getName();
 		// Don't save unnamed player
 		if(playername == "")
-		{
-			//infostream<<"Not saving unnamed player."<<std::endl;
 			continue;
-		}
-		/*
-			Find a sane filename
-		*/
-		if(string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
-			playername = "player";
-		std::string path = players_path + "/" + playername;
-		bool found = false;
-		for(u32 i=0; i<1000; i++)
-		{
-			if(fs::PathExists(path) == false)
-			{
-				found = true;
-				break;
-			}
-			path = players_path + "/" + playername + itos(i);
-		}
-		if(found == false)
-		{
-			infostream<<"Didn't find free file for player"<<std::endl;
+		// Only write players that have changed since the last save
+		bool modified = player->checkModified();
+		if(!modified && db->playerExists(playername))
 			continue;
-		}
-
-		{
-			/*infostream<<"Saving player "<<player->getName()<<" to "
-					<<path<<std::endl;*/
-			// Open file and serialize
-			std::ostringstream ss(std::ios_base::binary);
-			player->serialize(ss);
-			if(!fs::safeWriteToFile(path, ss.str()))
-			{
-				infostream<<"Failed to write "<<path<<std::endl;
-				continue;
-			}
-			saved_players.insert(player);
-		}
+		db->savePlayer(player);
 	}
-
-	//infostream<<"Saved "<<saved_players.size()<<" players."<<std::endl;
+	db->endSave();
 }
 
 void ServerEnvironment::deSerializePlayers(const std::string &savedir)
 {
-	std::string players_path = savedir + "/players";
+	PlayerDatabase *db = getPlayerDatabase(savedir);
 
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
+	std::list<std::string> names;
+	db->listPlayers(names);
+	for(std::list<std::string>::iterator i = names.begin();
+			i != names.end(); ++i)
 	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
-
-		//infostream<<"Checking player file "<<path<<std::endl;
-
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is, player_files[i].name);
-		}
+		std::string playername = *i;
 
-		if(!string_allowed(testplayer.getName(), PLAYERNAME_ALLOWED_CHARS))
+		if(!string_allowed(playername, PLAYERNAME_ALLOWED_CHARS))
 		{
 			infostream<<"Not loading player with invalid name: "
-					<<testplayer.getName()<<std::endl;
+					<<playername<<std::endl;
 		}
 
-		/*infostream<<"Loaded test player with name "<<testplayer.getName()
-				<<std::endl;*/
-		
 		// Search for the player
-		std::string playername = testplayer.getName();
 		Player *player = getPlayer(playername.c_str());
 		bool newplayer = false;
 		if(player == NULL)
 		{
-			//infostream<<"Is a new player"<<std::endl;
 			player = new RemotePlayer(m_gamedef);
 			newplayer = true;
 		}
 
-		// Load player
+		verbosestream<<"Reading player "<<playername<<std::endl;
+		if(!db->loadPlayer(playername, player))
 		{
-			verbosestream<<"Reading player "<<testplayer.getName()<<" from "
-					<<path<<std::endl;
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			player->deSerialize(is, player_files[i].name);
+			if(newplayer)
+				delete player;
+			continue;
 		}
 
 		if(newplayer)
@@ -636,16 +635,26 @@ struct ActiveABM
 	std::set<content_t> required_neighbors;
 };
 
+struct ABMTrigger
+{
+	ActiveBlockModifier *abm;
+	v3s16 p;
+	MapNode n;
+};
+
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
-	std::map<content_t, std::list<ActiveABM> > m_aabms;
+	// Indexed by content_t; NULL for contents that trigger nothing
+	std::vector<std::vector<ActiveABM> *> m_aabms;
+	bool m_aabms_empty;
 public:
 	ABMHandler(std::list<ABMWithState> &abms,
 			float dtime_s, ServerEnvironment *env,
 			bool use_timers):
-		m_env(env)
+		m_env(env),
+		m_aabms_empty(true)
 	{
 		if(dtime_s < 0.001)
 			return;
@@ -695,21 +704,59 @@ class ABMHandler
 						k != ids.end(); k++)
 				{
 					content_t c = *k;
-					std::map<content_t, std::list<ActiveABM> >::iterator j;
-					j = m_aabms.find(c);
-					if(j == m_aabms.end()){
-						std::list<ActiveABM> aabmlist;
-						m_aabms[c] = aabmlist;
-						j = m_aabms.find(c);
-					}
-					j->second.push_back(aabm);
+					if(c >= m_aabms.size())
+						m_aabms.resize(c + 1, NULL);
+					if(m_aabms[c] == NULL)
+						m_aabms[c] = new std::vector<ActiveABM>;
+					m_aabms[c]->push_back(aabm);
+					m_aabms_empty = false;
 				}
 			}
 		}
 	}
-	void apply(MapBlock *block)
+	~ABMHandler()
+	{
+		for(u32 i = 0; i < m_aabms.size(); i++)
+			delete m_aabms[i];
+	}
+	// Whether any of the contents of the block triggers something
+	bool blockMayTrigger(MapBlock *block)
 	{
-		if(m_aabms.empty())
+		const std::vector<content_t> &contents = block->getContents();
+		for(std::vector<content_t>::const_iterator
+				i = contents.begin(); i != contents.end(); ++i)
+		{
+			if(*i < m_aabms.size() && m_aabms[*i] != NULL)
+				return true;
+		}
+		return false;
+	}
+	static bool blockContainsAny(MapBlock *block,
+			const std::set<content_t> &ids)
+	{
+		const std::vector<content_t> &contents = block->getContents();
+		for(std::vector<content_t>::const_iterator
+				i = contents.begin(); i != contents.end(); ++i)
+		{
+			if(ids.find(*i) != ids.end())
+				return true;
+		}
+		return false;
+	}
+	/*
+		Finds the nodes of the block whose ABMs pass the chance and
+		neighbor checks, without calling the ABMs.
+		Only reads the map, so different blocks can be scanned by
+		several threads at once.
+	*/
+	void scan(MapBlock *block, PseudoRandom &pr,
+			std::vector<ABMTrigger> &dst)
+	{
+		if(m_aabms_empty)
+			return;
+
+		// Most blocks contain nothing that any ABM is interested in
+		if(block->isDummy() || !blockMayTrigger(block))
 			return;
 
 		ServerMap *map = &m_env->getServerMap();
@@ -719,24 +766,31 @@ class ABMHandler
 		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
 		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
 		{
-			MapNode n = block->getNodeNoEx(p0);
+			MapNode n = block->getNodeNoCheck(p0);
 			content_t c = n.getContent();
 			v3s16 p = p0 + block->getPosRelative();
 
-			std::map<content_t, std::list<ActiveABM> >::iterator j;
-			j = m_aabms.find(c);
-			if(j == m_aabms.end())
+			if(c >= m_aabms.size() || m_aabms[c] == NULL)
 				continue;
 
-			for(std::list<ActiveABM>::iterator
-					i = j->second.begin(); i != j->second.end(); i++)
+			// Neighbors of nodes not on the border are in this block
+			bool inner = (p0.X > 0 && p0.X < MAP_BLOCKSIZE-1
+					&& p0.Y > 0 && p0.Y < MAP_BLOCKSIZE-1
+					&& p0.Z > 0 && p0.Z < MAP_BLOCKSIZE-1);
+
+			std::vector<ActiveABM> &aabms = *m_aabms[c];
+			for(std::vector<ActiveABM>::iterator
+					i = aabms.begin(); i != aabms.end(); i++)
 			{
-				if(myrand() % i->chance != 0)
+				if(pr.next() % i->chance != 0)
 					continue;
 
 				// Check neighbors
 				if(!i->required_neighbors.empty())
 				{
+					if(inner && !blockContainsAny(block,
+							i->required_neighbors))
+						continue;
 					v3s16 p1;
 					for(p1.X = p.X-1; p1.X <= p.X+1; p1.X++)
 					for(p1.Y = p.Y-1; p1.Y <= p.Y+1; p1.Y++)
@@ -744,7 +798,9 @@ class ABMHandler
 					{
 						if(p1 == p)
 							continue;
-						MapNode n = map->getNodeNoEx(p1);
+						MapNode n = inner ?
+								block->getNodeNoCheck(p1 - block->getPosRelative()) :
+								map->getNodeNoEx(p1);
 						content_t c = n.getContent();
 						std::set<content_t>::const_iterator k;
 						k = i->required_neighbors.find(c);
@@ -757,36 +813,84 @@ class ABMHandler
 				}
 neighbor_found:
 
-				// Find out how many objects the block contains
-				u32 active_object_count = block->m_static_objects.m_active.size();
-				// Find out how many objects this and all the neighbors contain
-				u32 active_object_count_wider = 0;
-				u32 wider_unknown_count = 0;
-				for(s16 x=-1; x<=1; x++)
-				for(s16 y=-1; y<=1; y++)
-				for(s16 z=-1; z<=1; z++)
-				{
-					MapBlock *block2 = map->getBlockNoCreateNoEx(
-							block->getPos() + v3s16(x,y,z));
-					if(block2==NULL){
-						wider_unknown_count = 0;
-						continue;
-					}
-					active_object_count_wider +=
-							block2->m_static_objects.m_active.size()
-							+ block2->m_static_objects.m_stored.size();
+				ABMTrigger t;
+				t.abm = i->abm;
+				t.p = p;
+				t.n = n;
+				dst.push_back(t);
+			}
+		}
+	}
+	// Calls the ABMs found by scan(). Must be done in the server thread.
+	void trigger(MapBlock *block, const std::vector<ABMTrigger> &triggers)
+	{
+		ServerMap *map = &m_env->getServerMap();
+
+		for(std::vector<ABMTrigger>::const_iterator
+				i = triggers.begin(); i != triggers.end(); ++i)
+		{
+			// An earlier ABM may have changed the node
+			MapNode n = map->getNodeNoEx(i->p);
+			if(n.getContent() != i->n.getContent())
+				continue;
+
+			// Find out how many objects the block contains
+			u32 active_object_count = block->m_static_objects.m_active.size();
+			// Find out how many objects this and all the neighbors contain
+			u32 active_object_count_wider = 0;
+			u32 wider_unknown_count = 0;
+			for(s16 x=-1; x<=1; x++)
+			for(s16 y=-1; y<=1; y++)
+			for(s16 z=-1; z<=1; z++)
+			{
+				MapBlock *block2 = map->getBlockNoCreateNoEx(
+						block->getPos() + v3s16(x,y,z));
+				if(block2==NULL){
+					wider_unknown_count = 0;
+					continue;
 				}
-				// Extrapolate
-				u32 wider_known_count = 3*3*3 - wider_unknown_count;
-				active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
-				
-				// Call all the trigger variations
-				i->abm->trigger(m_env, p, n);
-				i->abm->trigger(m_env, p, n,
-						active_object_count, active_object_count_wider);
+				active_object_count_wider +=
+						block2->m_static_objects.m_active.size()
+						+ block2->m_static_objects.m_stored.size();
 			}
+			// Extrapolate
+			u32 wider_known_count = 3*3*3 - wider_unknown_count;
+			active_object_count_wider += wider_unknown_count * active_object_count_wider / wider_known_count;
+			
+			// Call all the trigger variations
+			i->abm->trigger(m_env, i->p, n);
+			i->abm->trigger(m_env, i->p, n,
+					active_object_count, active_object_count_wider);
 		}
 	}
+	void apply(MapBlock *block)
+	{
+		PseudoRandom pr(myrand());
+		std::vector<ABMTrigger> triggers;
+		scan(block, pr, triggers);
+		trigger(block, triggers);
+	}
+};
+
+class ABMScanJob : public WorkerPoolJob
+{
+public:
+	ABMScanJob(ABMHandler *handler, MapBlock *block, int seed):
+		handler(handler),
+		block(block),
+		pr(seed)
+	{}
+
+	void run()
+	{
+		handler->scan(block, pr, triggers);
+	}
+
+	ABMHandler *handler;
+	MapBlock *block;
+	PseudoRandom pr;
+	// Result
+	std::vector<ABMTrigger> triggers;
 };
 
 void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
@@ -815,6 +919,8 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 		m_map->updateBlockHeat(this, block->getPos() *  MAP_BLOCKSIZE, block);
 		m_map->updateBlockHumidity(this, block->getPos() * MAP_BLOCKSIZE, block);
 	} else {
+		if(block->heat != HEAT_UNDEFINED || block->humidity != HUMIDITY_UNDEFINED)
+			block->clearNetworkCache();
 		block->heat     = HEAT_UNDEFINED;
 		block->humidity = HUMIDITY_UNDEFINED;
 		block->weather_update_time = 0;
@@ -887,12 +993,15 @@ bool ServerEnvironment::removeNode(v3s16 p)
 std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 {
 	std::set<u16> objects;
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	std::vector<u16> nearby;
+	m_active_object_index.getObjectsNear(pos, radius, nearby);
+	for(std::vector<u16>::iterator
+			i = nearby.begin(); i != nearby.end(); ++i)
 	{
-		ServerActiveObject* obj = i->second;
-		u16 id = i->first;
+		u16 id = *i;
+		ServerActiveObject* obj = getActiveObject(id);
+		if(obj == NULL)
+			continue;
 		v3f objectpos = obj->getBasePosition();
 		if(objectpos.getDistanceFrom(pos) > radius)
 			continue;
@@ -901,6 +1010,11 @@ std::set<u16> ServerEnvironment::getObjectsInsideRadius(v3f pos, float radius)
 	return objects;
 }
 
+void ServerEnvironment::activeObjectMoved(u16 id, v3f pos)
+{
+	m_active_object_index.update(id, pos);
+}
+
 void ServerEnvironment::clearAllObjects()
 {
 	infostream<<"ServerEnvironment::clearAllObjects(): "
@@ -947,6 +1061,7 @@ void ServerEnvironment::clearAllObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 
 	// Get list of loaded blocks
@@ -1048,7 +1163,7 @@ void ServerEnvironment::step(float dtime)
 	// Update this one
 	// NOTE: This is kind of funny on a singleplayer game, but doesn't
 	// really matter that much.
-	m_recommended_send_interval = g_settings->getFloat("dedicated_server_step");
+	m_recommended_send_interval = m_dedicated_server_step.get();
 
 	/*
 		Increment game time
@@ -1105,7 +1220,7 @@ void ServerEnvironment::step(float dtime)
 		/*
 			Update list of active blocks, collecting changes
 		*/
-		const s16 active_block_range = g_settings->getS16("active_block_range");
+		const s16 active_block_range = m_active_block_range.get();
 		std::set<v3s16> blocks_removed;
 		std::set<v3s16> blocks_added;
 		m_active_blocks.update(players_blockpos, active_block_range,
@@ -1224,6 +1339,9 @@ void ServerEnvironment::step(float dtime)
 		// Initialize handling of ActiveBlockModifiers
 		ABMHandler abmhandler(m_abms, abm_interval, this, true);
 
+		std::vector<ABMScanJob> jobs;
+		jobs.reserve(m_active_blocks.m_list.size());
+
 		for(std::set<v3s16>::iterator
 				i = m_active_blocks.m_list.begin();
 				i != m_active_blocks.m_list.end(); ++i)
@@ -1240,10 +1358,25 @@ void ServerEnvironment::step(float dtime)
 			// Set current time as timestamp
 			block->setTimestampNoChangedFlag(m_game_time);
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block);
+			jobs.push_back(ABMScanJob(&abmhandler, block, myrand()));
+		}
+
+		/*
+			Find the ABMs to run in all blocks in parallel, then run
+			them here in the order of the blocks
+		*/
+		{
+			ScopeProfiler sp(g_profiler, "SEnv: ABM scan avg /1s", SPT_AVG);
+			std::vector<WorkerPoolJob*> job_ptrs;
+			job_ptrs.reserve(jobs.size());
+			for(u32 i=0; i<jobs.size(); i++)
+				job_ptrs.push_back(&jobs[i]);
+			m_abm_pool->run(job_ptrs);
 		}
 
+		for(u32 i=0; i<jobs.size(); i++)
+			abmhandler.trigger(jobs[i].block, jobs[i].triggers);
+
 		u32 time_ms = timer.stop(true);
 		u32 max_time_ms = 200;
 		if(time_ms > max_time_ms){
@@ -1411,20 +1544,36 @@ void ServerEnvironment::getAddedActiveObjects(v3s16 pos, s16 radius,
 {
 	v3f pos_f = intToFloat(pos, BS);
 	f32 radius_f = radius * BS;
+
 	/*
-		Go through the object list,
+		Only objects near the position and objects with an unlimited
+		transfer distance can be added. The latter are always player
+		objects, so look at those separately.
+	*/
+	std::vector<u16> candidates;
+	m_active_object_index.getObjectsNear(pos_f, radius_f, candidates);
+	for(std::list<Player*>::iterator i = m_players.begin();
+			i != m_players.end(); ++i)
+	{
+		PlayerSAO *playersao = (*i)->getPlayerSAO();
+		if(playersao && playersao->unlimitedTransferDistance())
+			candidates.push_back(playersao->getId());
+	}
+
+	/*
+		Go through the candidates,
 		- discard m_removed objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects.
 		- add remaining objects to added_objects
 	*/
-	for(std::map<u16, ServerActiveObject*>::iterator
-			i = m_active_objects.begin();
-			i != m_active_objects.end(); ++i)
+	for(std::vector<u16>::iterator
+			i = candidates.begin();
+			i != candidates.end(); ++i)
 	{
-		u16 id = i->first;
+		u16 id = *i;
 		// Get object
-		ServerActiveObject *object = i->second;
+		ServerActiveObject *object = getActiveObject(id);
 		if(object == NULL)
 			continue;
 		// Discard if removed
@@ -1546,6 +1695,7 @@ u16 ServerEnvironment::addActiveObjectRaw(ServerActiveObject *object,
 			<<"added (id="<<object->getId()<<")"<<std::endl;*/
 			
 	m_active_objects[object->getId()] = object;
+	m_active_object_index.insert(object->getId(), object->getBasePosition());
   
 	verbosestream<<"ServerEnvironment::addActiveObjectRaw(): "
 			<<"Added id="<<object->getId()<<"; there are now "
@@ -1654,6 +1804,7 @@ void ServerEnvironment::removeRemovedObjects()
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -1705,7 +1856,7 @@ void ServerEnvironment::activateObjects(MapBlock *block, u32 dtime_s)
 			<<"activating objects of block "<<PP(block->getPos())
 			<<" ("<<block->m_static_objects.m_stored.size()
 			<<" objects)"<<std::endl;
-	bool large_amount = (block->m_static_objects.m_stored.size() > g_settings->getU16("max_objects_per_block"));
+	bool large_amount = (block->m_static_objects.m_stored.size() > m_max_objects_per_block.get());
 	if(large_amount){
 		errorstream<<"suspiciously large amount of objects detected: "
 				<<block->m_static_objects.m_stored.size()<<" in "
@@ -1883,7 +2034,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 
 			if(block)
 			{
-				if(block->m_static_objects.m_stored.size() >= g_settings->getU16("max_objects_per_block")){
+				if(block->m_static_objects.m_stored.size() >= m_max_objects_per_block.get()){
 					errorstream<<"ServerEnv: Trying to store id="<<obj->getId()
 							<<" statically but block "<<PP(blockpos)
 							<<" already contains "
@@ -1961,6 +2112,7 @@ void ServerEnvironment::deactivateFarObjects(bool force_delete)
 			i != objects_to_remove.end(); ++i)
 	{
 		m_active_objects.erase(*i);
+		m_active_object_index.remove(*i);
 	}
 }
 
@@ -33,11 +33,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <list>
 #include <map>
+#include <vector>
 #include "irr_v3d.h"
 #include "activeobject.h"
 #include "util/numeric.h"
 #include "mapnode.h"
 #include "mapblock.h"
+#include "collision.h"
+#include "settings.h" // CachedSetting
 
 class ServerEnvironment;
 class ActiveBlockModifier;
@@ -50,6 +53,8 @@ class ServerMap;
 class ClientMap;
 class GameScripting;
 class Player;
+class PlayerDatabase;
+class WorkerPool;
 
 class Environment
 {
@@ -100,6 +105,11 @@ class Environment
 	float getTimeOfDaySpeed()
 	{ return m_time_of_day_speed; }
 
+	// Scratch space of collisionMoveSimple(). An environment is only
+	// stepped by one thread, so the buffer can be reused between calls.
+	std::vector<NearbyCollisionInfo> &getCollisionBuffer()
+	{ return m_collision_buffer; }
+
 protected:
 	// peer_ids in here should be unique, except that there may be many 0s
 	std::list<Player*> m_players;
@@ -110,6 +120,7 @@ class Environment
 	float m_time_of_day_speed;
 	// Used to buffer dtime for adding to m_time_of_day
 	float m_time_counter;
+	std::vector<NearbyCollisionInfo> m_collision_buffer;
 };
 
 /*
@@ -174,6 +185,46 @@ class ActiveBlockList
 private:
 };
 
+/*
+	Spatial index of active objects, used by ServerEnvironment.
+
+	Objects are bucketed by the MapBlock their base position is in, so
+	that radius queries only have to look at the objects near the
+	query point instead of every active object.
+*/
+
+class ActiveObjectIndex
+{
+public:
+	void insert(u16 id, v3f pos);
+	void remove(u16 id);
+	// Moves the object to the bucket of pos; ignores unknown ids
+	void update(u16 id, v3f pos);
+	/*
+		Adds the ids of all objects that may be within radius of pos
+		to result. The result is a superset; callers check the exact
+		distance themselves.
+	*/
+	void getObjectsNear(v3f pos, f32 radius, std::vector<u16> &result);
+
+	void clear(){
+		m_object_blocks.clear();
+		m_blocks.clear();
+	}
+
+	u32 size(){
+		return m_object_blocks.size();
+	}
+
+private:
+	static v3s16 getBucketPos(v3f pos);
+
+	// Object id -> bucket
+	std::map<u16, v3s16> m_object_blocks;
+	// Bucket -> object ids
+	std::map<v3s16, std::set<u16> > m_blocks;
+};
+
 /*
 	The server-side environment.
 
@@ -204,6 +255,7 @@ class ServerEnvironment : public Environment
 
 	/*
 		Save players
+		Only players that have changed since the last save are written.
 	*/
 	void serializePlayers(const std::string &savedir);
 	void deSerializePlayers(const std::string &savedir);
@@ -286,6 +338,9 @@ class ServerEnvironment : public Environment
 	
 	// Find all active objects inside a radius around a point
 	std::set<u16> getObjectsInsideRadius(v3f pos, float radius);
+
+	// Called by ServerActiveObject when its base position changes
+	void activeObjectMoved(u16 id, v3f pos);
 	
 	// Clear all objects, loading and going through every MapBlock
 	void clearAllObjects();
@@ -306,6 +361,8 @@ class ServerEnvironment : public Environment
 	
 private:
 
+	PlayerDatabase * getPlayerDatabase(const std::string &savedir);
+
 	/*
 		Internal ActiveObject interface
 		-------------------------------------------
@@ -358,6 +415,8 @@ class ServerEnvironment : public Environment
 	IBackgroundBlockEmerger *m_emerger;
 	// Active object list
 	std::map<u16, ServerActiveObject*> m_active_objects;
+	// Active objects by position, kept in sync with m_active_objects
+	ActiveObjectIndex m_active_object_index;
 	// Outgoing network message buffer for active objects
 	std::list<ActiveObjectMessage> m_active_object_messages;
 	// Some timers
@@ -376,11 +435,21 @@ class ServerEnvironment : public Environment
 	// A helper variable for incrementing the latter
 	float m_game_time_fraction_counter;
 	std::list<ABMWithState> m_abms;
+	// Scans the active blocks for ABMs to run
+	WorkerPool *m_abm_pool;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval;
 	// Estimate for general maximum lag as determined by server.
 	// Can raise to high values like 15s with eg. map generation mods.
 	float m_max_lag_estimate;
+
+	// Created on first use, see getPlayerDatabase()
+	PlayerDatabase *m_player_database;
+
+	// Settings read in every step
+	CachedSetting<float> m_dedicated_server_step;
+	CachedSetting<s16> m_active_block_range;
+	CachedSetting<u16> m_max_objects_per_block;
 };
 
 #ifndef SERVER
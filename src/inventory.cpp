@@ -306,6 +306,33 @@ void ItemStack::deSerialize(const std::string &str, IItemDefManager *itemdef)
 	deSerialize(is, itemdef);
 }
 
+void ItemStack::serializeBinary(std::ostream &os) const
+{
+	/*
+		Empty items are only an empty name
+	*/
+	if(empty())
+	{
+		os<<serializeString("");
+		return;
+	}
+	os<<serializeString(name);
+	writeU16(os, count);
+	writeU16(os, wear);
+	os<<serializeLongString(metadata);
+}
+
+void ItemStack::deSerializeBinary(std::istream &is)
+{
+	clear();
+	name = deSerializeString(is);
+	if(name.empty())
+		return;
+	count = readU16(is);
+	wear = readU16(is);
+	metadata = deSerializeLongString(is);
+}
+
 std::string ItemStack::getItemString() const
 {
 	// Get item string
@@ -434,7 +461,6 @@ InventoryList::InventoryList(std::string name, u32 size, IItemDefManager *itemde
 	m_width = 0;
 	m_itemdef = itemdef;
 	clearItems();
-	//m_dirty = false;
 }
 
 InventoryList::~InventoryList()
@@ -450,24 +476,36 @@ void InventoryList::clearItems()
 		m_items.push_back(ItemStack());
 	}
 
-	//setDirty(true);
+	m_all_changed = true;
+	m_changed_slots.clear();
 }
 
 void InventoryList::setSize(u32 newsize)
 {
 	if(newsize != m_items.size())
+	{
 		m_items.resize(newsize);
+		m_all_changed = true;
+		m_changed_slots.clear();
+	}
 	m_size = newsize;
 }
 
 void InventoryList::setWidth(u32 newwidth)
 {
+	if(newwidth != m_width)
+	{
+		m_all_changed = true;
+		m_changed_slots.clear();
+	}
 	m_width = newwidth;
 }
 
 void InventoryList::setName(const std::string &name)
 {
 	m_name = name;
+	m_all_changed = true;
+	m_changed_slots.clear();
 }
 
 void InventoryList::serialize(std::ostream &os) const
@@ -557,7 +595,8 @@ InventoryList & InventoryList::operator = (const InventoryList &other)
 	m_width = other.m_width;
 	m_name = other.m_name;
 	m_itemdef = other.m_itemdef;
-	//setDirty(true);
+	m_all_changed = true;
+	m_changed_slots.clear();
 
 	return *this;
 }
@@ -622,6 +661,8 @@ const ItemStack& InventoryList::getItem(u32 i) const
 ItemStack& InventoryList::getItem(u32 i)
 {
 	assert(i < m_size);
+	// The caller may change it
+	setSlotChanged(i);
 	return m_items[i];
 }
 
@@ -632,7 +673,7 @@ ItemStack InventoryList::changeItem(u32 i, const ItemStack &newitem)
 
 	ItemStack olditem = m_items[i];
 	m_items[i] = newitem;
-	//setDirty(true);
+	setSlotChanged(i);
 	return olditem;
 }
 
@@ -640,6 +681,7 @@ void InventoryList::deleteItem(u32 i)
 {
 	assert(i < m_items.size());
 	m_items[i].clear();
+	setSlotChanged(i);
 }
 
 ItemStack InventoryList::addItem(const ItemStack &newitem_)
@@ -687,8 +729,8 @@ ItemStack InventoryList::addItem(u32 i, const ItemStack &newitem)
 		return newitem;
 
 	ItemStack leftover = m_items[i].addItem(newitem, m_itemdef);
-	//if(leftover != newitem)
-	//	setDirty(true);
+	if(leftover.count != newitem.count)
+		setSlotChanged(i);
 	return leftover;
 }
 
@@ -743,14 +785,14 @@ bool InventoryList::containsItem(const ItemStack &item) const
 ItemStack InventoryList::removeItem(const ItemStack &item)
 {
 	ItemStack removed;
-	for(std::vector<ItemStack>::reverse_iterator
-			i = m_items.rbegin();
-			i != m_items.rend(); i++)
+	for(u32 i=m_items.size(); i>0; i--)
 	{
-		if(i->name == item.name)
+		ItemStack &stack = m_items[i - 1];
+		if(stack.name == item.name)
 		{
 			u32 still_to_remove = item.count - removed.count;
-			removed.addItem(i->takeItem(still_to_remove), m_itemdef);
+			removed.addItem(stack.takeItem(still_to_remove), m_itemdef);
+			setSlotChanged(i - 1);
 			if(removed.count == item.count)
 				break;
 		}
@@ -764,8 +806,8 @@ ItemStack InventoryList::takeItem(u32 i, u32 takecount)
 		return ItemStack();
 
 	ItemStack taken = m_items[i].takeItem(takecount);
-	//if(!taken.empty())
-	//	setDirty(true);
+	if(!taken.empty())
+		setSlotChanged(i);
 	return taken;
 }
 
@@ -820,6 +862,59 @@ void InventoryList::moveItem(u32 i, InventoryList *dest, u32 dest_i, u32 count)
 	}
 }
 
+void InventoryList::serializeChanges(std::ostream &os) const
+{
+	writeU32(os, m_size);
+	writeU32(os, m_width);
+	if(m_all_changed)
+	{
+		writeU8(os, 1);
+		for(u32 i=0; i<m_items.size(); i++)
+			m_items[i].serializeBinary(os);
+		return;
+	}
+	writeU8(os, 0);
+	writeU16(os, m_changed_slots.size());
+	for(std::set<u32>::const_iterator
+			i = m_changed_slots.begin();
+			i != m_changed_slots.end(); ++i)
+	{
+		writeU16(os, *i);
+		m_items[*i].serializeBinary(os);
+	}
+}
+
+void InventoryList::deSerializeChanges(std::istream &is)
+{
+	setSize(readU32(is));
+	setWidth(readU32(is));
+	bool all = readU8(is);
+	if(all)
+	{
+		for(u32 i=0; i<m_items.size(); i++)
+			m_items[i].deSerializeBinary(is);
+		m_all_changed = true;
+		m_changed_slots.clear();
+		return;
+	}
+	u16 count = readU16(is);
+	for(u16 j=0; j<count; j++)
+	{
+		u16 i = readU16(is);
+		if(i >= m_items.size())
+			throw SerializationError("InventoryList::deSerializeChanges: "
+					"invalid slot");
+		m_items[i].deSerializeBinary(is);
+		setSlotChanged(i);
+	}
+}
+
+void InventoryList::clearChanges()
+{
+	m_all_changed = false;
+	m_changed_slots.clear();
+}
+
 /*
 	Inventory
 */
@@ -836,6 +931,7 @@ void Inventory::clear()
 		delete m_lists[i];
 	}
 	m_lists.clear();
+	m_lists_changed = true;
 }
 
 void Inventory::clearContents()
@@ -853,6 +949,7 @@ void Inventory::clearContents()
 Inventory::Inventory(IItemDefManager *itemdef)
 {
 	m_itemdef = itemdef;
+	m_lists_changed = true;
 }
 
 Inventory::Inventory(const Inventory &other)
@@ -989,9 +1086,68 @@ bool Inventory::deleteList(const std::string &name)
 		return false;
 	delete m_lists[i];
 	m_lists.erase(m_lists.begin() + i);
+	m_lists_changed = true;
+	return true;
+}
+
+bool Inventory::isChanged() const
+{
+	if(m_lists_changed)
+		return true;
+	for(u32 i=0; i<m_lists.size(); i++)
+	{
+		if(m_lists[i]->isChanged())
+			return true;
+	}
+	return false;
+}
+
+bool Inventory::serializeChanges(std::ostream &os) const
+{
+	if(m_lists_changed)
+		return false;
+
+	std::vector<const InventoryList*> changed;
+	for(u32 i=0; i<m_lists.size(); i++)
+	{
+		const InventoryList *list = m_lists[i];
+		if(!list->isChanged())
+			continue;
+		// Slot numbers are sent as u16
+		if(list->getSize() > 0xffff)
+			return false;
+		changed.push_back(list);
+	}
+
+	writeU16(os, changed.size());
+	for(u32 i=0; i<changed.size(); i++)
+	{
+		os<<serializeString(changed[i]->getName());
+		changed[i]->serializeChanges(os);
+	}
 	return true;
 }
 
+void Inventory::deSerializeChanges(std::istream &is)
+{
+	u16 count = readU16(is);
+	for(u16 i=0; i<count; i++)
+	{
+		std::string name = deSerializeString(is);
+		InventoryList *list = getList(name);
+		if(list == NULL)
+			list = addList(name, 0);
+		list->deSerializeChanges(is);
+	}
+}
+
+void Inventory::clearChanges()
+{
+	m_lists_changed = false;
+	for(u32 i=0; i<m_lists.size(); i++)
+		m_lists[i]->clearChanges();
+}
+
 const InventoryList * Inventory::getList(const std::string &name) const
 {
 	s32 i = getListIndex(name);
@@ -23,6 +23,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <iostream>
 #include <string>
 #include <vector>
+#include <set>
 #include "irrlichttypes.h"
 #include "debug.h"
 #include "itemdef.h"
@@ -41,6 +42,9 @@ struct ItemStack
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is, IItemDefManager *itemdef);
 	void deSerialize(const std::string &s, IItemDefManager *itemdef);
+	// Binary format used for sending changed slots
+	void serializeBinary(std::ostream &os) const;
+	void deSerializeBinary(std::istream &is);
 
 	// Returns the string used for inventory
 	std::string getItemString() const;
@@ -240,11 +244,33 @@ class InventoryList
 	// count is the maximum number of items to move (0 for everything)
 	void moveItem(u32 i, InventoryList *dest, u32 dest_i, u32 count = 0);
 
+	/*
+		Change tracking, so that only the changed slots need to be sent.
+		Non-const getItem() counts as a change of the slot.
+	*/
+	bool isChanged() const
+	{
+		return m_all_changed || !m_changed_slots.empty();
+	}
+	// Writes the size, width and the changed slots (or all of them)
+	void serializeChanges(std::ostream &os) const;
+	void deSerializeChanges(std::istream &is);
+	void clearChanges();
+
 private:
+	void setSlotChanged(u32 i)
+	{
+		if(!m_all_changed)
+			m_changed_slots.insert(i);
+	}
+
 	std::vector<ItemStack> m_items;
 	u32 m_size, m_width;
 	std::string m_name;
 	IItemDefManager *m_itemdef;
+
+	bool m_all_changed;
+	std::set<u32> m_changed_slots;
 };
 
 class Inventory
@@ -268,6 +294,17 @@ class Inventory
 	const InventoryList * getList(const std::string &name) const;
 	std::vector<const InventoryList*> getLists();
 	bool deleteList(const std::string &name);
+
+	// Whether anything changed since the last clearChanges()
+	bool isChanged() const;
+	/*
+		Writes the lists that changed since the last clearChanges().
+		Returns false if removed lists make that impossible, in which
+		case the whole inventory has to be sent.
+	*/
+	bool serializeChanges(std::ostream &os) const;
+	void deSerializeChanges(std::istream &is);
+	void clearChanges();
 	// A shorthand for adding items. Returns leftover item (possibly empty).
 	ItemStack addItem(const std::string &listname, const ItemStack &newitem)
 	{
@@ -283,6 +320,9 @@ class Inventory
 
 	std::vector<InventoryList*> m_lists;
 	IItemDefManager *m_itemdef;
+
+	// A list was removed or all of them were replaced
+	bool m_lists_changed;
 };
 
 #endif
@@ -96,15 +96,86 @@ class Event {
 	void wait() {
 		WaitForSingleObject(hEvent, INFINITE); 
 	}
+
+	// Returns false if the timeout ran out
+	bool wait(unsigned int timeout_ms) {
+		return WaitForSingleObject(hEvent, timeout_ms) == WAIT_OBJECT_0;
+	}
 	
 	void signal() {
 		SetEvent(hEvent);
 	}
 };
 
+#elif defined(__APPLE__)
+
+#include <sys/time.h>
+#include <errno.h>
+
+/*
+	Mac OS X has neither unnamed semaphores nor sem_timedwait(), so the
+	count is kept under a mutex and waited for with a condition
+*/
+class Event {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned int count;
+
+public:
+	Event(): count(0) {
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+	}
+
+	~Event() {
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+	}
+
+	void wait() {
+		pthread_mutex_lock(&mutex);
+		while(count == 0)
+			pthread_cond_wait(&cond, &mutex);
+		count--;
+		pthread_mutex_unlock(&mutex);
+	}
+
+	// Returns false if the timeout ran out
+	bool wait(unsigned int timeout_ms) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		struct timespec ts;
+		ts.tv_sec = now.tv_sec + timeout_ms / 1000;
+		ts.tv_nsec = (long)now.tv_usec * 1000
+				+ (long)(timeout_ms % 1000) * 1000000;
+		if(ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_mutex_lock(&mutex);
+		int r = 0;
+		while(count == 0 && r != ETIMEDOUT)
+			r = pthread_cond_timedwait(&cond, &mutex, &ts);
+		bool signaled = count != 0;
+		if(signaled)
+			count--;
+		pthread_mutex_unlock(&mutex);
+		return signaled;
+	}
+
+	void signal() {
+		pthread_mutex_lock(&mutex);
+		count++;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+	}
+};
+
 #else
 
 #include <semaphore.h>
+#include <time.h>
+#include <errno.h>
 
 class Event {
 	sem_t sem;
@@ -121,6 +192,22 @@ class Event {
 	void wait() {
 		sem_wait(&sem);
 	}
+
+	// Returns false if the timeout ran out
+	bool wait(unsigned int timeout_ms) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += timeout_ms / 1000;
+		ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+		if(ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		int r;
+		while((r = sem_timedwait(&sem, &ts)) == -1 && errno == EINTR)
+			;
+		return r == 0;
+	}
 	
 	void signal() {
 		sem_post(&sem);
@@ -79,11 +79,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serverlist.h"
 #include "guiEngine.h"
 #include "mapsector.h"
+#include "noise.h"
 
 #include "database-sqlite3.h"
 #ifdef USE_LEVELDB
 #include "database-leveldb.h"
 #endif
+#include "playerdatabase.h"
+#include "player.h"
 
 /*
 	Settings.
@@ -722,6 +725,54 @@ void SpeedTests()
 		infostream<<"Done. "<<dtime<<"ms, "
 				<<per_ms<<"/ms"<<std::endl;
 	}
+
+	{
+		// Same parameters as the mapgen v6 terrain noise
+		NoiseParams np = {-4, 20.0, v3f(250, 250, 250), 82341, 5, 0.6};
+		Noise noise(&np, 1, 80, 80);
+
+		infostream<<"Noise map throughput in points/ms:"<<std::endl;
+		TimeTaker timer("Testing 2D noise map speed");
+		u32 n = 0;
+		u32 i = 0;
+		do{
+			n += 100;
+			for(; i<n; i++){
+				noise.perlinMap2D(i * 80, 0);
+				tempf += noise.result[i % (80 * 80)];
+			}
+		}
+		// Do at least 100ms
+		while(timer.getTimerTime() < 100);
+
+		u32 dtime = timer.stop();
+		u32 per_ms = n * 80 * 80 / dtime;
+		infostream<<"Done. "<<dtime<<"ms, "
+				<<per_ms<<"/ms"<<std::endl;
+	}
+
+	{
+		NoiseParams np = {0, 1, v3f(250, 250, 250), 5333, 5, 0.63};
+		Noise noise(&np, 1, 80, 80, 80);
+
+		TimeTaker timer("Testing 3D noise map speed");
+		u32 n = 0;
+		u32 i = 0;
+		do{
+			n += 2;
+			for(; i<n; i++){
+				noise.perlinMap3D(i * 80, 0, 0);
+				tempf += noise.result[i % (80 * 80 * 80)];
+			}
+		}
+		// Do at least 100ms
+		while(timer.getTimerTime() < 100);
+
+		u32 dtime = timer.stop();
+		u32 per_ms = n * 80 * 80 * 80 / dtime;
+		infostream<<"Done. "<<dtime<<"ms, "
+				<<per_ms<<"/ms"<<std::endl;
+	}
 }
 
 static void print_worldspecs(const std::vector<WorldSpec> &worldspecs,
@@ -800,6 +851,8 @@ int main(int argc, char *argv[])
 			_("Set gameid (\"--gameid list\" prints available ones)"))));
 	allowed_options.insert(std::make_pair("migrate", ValueSpec(VALUETYPE_STRING,
 			_("Migrate from current map backend to another (Only works when using minetestserver or with --server)"))));
+	allowed_options.insert(std::make_pair("migrate-players", ValueSpec(VALUETYPE_STRING,
+			_("Migrate from current players backend to another (Only works when using minetestserver or with --server)"))));
 #ifndef SERVER
 	allowed_options.insert(std::make_pair("videomodes", ValueSpec(VALUETYPE_FLAG,
 			_("Show available video modes"))));
@@ -1290,6 +1343,55 @@ int main(int argc, char *argv[])
 			return 0;
 		}
 
+		// Player database migration
+		if (cmd_args.exists("migrate-players")) {
+			std::string migrate_to = cmd_args.get("migrate-players");
+			std::string worldmt_path = world_path + DIR_DELIM + "world.mt";
+			Settings world_mt;
+			if (!world_mt.readConfigFile(worldmt_path.c_str())) {
+				errorstream << "Cannot read world.mt" << std::endl;
+				return 1;
+			}
+			std::string backend = getPlayerDatabaseBackend(world_path);
+			if (backend == migrate_to) {
+				errorstream << "Cannot migrate: new backend is same as the old one" << std::endl;
+				return 1;
+			}
+			PlayerDatabase *old_db = createPlayerDatabase(backend, world_path, &server);
+			PlayerDatabase *new_db = createPlayerDatabase(migrate_to, world_path, &server);
+			if (!old_db || !new_db) {
+				errorstream << "Migration from " << backend << " to " << migrate_to
+					<< " is not supported" << std::endl;
+				delete old_db;
+				delete new_db;
+				return 1;
+			}
+
+			std::list<std::string> names;
+			old_db->listPlayers(names);
+			int count = 0;
+			new_db->beginSave();
+			for (std::list<std::string>::iterator i = names.begin(); i != names.end(); ++i) {
+				RemotePlayer player(&server);
+				if (!old_db->loadPlayer(*i, &player))
+					continue;
+				new_db->savePlayer(&player);
+				++count;
+			}
+			new_db->endSave();
+			delete old_db;
+			delete new_db;
+
+			actionstream << "Successfully migrated " << count << " players" << std::endl;
+			world_mt.set("player_backend", migrate_to);
+			if(!world_mt.updateConfigFile(worldmt_path.c_str()))
+				errorstream<<"Failed to update world.mt!"<<std::endl;
+			else
+				actionstream<<"world.mt updated"<<std::endl;
+
+			return 0;
+		}
+
 		server.start(port);
 		
 		// Run server
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "filesys.h"
 #include "voxel.h"
 #include "porting.h"
+#include "util/thread.h"
 #include "serialization.h"
 #include "nodemetadata.h"
 #include "settings.h"
@@ -66,6 +67,98 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 			BLOB data
 */
 
+/*
+	MapBlockIndex
+*/
+
+MapBlockIndex::MapBlockIndex():
+	m_count(0)
+{
+	resize(1024);
+}
+
+void MapBlockIndex::set(v3s16 p, MapBlock *block)
+{
+	assert(block != NULL);
+
+	// Keep at most half of the slots in use so that probes stay short
+	if((m_count + 1) * 2 > m_slots.size())
+		resize(m_slots.size() * 2);
+
+	u64 key = packPos(p);
+	u32 i = hashKey(key) & m_mask;
+	while(m_slots[i].block != NULL && m_slots[i].key != key)
+		i = (i + 1) & m_mask;
+	if(m_slots[i].block == NULL)
+		m_count++;
+	m_slots[i].key = key;
+	m_slots[i].block = block;
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u64 key = packPos(p);
+	u32 i = hashKey(key) & m_mask;
+	for(;;)
+	{
+		if(m_slots[i].block == NULL)
+			return;
+		if(m_slots[i].key == key)
+			break;
+		i = (i + 1) & m_mask;
+	}
+
+	/*
+		Move the following entries of the probe sequence back, so that
+		no lookup stops at the freed slot before finding its entry.
+	*/
+	u32 j = i;
+	for(;;)
+	{
+		j = (j + 1) & m_mask;
+		if(m_slots[j].block == NULL)
+			break;
+		u32 home = hashKey(m_slots[j].key) & m_mask;
+		// Distances from home; the entry can't move in front of it
+		if(((j - home) & m_mask) >= ((j - i) & m_mask))
+		{
+			m_slots[i] = m_slots[j];
+			i = j;
+		}
+	}
+	m_slots[i].block = NULL;
+	m_count--;
+}
+
+void MapBlockIndex::clear()
+{
+	m_slots.clear();
+	m_count = 0;
+	resize(1024);
+}
+
+void MapBlockIndex::resize(u32 capacity)
+{
+	std::vector<Slot> old;
+	old.swap(m_slots);
+
+	Slot empty;
+	empty.key = 0;
+	empty.block = NULL;
+	m_slots.resize(capacity, empty);
+	m_mask = capacity - 1;
+
+	for(std::vector<Slot>::iterator i = old.begin(); i != old.end(); ++i)
+	{
+		if(i->block == NULL)
+			continue;
+		u32 k = hashKey(i->key) & m_mask;
+		while(m_slots[k].block != NULL)
+			k = (k + 1) & m_mask;
+		m_slots[k] = *i;
+	}
+}
+
 /*
 	Map
 */
@@ -146,16 +239,6 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 	return sector;
 }
 
-MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
-{
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
-}
-
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
 {
 	MapBlock *block = getBlockNoCreateNoEx(p3d);
@@ -185,12 +268,17 @@ bool Map::isValidPosition(v3s16 p)
 }
 
 // Returns a CONTENT_IGNORE node if not found
-MapNode Map::getNodeNoEx(v3s16 p)
+MapNode Map::getNodeNoEx(v3s16 p, bool *is_valid_position)
 {
 	v3s16 blockpos = getNodeBlockPos(p);
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
-	if(block == NULL)
+	if(block == NULL || block->isDummy()){
+		if(is_valid_position != NULL)
+			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
+	}
+	if(is_valid_position != NULL)
+		*is_valid_position = true;
 	v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
 	return block->getNodeNoCheck(relpos);
 }
@@ -280,19 +368,15 @@ void Map::unspreadLight(enum LightBank bank,
 		v3s16 blockpos = getNodeBlockPos(pos);
 
 		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
+			block_checked_in_modified = false;
+			blockchangecount++;
 		}
-		catch(InvalidPositionException &e)
-		{
+		if(block == NULL)
 			continue;
-		}
 
 		if(block->isDummy())
 			continue;
@@ -314,88 +398,77 @@ void Map::unspreadLight(enum LightBank bank,
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			// Only fetch a new block if the block position has changed
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+				block_checked_in_modified = false;
+				blockchangecount++;
+			}
+			if(block == NULL || block->isDummy())
+				continue;
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
 
-				bool changed = false;
+			bool changed = false;
 
-				//TODO: Optimize output by optimizing light_sources?
+			//TODO: Optimize output by optimizing light_sources?
 
+			/*
+				If the neighbor is dimmer than what was specified
+				as oldlight (the light of the previous node)
+			*/
+			if(n2.getLight(bank, nodemgr) < oldlight)
+			{
 				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
+					And the neighbor is transparent and it has some light
 				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
+				if(nodemgr->get(n2).light_propagates
+						&& n2.getLight(bank, nodemgr) != 0)
 				{
 					/*
-						And the neighbor is transparent and it has some light
+						Set light to 0 and add to queue
 					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes[n2pos] = current_light;
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
 
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos);
-				}
+					u8 current_light = n2.getLight(bank, nodemgr);
+					n2.setLight(bank, 0, nodemgr);
+					block->setNode(relpos, n2);
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
+					unlighted_nodes[n2pos] = current_light;
+					changed = true;
+
+					/*
+						Remove from light_sources if it is there
+						NOTE: This doesn't happen nearly at all
+					*/
+					/*if(light_sources.find(n2pos))
 					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
+						infostream<<"Removed from light_sources"<<std::endl;
+						light_sources.remove(n2pos);
+					}*/
 				}
+
+				/*// DEBUG
+				if(light_sources.find(n2pos) != NULL)
+					light_sources.remove(n2pos);*/
 			}
-			catch(InvalidPositionException &e)
+			else{
+				light_sources.insert(n2pos);
+			}
+
+			// Add to modified_blocks
+			if(changed == true && block_checked_in_modified == false)
 			{
-				continue;
+				// If the block is not found in modified_blocks, add.
+				if(modified_blocks.find(blockpos) == modified_blocks.end())
+				{
+					modified_blocks[blockpos] = block;
+				}
+				block_checked_in_modified = true;
 			}
 		}
 	}
@@ -464,19 +537,15 @@ void Map::spreadLight(enum LightBank bank,
 		v3s16 blockpos = getNodeBlockPos(pos);
 
 		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
+			block_checked_in_modified = false;
+			blockchangecount++;
 		}
-		catch(InvalidPositionException &e)
-		{
+		if(block == NULL)
 			continue;
-		}
 
 		if(block->isDummy())
 			continue;
@@ -485,7 +554,7 @@ void Map::spreadLight(enum LightBank bank,
 		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
 
 		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
+		MapNode n = block->getNodeNoCheck(relpos);
 
 		u8 oldlight = n.getLight(bank, nodemgr);
 		u8 newlight = diminish_light(oldlight);
@@ -498,67 +567,56 @@ void Map::spreadLight(enum LightBank bank,
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			// Only fetch a new block if the block position has changed
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+				block_checked_in_modified = false;
+				blockchangecount++;
+			}
+			if(block == NULL || block->isDummy())
+				continue;
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			MapNode n2 = block->getNodeNoCheck(relpos);
 
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			bool changed = false;
+			/*
+				If the neighbor is brighter than the current node,
+				add to list (it will light up this node on its turn)
+			*/
+			if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			{
+				lighted_nodes.insert(n2pos);
+				changed = true;
+			}
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, add to list
+			*/
+			if(n2.getLight(bank, nodemgr) < newlight)
+			{
+				if(nodemgr->get(n2).light_propagates)
 				{
+					n2.setLight(bank, newlight, nodemgr);
+					block->setNode(relpos, n2);
 					lighted_nodes.insert(n2pos);
 					changed = true;
 				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos);
-						changed = true;
-					}
-				}
+			}
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
+			// Add to modified_blocks
+			if(changed == true && block_checked_in_modified == false)
+			{
+				// If the block is not found in modified_blocks, add.
+				if(modified_blocks.find(blockpos) == modified_blocks.end())
 				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == modified_blocks.end())
-					{
-						modified_blocks[blockpos] = block;
-					}
-					block_checked_in_modified = true;
+					modified_blocks[blockpos] = block;
 				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
+				block_checked_in_modified = true;
 			}
 		}
 	}
@@ -605,14 +663,10 @@ v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
 	for(u16 i=0; i<6; i++){
 		// Get the position of the neighbor node
 		v3s16 n2pos = p + dirs[i];
-		MapNode n2;
-		try{
-			n2 = getNode(n2pos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		bool is_valid_position;
+		MapNode n2 = getNodeNoEx(n2pos, &is_valid_position);
+		if(!is_valid_position)
 			continue;
-		}
 		if(n2.getLight(bank, nodemgr) > brightest_light || found_something == false){
 			brightest_light = n2.getLight(bank, nodemgr);
 			brightest_pos = n2pos;
@@ -645,17 +699,12 @@ s16 Map::propagateSunlight(v3s16 start,
 		v3s16 pos(start.X, y, start.Z);
 
 		v3s16 blockpos = getNodeBlockPos(pos);
-		MapBlock *block;
-		try{
-			block = getBlockNoCreate(blockpos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		if(block == NULL || block->isDummy())
 			break;
-		}
 
 		v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
-		MapNode n = block->getNode(relpos);
+		MapNode n = block->getNodeNoCheck(relpos);
 
 		if(nodemgr->get(n).sunlight_propagates)
 		{
@@ -722,38 +771,26 @@ void Map::updateLighting(enum LightBank bank,
 			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
 			{
-
-				try{
-					v3s16 p(x,y,z);
-					MapNode n = block->getNode(p);
-					u8 oldlight = n.getLight(bank, nodemgr);
-					n.setLight(bank, 0, nodemgr);
-					block->setNode(p, n);
-
-					// If node sources light, add to list
-					u8 source = nodemgr->get(n).light_source;
-					if(source != 0)
-						light_sources.insert(p + posnodes);
-
-					// Collect borders for unlighting
-					if((x==0 || x == MAP_BLOCKSIZE-1
-					|| y==0 || y == MAP_BLOCKSIZE-1
-					|| z==0 || z == MAP_BLOCKSIZE-1)
-					&& oldlight != 0)
-					{
-						v3s16 p_map = p + posnodes;
-						unlight_from[p_map] = oldlight;
-					}
-				}
-				catch(InvalidPositionException &e)
+				// Dummy blocks were skipped above, so p is always valid
+				v3s16 p(x,y,z);
+				MapNode n = block->getNodeNoCheck(p);
+				u8 oldlight = n.getLight(bank, nodemgr);
+				n.setLight(bank, 0, nodemgr);
+				block->setNodeNoCheck(p, n);
+
+				// If node sources light, add to list
+				u8 source = nodemgr->get(n).light_source;
+				if(source != 0)
+					light_sources.insert(p + posnodes);
+
+				// Collect borders for unlighting
+				if((x==0 || x == MAP_BLOCKSIZE-1
+				|| y==0 || y == MAP_BLOCKSIZE-1
+				|| z==0 || z == MAP_BLOCKSIZE-1)
+				&& oldlight != 0)
 				{
-					/*
-						This would happen when dealing with a
-						dummy block.
-					*/
-					//assert(0);
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
+					v3s16 p_map = p + posnodes;
+					unlight_from[p_map] = oldlight;
 				}
 			}
 
@@ -963,15 +1000,11 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 
 		Otherwise there probably is.
 	*/
-	try{
-		MapNode topnode = getNode(toppos);
-
-		if(topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-			node_under_sunlight = false;
-	}
-	catch(InvalidPositionException &e)
-	{
-	}
+	bool is_valid_position;
+	MapNode topnode = getNodeNoEx(toppos, &is_valid_position);
+	if(is_valid_position &&
+			topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
+		node_under_sunlight = false;
 
 	/*
 		Remove all light that has come out of this node
@@ -1041,14 +1074,9 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 			//m_dout<<DTIME<<"y="<<y<<std::endl;
 			v3s16 n2pos(p.X, y, p.Z);
 
-			MapNode n2;
-			try{
-				n2 = getNode(n2pos);
-			}
-			catch(InvalidPositionException &e)
-			{
+			MapNode n2 = getNodeNoEx(n2pos, &is_valid_position);
+			if(!is_valid_position)
 				break;
-			}
 
 			if(n2.getLight(LIGHTBANK_DAY, ndef) == LIGHT_SUN)
 			{
@@ -1110,20 +1138,14 @@ void Map::addNodeAndUpdate(v3s16 p, MapNode n,
 	};
 	for(u16 i=0; i<7; i++)
 	{
-		try
-		{
-
 		v3s16 p2 = p + dirs[i];
 
-		MapNode n2 = getNode(p2);
-		if(ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR)
+		MapNode n2 = getNodeNoEx(p2, &is_valid_position);
+		if(is_valid_position &&
+				(ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR))
 		{
 			m_transforming_liquid.push_back(p2);
 		}
-
-		}catch(InvalidPositionException &e)
-		{
-		}
 	}
 }
 
@@ -1154,15 +1176,11 @@ void Map::removeNodeAndUpdate(v3s16 p,
 		If there is a node at top and it doesn't have sunlight,
 		there will be no sunlight going down.
 	*/
-	try{
-		MapNode topnode = getNode(toppos);
-
-		if(topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
-			node_under_sunlight = false;
-	}
-	catch(InvalidPositionException &e)
-	{
-	}
+	bool is_valid_position;
+	MapNode topnode = getNodeNoEx(toppos, &is_valid_position);
+	if(is_valid_position &&
+			topnode.getLight(LIGHTBANK_DAY, ndef) != LIGHT_SUN)
+		node_under_sunlight = false;
 
 	std::set<v3s16> light_sources;
 
@@ -1302,20 +1320,14 @@ void Map::removeNodeAndUpdate(v3s16 p,
 	};
 	for(u16 i=0; i<7; i++)
 	{
-		try
-		{
-
 		v3s16 p2 = p + dirs[i];
 
-		MapNode n2 = getNode(p2);
-		if(ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR)
+		MapNode n2 = getNodeNoEx(p2, &is_valid_position);
+		if(is_valid_position &&
+				(ndef->get(n2).isLiquid() || n2.getContent() == CONTENT_AIR))
 		{
 			m_transforming_liquid.push_back(p2);
 		}
-
-		}catch(InvalidPositionException &e)
-		{
-		}
 	}
 }
 
@@ -2314,6 +2326,7 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	block->clearNetworkCache();
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -2328,6 +2341,7 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	block->clearNetworkCache();
 }
 
 NodeTimer Map::getNodeTimer(v3s16 p)
@@ -2403,6 +2417,173 @@ s16 Map::getHumidity(v3s16 p)
 	return 0;
 }
 
+/*
+	MapSaveThread
+*/
+
+class MapSaveThread : public SimpleThread
+{
+public:
+	MapSaveThread(Database *dbase, JMutex &dbase_mutex, u32 queue_limit):
+		SimpleThread(),
+		m_dbase(dbase),
+		m_dbase_mutex(dbase_mutex),
+		m_queue_limit(queue_limit)
+	{
+		m_queue_mutex.Init();
+	}
+
+	~MapSaveThread()
+	{
+		// Only left over if the thread never ran
+		deleteSnapshots(m_queue);
+	}
+
+	/*
+		Takes ownership of the snapshot. A snapshot of the same block
+		that is still queued is replaced, as only the latest one
+		matters. Blocks while the queue is full.
+	*/
+	void enqueue(v3s16 p, MapBlockDiskSnapshot *snapshot)
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		for(;;)
+		{
+			std::map<v3s16, MapBlockDiskSnapshot*>::iterator
+					i = m_queue.find(p);
+			if(i != m_queue.end())
+			{
+				delete i->second;
+				i->second = snapshot;
+				return;
+			}
+			if(m_queue.size() < m_queue_limit || !IsRunning())
+				break;
+			m_queue_mutex.Unlock();
+			sleep_ms(1);
+			m_queue_mutex.Lock();
+		}
+		bool was_empty = m_queue.empty();
+		m_queue[p] = snapshot;
+		if(was_empty)
+			m_queue_event.signal();
+	}
+
+	// Whether the block is queued or being written
+	bool isPending(v3s16 p)
+	{
+		JMutexAutoLock lock(m_queue_mutex);
+		return m_queue.find(p) != m_queue.end()
+				|| m_writing.find(p) != m_writing.end();
+	}
+
+	// Waits until the block has been written
+	void waitFor(v3s16 p)
+	{
+		while(isPending(p) && IsRunning())
+			sleep_ms(1);
+	}
+
+	// Waits until everything queued so far has been written
+	void flush()
+	{
+		for(;;)
+		{
+			{
+				JMutexAutoLock lock(m_queue_mutex);
+				if(m_queue.empty() && m_writing.empty())
+					return;
+			}
+			if(!IsRunning())
+				return;
+			sleep_ms(1);
+		}
+	}
+
+	// Writes out the whole queue before returning
+	void stop()
+	{
+		setRun(false);
+		m_queue_event.signal();
+		while(IsRunning())
+			sleep_ms(1);
+		// In case the thread was never started
+		writeQueued();
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+		log_register_thread("MapSaveThread");
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		while(getRun())
+		{
+			m_queue_event.wait();
+			writeQueued();
+		}
+		writeQueued();
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		return NULL;
+	}
+
+private:
+	// Writes everything that is in the queue in one database transaction
+	void writeQueued()
+	{
+		{
+			JMutexAutoLock lock(m_queue_mutex);
+			if(m_queue.empty())
+				return;
+			// m_writing is only changed by this thread, and other threads
+			// only read it with m_queue_mutex locked
+			m_writing.swap(m_queue);
+		}
+
+		{
+			JMutexAutoLock lock(m_dbase_mutex);
+			m_dbase->beginSave();
+			for(std::map<v3s16, MapBlockDiskSnapshot*>::iterator
+					i = m_writing.begin(); i != m_writing.end(); ++i)
+			{
+				/*
+					[0] u8 serialization version
+					[1] data
+				*/
+				MapBlockDiskSnapshot *snapshot = i->second;
+				std::ostringstream o(std::ios_base::binary);
+				o.write((char*)&snapshot->version, 1);
+				snapshot->serialize(o);
+				m_dbase->saveBlockData(i->first, o.str());
+			}
+			m_dbase->endSave();
+		}
+
+		JMutexAutoLock lock(m_queue_mutex);
+		deleteSnapshots(m_writing);
+	}
+
+	static void deleteSnapshots(std::map<v3s16, MapBlockDiskSnapshot*> &snapshots)
+	{
+		for(std::map<v3s16, MapBlockDiskSnapshot*>::iterator
+				i = snapshots.begin(); i != snapshots.end(); ++i)
+			delete i->second;
+		snapshots.clear();
+	}
+
+	Database *m_dbase;
+	JMutex &m_dbase_mutex;
+	u32 m_queue_limit;
+
+	JMutex m_queue_mutex;
+	std::map<v3s16, MapBlockDiskSnapshot*> m_queue;
+	std::map<v3s16, MapBlockDiskSnapshot*> m_writing;
+	// Signaled when the queue becomes non-empty or the thread should quit
+	Event m_queue_event;
+};
+
 /*
 	ServerMap
 */
@@ -2462,6 +2643,14 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef, EmergeManager *emer
 			throw BaseException("Unknown map backend");
 	}
 
+	m_dbase_mutex.Init();
+	m_save_thread = NULL;
+	if(g_settings->getBool("map_save_async"))
+	{
+		m_save_thread = new MapSaveThread(dbase, m_dbase_mutex, 1024);
+		m_save_thread->Start();
+	}
+
 	m_savedir = savedir;
 	m_map_saving_enabled = false;
 
@@ -2550,6 +2739,15 @@ ServerMap::~ServerMap()
 				<<", exception: "<<e.what()<<std::endl;
 	}
 
+	/*
+		Write out the blocks that are still queued
+	*/
+	if(m_save_thread)
+	{
+		m_save_thread->stop();
+		delete m_save_thread;
+	}
+
 	/*
 		Close database if it was opened
 	*/
@@ -2854,6 +3052,7 @@ MapBlock* ServerMap::finishBlockMake(BlockMakeData *data,
 			block->heat     = HEAT_UNDEFINED;
 			block->humidity = HUMIDITY_UNDEFINED;
 			block->weather_update_time = 0;
+			block->clearNetworkCache();
 		}
 	}
 	
@@ -3405,6 +3604,10 @@ void ServerMap::listAllLoadableBlocks(std::list<v3s16> &dst)
 		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
 				<<"all blocks that are stored in flat files"<<std::endl;
 	}
+	// Include the blocks that haven't been written yet
+	if(m_save_thread)
+		m_save_thread->flush();
+	JMutexAutoLock lock(m_dbase_mutex);
 	dbase->listAllLoadableBlocks(dst);
 }
 
@@ -3691,16 +3894,52 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 #endif
 
 void ServerMap::beginSave() {
+	// The save thread writes each batch in its own transaction
+	if(m_save_thread)
+		return;
+	JMutexAutoLock lock(m_dbase_mutex);
 	dbase->beginSave();
 }
 
 void ServerMap::endSave() {
+	if(m_save_thread)
+		return;
+	JMutexAutoLock lock(m_dbase_mutex);
 	dbase->endSave();
 }
 
 void ServerMap::saveBlock(MapBlock *block)
 {
-  dbase->saveBlock(block);
+	if(m_save_thread == NULL)
+	{
+		JMutexAutoLock lock(m_dbase_mutex);
+		dbase->saveBlock(block);
+		return;
+	}
+
+	/*
+		Dummy blocks are not written
+	*/
+	if(block->isDummy())
+		return;
+
+	/*
+		Only the parts that need the block are done here; compressing
+		and writing are left to the save thread.
+	*/
+	MapBlockDiskSnapshot *snapshot = new MapBlockDiskSnapshot;
+	try{
+		block->serializeDiskSnapshot(*snapshot, SER_FMT_VER_HIGHEST_WRITE);
+	}
+	catch(...)
+	{
+		delete snapshot;
+		throw;
+	}
+	m_save_thread->enqueue(block->getPos(), snapshot);
+
+	// The block may now be unloaded, the snapshot will be written
+	block->resetModified();
 }
 
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
@@ -3852,13 +4091,111 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	v2s16 p2d(blockpos.X, blockpos.Z);
-
-	MapBlock *ret;
+	MapBlock *block = loadBlockDetached(blockpos);
+	if(block)
+		return insertLoadedBlock(block);
 
-	ret = dbase->loadBlock(blockpos);
-	if (ret) return (ret);
 	// Not found in database, try the files
+	return loadBlockFromFiles(blockpos);
+}
+
+MapBlock* ServerMap::loadBlockDetached(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string data;
+	{
+		// Don't read an older version of a block that is still queued
+		if(m_save_thread)
+			m_save_thread->waitFor(blockpos);
+		JMutexAutoLock lock(m_dbase_mutex);
+		if(!dbase->loadBlockData(blockpos, data))
+			return NULL;
+	}
+
+	MapBlock *block = new MapBlock(this, blockpos, m_gamedef);
+	try{
+		std::istringstream is(data, std::ios_base::binary);
+
+		u8 version = SER_FMT_VER_INVALID;
+		is.read((char*)&version, 1);
+
+		if(is.fail())
+			throw SerializationError("ServerMap::loadBlock(): Failed"
+					" to read MapBlock version");
+
+		// The node definitions may only be touched with the
+		// environment lock; insertLoadedBlock() corrects the ids
+		block->deSerialize(is, version, true, true);
+	}
+	catch(SerializationError &e)
+	{
+		delete block;
+
+		errorstream<<"Invalid block data in database"
+				<<" ("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<")"
+				<<" (SerializationError): "<<e.what()<<std::endl;
+
+		// TODO: Block should be marked as invalid in memory so that it is
+		// not touched but the game can run
+
+		if(g_settings->getBool("ignore_world_load_errors")){
+			errorstream<<"Ignoring block load error. Duck and cover! "
+					<<"(ignore_world_load_errors)"<<std::endl;
+			return NULL;
+		}
+		throw SerializationError("Invalid block data in database");
+	}
+	catch(...)
+	{
+		delete block;
+		throw;
+	}
+
+	// We just loaded it, so it's up-to-date.
+	block->resetModified();
+	return block;
+}
+
+MapBlock* ServerMap::insertLoadedBlock(MapBlock *block)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v3s16 blockpos = block->getPos();
+	MapSector *sector = createSector(v2s16(blockpos.X, blockpos.Z));
+
+	MapBlock *existing = sector->getBlockNoCreateNoEx(blockpos.Y);
+	if(existing && !existing->isDummy() && existing->isGenerated())
+	{
+		// Loaded or generated by someone else in the meantime
+		delete block;
+		return existing;
+	}
+
+	// This may allocate ids for unknown nodes
+	block->correctNodeIds();
+
+	if(existing)
+	{
+		/*
+			Replace the placeholder. References are taken by position
+			(see ServerEnvironment::clearAllObjects()), so they are
+			carried over to the loaded block.
+		*/
+		for(int i=0; i<existing->refGet(); i++)
+			block->refGrab();
+		sector->deleteBlock(existing);
+	}
+
+	sector->insertBlock(block);
+	return block;
+}
+
+MapBlock* ServerMap::loadBlockFromFiles(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -3936,6 +4273,8 @@ s16 ServerMap::updateBlockHeat(ServerEnvironment *env, v3s16 p, MapBlock *block)
 			env->getTimeOfDayF(), gametime * env->getTimeOfDaySpeed());
 
 	if(block) {
+		if(block->heat != (s16)heat)
+			block->clearNetworkCache();
 		block->heat = heat;
 		block->weather_update_time = gametime;
 	}
@@ -3957,6 +4296,8 @@ s16 ServerMap::updateBlockHumidity(ServerEnvironment *env, v3s16 p, MapBlock *bl
 			env->getTimeOfDayF(), gametime * env->getTimeOfDaySpeed());
 			
 	if(block) {
+		if(block->humidity != (s16)humidity)
+			block->clearNetworkCache();
 		block->humidity = humidity;
 		block->weather_update_time = gametime;
 	}
@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <set>
 #include <map>
 #include <list>
+#include <vector>
 
 #include "irrlichttypes_bloated.h"
 #include "mapnode.h"
@@ -46,6 +47,7 @@ class EmergeManager;
 class ServerEnvironment;
 struct BlockMakeData;
 struct MapgenParams;
+class MapSaveThread;
 
 
 /*
@@ -64,6 +66,9 @@ enum MapEditEventType{
 	// Node metadata of block changed (not knowing which node exactly)
 	// p stores block coordinate
 	MEET_BLOCK_NODE_METADATA_CHANGED,
+	// Node metadata of a single node changed
+	// p stores node coordinate
+	MEET_NODE_METADATA_CHANGED,
 	// Anything else (modified_blocks are set unsent)
 	MEET_OTHER
 };
@@ -105,6 +110,8 @@ struct MapEditEvent
 			v3s16 np2 = np1 + v3s16(1,1,1)*MAP_BLOCKSIZE - v3s16(1,1,1);
 			return VoxelArea(np1, np2);
 		}
+		case MEET_NODE_METADATA_CHANGED:
+			return VoxelArea(p);
 		case MEET_OTHER:
 		{
 			VoxelArea a;
@@ -132,6 +139,67 @@ class MapEventReceiver
 	virtual void onMapEditEvent(MapEditEvent *event) = 0;
 };
 
+/*
+	Hash table of all the blocks of a map by position, with open
+	addressing. Finding a block usually takes a single probe.
+	Lookups don't modify anything, so any number of threads can look up
+	blocks at once as long as nothing is inserted or removed meanwhile.
+*/
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+
+	// Returns NULL if not found
+	MapBlock * get(v3s16 p) const
+	{
+		u64 key = packPos(p);
+		u32 i = hashKey(key) & m_mask;
+		for(;;)
+		{
+			const Slot &slot = m_slots[i];
+			if(slot.block == NULL)
+				return NULL;
+			if(slot.key == key)
+				return slot.block;
+			i = (i + 1) & m_mask;
+		}
+	}
+	// Inserts or replaces; block must not be NULL
+	void set(v3s16 p, MapBlock *block);
+	void remove(v3s16 p);
+	void clear();
+
+	u32 size() const
+	{
+		return m_count;
+	}
+
+private:
+	struct Slot
+	{
+		u64 key;
+		// NULL if the slot is free
+		MapBlock *block;
+	};
+
+	static u64 packPos(v3s16 p)
+	{
+		return ((u64)(u16)p.X << 32) | ((u64)(u16)p.Y << 16) | (u16)p.Z;
+	}
+	static u32 hashKey(u64 key)
+	{
+		u32 h = (u32)key * 0x9E3779B1 ^ (u32)(key >> 32) * 0x85EBCA77;
+		return h ^ (h >> 16);
+	}
+	void resize(u32 capacity);
+
+	std::vector<Slot> m_slots;
+	// Size of m_slots minus one; the size is a power of two
+	u32 m_mask;
+	u32 m_count;
+};
+
 class Map /*: public NodeContainer*/
 {
 public:
@@ -181,8 +249,13 @@ class Map /*: public NodeContainer*/
 
 	// Returns InvalidPositionException if not found
 	MapBlock * getBlockNoCreate(v3s16 p);
-	// Returns NULL if not found
-	MapBlock * getBlockNoCreateNoEx(v3s16 p);
+	/*
+		Returns NULL if not found.
+		Safe to call from several threads at once as long as nothing
+		modifies the map meanwhile.
+	*/
+	MapBlock * getBlockNoCreateNoEx(v3s16 p)
+	{ return m_block_index.get(p); }
 
 	/* Server overrides */
 	virtual MapBlock * emergeBlock(v3s16 p, bool allow_generate=true)
@@ -200,7 +273,8 @@ class Map /*: public NodeContainer*/
 	void setNode(v3s16 p, MapNode & n);
 
 	// Returns a CONTENT_IGNORE node if not found
-	MapNode getNodeNoEx(v3s16 p);
+	// If is_valid_position is not NULL, it tells whether the node was found
+	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL);
 
 	void unspreadLight(enum LightBank bank,
 			std::map<v3s16, u8> & from_nodes,
@@ -336,6 +410,8 @@ class Map /*: public NodeContainer*/
 
 protected:
 	friend class LuaVoxelManip;
+	// Sectors keep m_block_index up to date
+	friend class MapSector;
 
 	std::ostream &m_dout; // A bit deprecated, could be removed
 
@@ -345,6 +421,9 @@ class Map /*: public NodeContainer*/
 
 	std::map<v2s16, MapSector*> m_sectors;
 
+	// All the blocks in the sectors, for fast lookups
+	MapBlockIndex m_block_index;
+
 	// Be sure to set this to NULL when the cached sector is deleted
 	MapSector *m_sector_cache;
 	v2s16 m_sector_cache_p;
@@ -465,6 +544,21 @@ class ServerMap : public Map
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
+	/*
+		Loading in two steps, so that the disk access and decoding can be
+		done without the environment lock.
+		loadBlockDetached() reads the block from the database into a new
+		MapBlock that is not in the map; it returns NULL if the database
+		doesn't have it. The node ids are left as they are stored.
+		insertLoadedBlock() takes ownership of such a block, corrects
+		its node ids and puts it in the map; it needs the environment
+		lock and returns the block that ended up in the map.
+	*/
+	MapBlock* loadBlockDetached(v3s16 p);
+	MapBlock* insertLoadedBlock(MapBlock *block);
+	// Loads a block stored in the old flat file format
+	MapBlock* loadBlockFromFiles(v3s16 p);
+
 	// For debug printing
 	virtual void PrintInfo(std::ostream &out);
 
@@ -504,6 +598,15 @@ class ServerMap : public Map
 	*/
 	bool m_map_metadata_changed;
 	Database *dbase;
+
+	/*
+		Compresses and writes saved blocks in the background.
+		NULL if blocks are written right away (map_save_async = false).
+		m_dbase_mutex must be locked when using dbase, as blocks are
+		also read without the environment lock.
+	*/
+	MapSaveThread *m_save_thread;
+	JMutex m_dbase_mutex;
 };
 
 #define VMANIP_BLOCK_DATA_INEXIST     1
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <algorithm>
 #include "map.h"
 #include "light.h"
 #include "nodedef.h"
@@ -52,10 +53,13 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_uncorrected_nimap(NULL),
+		m_uncorrected_legacy(false),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
+		m_contents_expired(true),
 		m_generated(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
@@ -88,6 +92,8 @@ MapBlock::~MapBlock()
 
 	if(data)
 		delete[] data;
+
+	delete m_uncorrected_nimap;
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -126,23 +132,22 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		addContent(n.getContent());
 	}
 }
 
-MapNode MapBlock::getNodeParentNoEx(v3s16 p)
+MapNode MapBlock::getNodeParentNoEx(v3s16 p, bool *is_valid_position)
 {
-	if(isValidPosition(p) == false)
+	if(p.X < 0 || p.X >= MAP_BLOCKSIZE
+			|| p.Y < 0 || p.Y >= MAP_BLOCKSIZE
+			|| p.Z < 0 || p.Z >= MAP_BLOCKSIZE)
 	{
-		try{
-			return m_parent->getNode(getPosRelative() + p);
-		}
-		catch(InvalidPositionException &e)
-		{
-			return MapNode(CONTENT_IGNORE);
-		}
+		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
 	}
 	else
 	{
+		if(is_valid_position != NULL)
+			*is_valid_position = (data != NULL);
 		if(data == NULL)
 		{
 			return MapNode(CONTENT_IGNORE);
@@ -188,8 +193,11 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 			bool no_sunlight = false;
 			bool no_top_block = false;
 			// Check if node above block has sunlight
-			try{
-				MapNode n = getNodeParent(v3s16(x, MAP_BLOCKSIZE, z));
+			bool is_valid_position;
+			MapNode n = getNodeParentNoEx(v3s16(x, MAP_BLOCKSIZE, z),
+					&is_valid_position);
+			if(is_valid_position)
+			{
 				if(n.getContent() == CONTENT_IGNORE)
 				{
 					// Trust heuristics
@@ -200,7 +208,7 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 					no_sunlight = true;
 				}
 			}
-			catch(InvalidPositionException &e)
+			else
 			{
 				no_top_block = true;
 				
@@ -312,12 +320,12 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 				
 				Ignore non-transparent nodes as they always have no light
 			*/
-			try
-			{
 			if(block_below_is_valid)
 			{
-				MapNode n = getNodeParent(v3s16(x, -1, z));
-				if(nodemgr->get(n).light_propagates)
+				MapNode n = getNodeParentNoEx(v3s16(x, -1, z),
+						&is_valid_position);
+				// If there is no block below, no need to panic.
+				if(is_valid_position && nodemgr->get(n).light_propagates)
 				{
 					if(n.getLight(LIGHTBANK_DAY, nodemgr) == LIGHT_SUN
 							&& sunlight_should_go_down == false)
@@ -326,13 +334,6 @@ bool MapBlock::propagateSunlight(std::set<v3s16> & light_sources,
 							&& sunlight_should_go_down == true)
 						block_below_is_valid = false;
 				}
-			}//if
-			}//try
-			catch(InvalidPositionException &e)
-			{
-				/*std::cout<<"InvalidBlockException for bottom block node"
-						<<std::endl;*/
-				// Just no block below, no need to panic.
 			}
 		}
 	}
@@ -351,6 +352,29 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 			getPosRelative(), data_size);
 }
 
+void MapBlock::copyTo(VoxelManipulator &dst, const VoxelArea &area)
+{
+	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
+	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
+	v3s16 relpos = getPosRelative();
+
+	// Intersection of area and this block, in map coordinates
+	v3s16 minp(
+		MYMAX(area.MinEdge.X, relpos.X),
+		MYMAX(area.MinEdge.Y, relpos.Y),
+		MYMAX(area.MinEdge.Z, relpos.Z));
+	v3s16 maxp(
+		MYMIN(area.MaxEdge.X, relpos.X + MAP_BLOCKSIZE - 1),
+		MYMIN(area.MaxEdge.Y, relpos.Y + MAP_BLOCKSIZE - 1),
+		MYMIN(area.MaxEdge.Z, relpos.Z + MAP_BLOCKSIZE - 1));
+	if(minp.X > maxp.X || minp.Y > maxp.Y || minp.Z > maxp.Z)
+		return;
+
+	// Copy from data to VoxelManipulator
+	dst.copyFrom(data, data_area, minp - relpos,
+			minp, maxp - minp + v3s16(1,1,1));
+}
+
 void MapBlock::copyFrom(VoxelManipulator &dst)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
@@ -359,19 +383,24 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	// Copy from VoxelManipulator to data
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	m_contents_expired = true;
+	clearNetworkCache();
 }
 
 void MapBlock::actuallyUpdateDayNightDiff()
 {
-	INodeDefManager *nodemgr = m_gamedef->ndef();
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
+	m_day_night_differs = calcDayNightDiff();
+}
+
+bool MapBlock::calcDayNightDiff()
+{
+	INodeDefManager *nodemgr = m_gamedef->ndef();
 
 	if(data == NULL)
-	{
-		m_day_night_differs = false;
-		return;
-	}
+		return false;
 
 	bool differs = false;
 
@@ -408,8 +437,7 @@ void MapBlock::actuallyUpdateDayNightDiff()
 			differs = false;
 	}
 
-	// Set member variable
-	m_day_night_differs = differs;
+	return differs;
 }
 
 void MapBlock::expireDayNightDiff()
@@ -425,6 +453,29 @@ void MapBlock::expireDayNightDiff()
 	m_day_night_differs_expired = true;
 }
 
+void MapBlock::updateContents()
+{
+	m_contents_expired = false;
+	m_contents.clear();
+	if(data == NULL)
+		return;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	content_t last = CONTENT_IGNORE;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		content_t c = data[i].getContent();
+		// Runs of the same content are common
+		if(c == last && !m_contents.empty())
+			continue;
+		last = c;
+		m_contents.push_back(c);
+	}
+	std::sort(m_contents.begin(), m_contents.end());
+	m_contents.erase(std::unique(m_contents.begin(), m_contents.end()),
+			m_contents.end());
+}
+
 s16 MapBlock::getGroundLevel(v2s16 p2d)
 {
 	if(isDummy())
@@ -548,6 +599,14 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 
 void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 {
+	if(disk)
+	{
+		MapBlockDiskSnapshot snapshot;
+		serializeDiskSnapshot(snapshot, version);
+		snapshot.serialize(os);
+		return;
+	}
+
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
@@ -563,46 +622,18 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 				"version < 24 not possible");
 		
 	// First byte
-	u8 flags = 0;
-	if(is_underground)
-		flags |= 0x01;
-	if(getDayNightDiff())
-		flags |= 0x02;
-	if(m_lighting_expired)
-		flags |= 0x04;
-	if(m_generated == false)
-		flags |= 0x08;
-	writeU8(os, flags);
+	writeU8(os, getSerializationFlags());
 	
 	/*
 		Bulk node data
 	*/
-	NameIdMapping nimap;
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	if(disk)
-	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
-		delete[] tmp_nodes;
-	}
-	else
-	{
-		u8 content_width = 2;
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
-	}
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	MapNode::serializeBulk(os, version, data, nodecount,
+			content_width, params_width, true);
 	
 	/*
 		Node metadata
@@ -610,31 +641,106 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	std::ostringstream oss(std::ios_base::binary);
 	m_node_metadata.serialize(oss);
 	compressZlib(oss.str(), os);
+}
+
+void MapBlock::serializeDiskSnapshot(MapBlockDiskSnapshot &dst, u8 version)
+{
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	
+	if(data == NULL)
+	{
+		throw SerializationError("ERROR: Not writing dummy block.");
+	}
+	
+	// Can't do this anymore; we have 16-bit dynamically allocated node IDs
+	// in memory; conversion just won't work in this direction.
+	if(version < 24)
+		throw SerializationError("MapBlock::serialize: serialization to "
+				"version < 24 not possible");
+
+	dst.version = version;
+
+	// First byte
+	std::ostringstream head(std::ios_base::binary);
+	writeU8(head, getSerializationFlags());
+	
+	/*
+		Bulk node data
+	*/
+	NameIdMapping nimap;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	MapNode *tmp_nodes = new MapNode[nodecount];
+	for(u32 i=0; i<nodecount; i++)
+		tmp_nodes[i] = data[i];
+	getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
+
+	u8 content_width = 2;
+	u8 params_width = 2;
+	writeU8(head, content_width);
+	writeU8(head, params_width);
+	dst.head = head.str();
+
+	std::ostringstream nodes(std::ios_base::binary);
+	MapNode::serializeBulk(nodes, version, tmp_nodes, nodecount,
+			content_width, params_width, false);
+	delete[] tmp_nodes;
+	dst.nodes = nodes.str();
+	
+	/*
+		Node metadata
+	*/
+	std::ostringstream metadata(std::ios_base::binary);
+	m_node_metadata.serialize(metadata);
+	dst.metadata = metadata.str();
 
 	/*
 		Data that goes to disk, but not the network
 	*/
-	if(disk)
-	{
-		if(version <= 24){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	std::ostringstream os(std::ios_base::binary);
 
-		// Static objects
-		m_static_objects.serialize(os);
+	if(version <= 24){
+		// Node timers
+		m_node_timers.serialize(os, version);
+	}
 
-		// Timestamp
-		writeU32(os, getTimestamp());
+	// Static objects
+	m_static_objects.serialize(os);
 
-		// Write block-specific node definition id mapping
-		nimap.serialize(os);
-		
-		if(version >= 25){
-			// Node timers
-			m_node_timers.serialize(os, version);
-		}
+	// Timestamp
+	writeU32(os, getTimestamp());
+
+	// Write block-specific node definition id mapping
+	nimap.serialize(os);
+	
+	if(version >= 25){
+		// Node timers
+		m_node_timers.serialize(os, version);
 	}
+
+	dst.tail = os.str();
+}
+
+u8 MapBlock::getSerializationFlags()
+{
+	u8 flags = 0;
+	if(is_underground)
+		flags |= 0x01;
+	if(getDayNightDiff())
+		flags |= 0x02;
+	if(m_lighting_expired)
+		flags |= 0x04;
+	if(m_generated == false)
+		flags |= 0x08;
+	return flags;
+}
+
+void MapBlockDiskSnapshot::serialize(std::ostream &os) const
+{
+	os<<head;
+	compressZlib(nodes, os);
+	compressZlib(metadata, os);
+	os<<tail;
 }
 
 void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
@@ -652,7 +758,8 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os, u16 net_proto_version)
 	}
 }
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		bool defer_node_ids)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -660,10 +767,12 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())<<std::endl);
 
 	m_day_night_differs_expired = false;
+	m_contents_expired = true;
+	clearNetworkCache();
 
 	if(version <= 21)
 	{
-		deSerialize_pre22(is, version, disk);
+		deSerialize_pre22(is, version, disk, defer_node_ids);
 		return;
 	}
 
@@ -744,7 +853,13 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 				<<": NameIdMapping"<<std::endl);
 		NameIdMapping nimap;
 		nimap.deSerialize(is);
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if(defer_node_ids){
+			delete m_uncorrected_nimap;
+			m_uncorrected_nimap = new NameIdMapping(nimap);
+			m_uncorrected_legacy = false;
+		} else {
+			correctBlockNodeIds(&nimap, data, m_gamedef);
+		}
 
 		if(version >= 25){
 			TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
@@ -757,6 +872,23 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 			<<": Done."<<std::endl);
 }
 
+void MapBlock::correctNodeIds()
+{
+	if(m_uncorrected_nimap == NULL)
+		return;
+
+	correctBlockNodeIds(m_uncorrected_nimap, data, m_gamedef);
+	m_contents_expired = true;
+	delete m_uncorrected_nimap;
+	m_uncorrected_nimap = NULL;
+
+	if(m_uncorrected_legacy)
+	{
+		m_uncorrected_legacy = false;
+		convertLegacyContents();
+	}
+}
+
 void MapBlock::deSerializeNetworkSpecific(std::istream &is)
 {
 	try {
@@ -779,7 +911,8 @@ void MapBlock::deSerializeNetworkSpecific(std::istream &is)
 	Legacy serialization
 */
 
-void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
+void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk,
+		bool defer_node_ids)
 {
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
@@ -961,12 +1094,23 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 		} else {
 			content_mapnode_get_name_id_mapping(&nimap);
 		}
+		if(defer_node_ids){
+			delete m_uncorrected_nimap;
+			m_uncorrected_nimap = new NameIdMapping(nimap);
+			m_uncorrected_legacy = true;
+			return;
+		}
 		correctBlockNodeIds(&nimap, data, m_gamedef);
 	}
 
+	convertLegacyContents();
+}
 
+void MapBlock::convertLegacyContents()
+{
 	// Legacy data changes
 	// This code has to convert from pre-22 to post-22 format.
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 	INodeDefManager *nodedef = m_gamedef->ndef();
 	for(u32 i=0; i<nodecount; i++)
 	{
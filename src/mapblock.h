@@ -21,6 +21,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #define MAPBLOCK_HEADER
 
 #include <set>
+#include <map>
+#include <vector>
+#include <algorithm>
 #include "debug.h"
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -31,12 +34,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodetimer.h"
 #include "modifiedstate.h"
 #include "util/numeric.h" // getContainerPos
+#include "util/pointer.h"
 
 class Map;
 class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
+class NameIdMapping;
 class VoxelManipulator;
+class VoxelArea;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -97,6 +103,25 @@ class NodeContainer
 };
 #endif
 
+/*
+	On-disk serialization of a MapBlock with the zlib compression not
+	done yet, so that it can be finished later without the block.
+*/
+struct MapBlockDiskSnapshot
+{
+	u8 version;
+	// Flags and content and params widths
+	std::string head;
+	// Bulk node data and node metadata, not compressed
+	std::string nodes;
+	std::string metadata;
+	// Everything after the node metadata
+	std::string tail;
+
+	// Writes what MapBlock::serialize(os, version, true) would have
+	void serialize(std::ostream &os) const;
+};
+
 /*
 	MapBlock itself
 */
@@ -127,6 +152,7 @@ class MapBlock /*: public NodeContainer*/
 			//data[i] = MapNode();
 			data[i] = MapNode(CONTENT_IGNORE);
 		}
+		m_contents_expired = true;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -147,6 +173,7 @@ class MapBlock /*: public NodeContainer*/
 	// m_modified methods
 	void raiseModified(u32 mod, const std::string &reason="unknown")
 	{
+		clearNetworkCache();
 		if(mod > m_modified){
 			m_modified = mod;
 			m_modified_reason = reason;
@@ -181,6 +208,37 @@ class MapBlock /*: public NodeContainer*/
 		m_modified_reason_too_long = false;
 	}
 	
+	/*
+		Network cache: the data sent to clients, built once and shared by
+		every client that uses the same serialization and protocol
+		version. Anything that changes what serialize() or
+		serializeNetworkSpecific() write must clear it; raiseModified()
+		does so.
+		It is kept as plain bytes: the reference count of a SharedBuffer
+		is not thread-safe and the connection threads release the
+		buffers they are given.
+	*/
+	bool getNetworkCache(u8 ser_ver, u16 net_proto_version,
+			std::string &data)
+	{
+		std::map<u32, std::string>::iterator i =
+				m_network_cache.find(getNetworkCacheKey(ser_ver, net_proto_version));
+		if(i == m_network_cache.end())
+			return false;
+		data = i->second;
+		return true;
+	}
+	void setNetworkCache(u8 ser_ver, u16 net_proto_version,
+			const std::string &data)
+	{
+		m_network_cache[getNetworkCacheKey(ser_ver, net_proto_version)] = data;
+	}
+	void clearNetworkCache()
+	{
+		if(!m_network_cache.empty())
+			m_network_cache.clear();
+	}
+
 	// is_underground getter/setter
 	bool getIsUnderground()
 	{
@@ -275,13 +333,14 @@ class MapBlock /*: public NodeContainer*/
 		return getNode(p.X, p.Y, p.Z);
 	}
 	
-	MapNode getNodeNoEx(v3s16 p)
+	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL)
 	{
-		try{
-			return getNode(p.X, p.Y, p.Z);
-		}catch(InvalidPositionException &e){
+		bool valid = isValidPosition(p);
+		if(is_valid_position != NULL)
+			*is_valid_position = valid;
+		if(!valid)
 			return MapNode(CONTENT_IGNORE);
-		}
+		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
 	}
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
@@ -292,6 +351,7 @@ class MapBlock /*: public NodeContainer*/
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		addContent(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -321,6 +381,7 @@ class MapBlock /*: public NodeContainer*/
 		if(data == NULL)
 			throw InvalidPositionException();
 		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		addContent(n.getContent());
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -336,7 +397,7 @@ class MapBlock /*: public NodeContainer*/
 	bool isValidPositionParent(v3s16 p);
 	MapNode getNodeParent(v3s16 p);
 	void setNodeParent(v3s16 p, MapNode & n);
-	MapNode getNodeParentNoEx(v3s16 p);
+	MapNode getNodeParentNoEx(v3s16 p, bool *is_valid_position = NULL);
 
 	void drawbox(s16 x0, s16 y0, s16 z0, s16 w, s16 h, s16 d, MapNode node)
 	{
@@ -352,6 +413,8 @@ class MapBlock /*: public NodeContainer*/
 	
 	// Copies data to VoxelManipulator to getPosRelative()
 	void copyTo(VoxelManipulator &dst);
+	// Like copyTo(dst), but only copies the nodes that are inside area
+	void copyTo(VoxelManipulator &dst, const VoxelArea &area);
 	// Copies data from VoxelManipulator getPosRelative()
 	void copyFrom(VoxelManipulator &dst);
 
@@ -361,6 +424,8 @@ class MapBlock /*: public NodeContainer*/
 		These methods don't care about neighboring blocks.
 	*/
 	void actuallyUpdateDayNightDiff();
+	// Computes the flag without touching the block
+	bool calcDayNightDiff();
 	/*
 		Call this to schedule what the previous function does to be done
 		when the value is actually needed.
@@ -374,6 +439,30 @@ class MapBlock /*: public NodeContainer*/
 		return m_day_night_differs;
 	}
 
+	/*
+		Same as the above, but leaves the flag expired instead of
+		storing the result. Can be called from several threads at once.
+	*/
+	bool getDayNightDiffNoUpdate()
+	{
+		if(m_day_night_differs_expired)
+			return calcDayNightDiff();
+		return m_day_night_differs;
+	}
+
+	/*
+		Sorted list of the content IDs of the nodes in the block.
+		Setting a node only adds its content, so after that the list
+		may also contain contents that are no longer in the block.
+		It is rebuilt when the whole block changes.
+	*/
+	const std::vector<content_t> & getContents()
+	{
+		if(m_contents_expired)
+			updateContents();
+		return m_contents;
+	}
+
 	/*
 		Miscellaneous stuff
 	*/
@@ -469,9 +558,17 @@ class MapBlock /*: public NodeContainer*/
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
 	void serialize(std::ostream &os, u8 version, bool disk);
+	// Takes what serialize(os, version, true) needs from the block
+	void serializeDiskSnapshot(MapBlockDiskSnapshot &dst, u8 version);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// If defer_node_ids == true, the node definitions are not touched and
+	// the stored ids are left for correctNodeIds(), so that decoding can
+	// be done without the environment lock
+	void deSerialize(std::istream &is, u8 version, bool disk,
+			bool defer_node_ids=false);
+	// Does what deSerialize() left out; needs the environment lock
+	void correctNodeIds();
 
 	void serializeNetworkSpecific(std::ostream &os, u16 net_proto_version);
 	void deSerializeNetworkSpecific(std::istream &is);
@@ -481,7 +578,25 @@ class MapBlock /*: public NodeContainer*/
 		Private methods
 	*/
 
-	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
+	void deSerialize_pre22(std::istream &is, u8 version, bool disk,
+			bool defer_node_ids);
+	// Converts the contents of blocks older than version 22
+	void convertLegacyContents();
+
+	// First byte of the serialized block
+	u8 getSerializationFlags();
+
+	void updateContents();
+	// Keeps the list of getContents() up to date when a node is set
+	void addContent(content_t c)
+	{
+		if(m_contents_expired)
+			return;
+		std::vector<content_t>::iterator i = std::lower_bound(
+				m_contents.begin(), m_contents.end(), c);
+		if(i == m_contents.end() || *i != c)
+			m_contents.insert(i, c);
+	}
 
 	/*
 		Used only internally, because changes can't be tracked
@@ -501,6 +616,11 @@ class MapBlock /*: public NodeContainer*/
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	static u32 getNetworkCacheKey(u8 ser_ver, u16 net_proto_version)
+	{
+		return ((u32)ser_ver << 16) | net_proto_version;
+	}
+
 public:
 	/*
 		Public member variables
@@ -545,6 +665,17 @@ class MapBlock /*: public NodeContainer*/
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
 
+	/*
+		Set by deSerialize() if correcting the node ids was deferred.
+		m_uncorrected_legacy tells that convertLegacyContents() has to
+		be done after it.
+	*/
+	NameIdMapping *m_uncorrected_nimap;
+	bool m_uncorrected_legacy;
+
+	// See getNetworkCache(); keyed by getNetworkCacheKey()
+	std::map<u32, std::string> m_network_cache;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -568,6 +699,10 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs;
 	bool m_day_night_differs_expired;
 
+	// See getContents()
+	std::vector<content_t> m_contents;
+	bool m_contents_expired;
+
 	bool m_generated;
 	
 	/*
@@ -64,10 +64,13 @@ void MeshMakeData::fill(MapBlock *block)
 		Copy data
 	*/
 
-	// Allocate this block + neighbors
+	// Allocate this block and a one node thick shell around it.
+	// The mesh generator looks no further than the direct neighbors of
+	// the nodes of the block.
+	VoxelArea area(blockpos_nodes-v3s16(1,1,1),
+			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE);
 	m_vmanip.clear();
-	m_vmanip.addArea(VoxelArea(blockpos_nodes-v3s16(1,1,1)*MAP_BLOCKSIZE,
-			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE*2-v3s16(1,1,1)));
+	m_vmanip.addArea(area);
 
 	{
 		//TimeTaker timer("copy central block data");
@@ -81,8 +84,8 @@ void MeshMakeData::fill(MapBlock *block)
 		// 0ms
 
 		/*
-			Copy neighbors. This is lightning fast.
-			Copying only the borders would be *very* slow.
+			Copy the parts of the neighbors that are in the shell.
+			These are copied row by row, like the central block.
 		*/
 		
 		// Get map
@@ -94,7 +97,7 @@ void MeshMakeData::fill(MapBlock *block)
 			v3s16 bp = m_blockpos + dir;
 			MapBlock *b = map->getBlockNoCreateNoEx(bp);
 			if(b)
-				b->copyTo(m_vmanip);
+				b->copyTo(m_vmanip, area);
 		}
 	}
 }
@@ -104,12 +107,12 @@ void MeshMakeData::fillSingleNode(MapNode *node)
 	m_blockpos = v3s16(0,0,0);
 	
 	v3s16 blockpos_nodes = v3s16(0,0,0);
-	VoxelArea area(blockpos_nodes-v3s16(1,1,1)*MAP_BLOCKSIZE,
-			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE*2-v3s16(1,1,1));
+	VoxelArea area(blockpos_nodes-v3s16(1,1,1),
+			blockpos_nodes+v3s16(1,1,1)*MAP_BLOCKSIZE);
 	s32 volume = area.getVolume();
 	s32 our_node_index = area.index(1,1,1);
 
-	// Allocate this block + neighbors
+	// Allocate this block + shell
 	m_vmanip.clear();
 	m_vmanip.addArea(area);
 
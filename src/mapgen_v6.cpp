@@ -473,38 +473,36 @@ void MapgenV6::calculateNoise() {
 
 	// Need to adjust for the original implementation's +.5 offset...
 	if (!(flags & MG_FLAT)) {
-		noise_terrain_base->perlinMap2D(
+		noise_batch.add2D(noise_terrain_base,
 			x + 0.5 * noise_terrain_base->np->spread.X,
-			z + 0.5 * noise_terrain_base->np->spread.Z);
-		noise_terrain_base->transformNoiseMap();
+			z + 0.5 * noise_terrain_base->np->spread.Z, true);
 
-		noise_terrain_higher->perlinMap2D(
+		noise_batch.add2D(noise_terrain_higher,
 			x + 0.5 * noise_terrain_higher->np->spread.X,
-			z + 0.5 * noise_terrain_higher->np->spread.Z);
-		noise_terrain_higher->transformNoiseMap();
+			z + 0.5 * noise_terrain_higher->np->spread.Z, true);
 
-		noise_steepness->perlinMap2D(
+		noise_batch.add2D(noise_steepness,
 			x + 0.5 * noise_steepness->np->spread.X,
-			z + 0.5 * noise_steepness->np->spread.Z);
-		noise_steepness->transformNoiseMap();
+			z + 0.5 * noise_steepness->np->spread.Z, true);
 
-		noise_height_select->perlinMap2D(
+		noise_batch.add2D(noise_height_select,
 			x + 0.5 * noise_height_select->np->spread.X,
-			z + 0.5 * noise_height_select->np->spread.Z);
+			z + 0.5 * noise_height_select->np->spread.Z, false);
 
-		noise_mud->perlinMap2D(
+		noise_batch.add2D(noise_mud,
 			x + 0.5 * noise_mud->np->spread.X,
-			z + 0.5 * noise_mud->np->spread.Z);
-		noise_mud->transformNoiseMap();
+			z + 0.5 * noise_mud->np->spread.Z, true);
 	}
 
-	noise_beach->perlinMap2D(
+	noise_batch.add2D(noise_beach,
 		x + 0.2 * noise_beach->np->spread.X,
-		z + 0.7 * noise_beach->np->spread.Z);
+		z + 0.7 * noise_beach->np->spread.Z, false);
 
-	noise_biome->perlinMap2D(
+	noise_batch.add2D(noise_biome,
 		x + 0.6 * noise_biome->np->spread.X,
-		z + 0.2 * noise_biome->np->spread.Z);
+		z + 0.2 * noise_biome->np->spread.Z, false);
+
+	noise_batch.run(emerge->noise_pool);
 }
 
 
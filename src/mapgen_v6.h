@@ -101,6 +101,7 @@ class MapgenV6 : public Mapgen {
 	Noise *noise_mud;
 	Noise *noise_beach;
 	Noise *noise_biome;
+	NoiseMapBatch noise_batch;
 	NoiseParams *np_cave;
 	NoiseParams *np_humidity;
 	NoiseParams *np_trees;
@@ -244,36 +244,32 @@ void MapgenV7::calculateNoise() {
 	int y = node_min.Y;
 	int z = node_min.Z;
 	
-	noise_height_select->perlinMap2D(x, z);
-	noise_height_select->transformNoiseMap();
-	
-	noise_terrain_persist->perlinMap2D(x, z);
-	noise_terrain_persist->transformNoiseMap();
-	float *persistmap = noise_terrain_persist->result;
-	for (int i = 0; i != csize.X * csize.Z; i++)
-		persistmap[i] = rangelim(persistmap[i], 0.4, 0.9);
-	
-	noise_terrain_base->perlinMap2DModulated(x, z, persistmap);
-	noise_terrain_base->transformNoiseMap();
-	
-	noise_terrain_alt->perlinMap2DModulated(x, z, persistmap);
-	noise_terrain_alt->transformNoiseMap();
-	
-	noise_filler_depth->perlinMap2D(x, z);
+	// Everything but the terrain maps, which depend on the persistence map
+	noise_batch.add2D(noise_height_select, x, z, true);
+	noise_batch.add2D(noise_terrain_persist, x, z, true);
+	noise_batch.add2D(noise_filler_depth, x, z, false);
 	
 	if (flags & MGV7_MOUNTAINS) {
-		noise_mountain->perlinMap3D(x, y, z);
-		noise_mount_height->perlinMap2D(x, z);
-		noise_mount_height->transformNoiseMap();
+		noise_batch.add3D(noise_mountain, x, y, z, false);
+		noise_batch.add2D(noise_mount_height, x, z, true);
 	}
 
 	if (flags & MGV7_RIDGES) {
-		noise_ridge->perlinMap3D(x, y, z);
-		noise_ridge_uwater->perlinMap2D(x, z);
+		noise_batch.add3D(noise_ridge, x, y, z, false);
+		noise_batch.add2D(noise_ridge_uwater, x, z, false);
 	}
 	
-	noise_heat->perlinMap2D(x, z);
-	noise_humidity->perlinMap2D(x, z);
+	noise_batch.add2D(noise_heat, x, z, false);
+	noise_batch.add2D(noise_humidity, x, z, false);
+	noise_batch.run(emerge->noise_pool);
+	
+	float *persistmap = noise_terrain_persist->result;
+	for (int i = 0; i != csize.X * csize.Z; i++)
+		persistmap[i] = rangelim(persistmap[i], 0.4, 0.9);
+	
+	noise_batch.add2DModulated(noise_terrain_base, x, z, persistmap, true);
+	noise_batch.add2DModulated(noise_terrain_alt, x, z, persistmap, true);
+	noise_batch.run(emerge->noise_pool);
 	
 	//printf("calculateNoise: %dus\n", t.stop());
 }
@@ -91,6 +91,8 @@ class MapgenV7 : public Mapgen {
 	Noise *noise_heat;
 	Noise *noise_humidity;
 	
+	NoiseMapBatch noise_batch;
+	
 	content_t c_stone;
 	content_t c_dirt;
 	content_t c_dirt_with_grass;
@@ -183,6 +183,13 @@ void ContentFeatures::reset()
 	has_on_construct = false;
 	has_on_destruct = false;
 	has_after_destruct = false;
+	// Matches the default NODEBOX_REGULAR node_box
+	collision_boxes.assign(1, aabb3f(-BS/2,-BS/2,-BS/2,BS/2,BS/2,BS/2));
+	collision_box_offsets.clear();
+	collision_box_offsets.push_back(0);
+	collision_box_offsets.push_back(1);
+	collision_param2_mask = 0;
+	bouncy = 0;
 	/*
 		Actual data
 
@@ -390,6 +397,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			// Insert directly into containers
 			content_t c = CONTENT_UNKNOWN;
 			m_content_features[c] = f;
+			updateCollisionData(c);
 			addNameIdMapping(c, f.name);
 		}
 
@@ -408,6 +416,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			// Insert directly into containers
 			content_t c = CONTENT_AIR;
 			m_content_features[c] = f;
+			updateCollisionData(c);
 			addNameIdMapping(c, f.name);
 		}
 
@@ -427,6 +436,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			// Insert directly into containers
 			content_t c = CONTENT_IGNORE;
 			m_content_features[c] = f;
+			updateCollisionData(c);
 			addNameIdMapping(c, f.name);
 		}
 	}
@@ -547,6 +557,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			addNameIdMapping(id, name);
 		}
 		m_content_features[id] = def;
+		updateCollisionData(id);
 		verbosestream<<"NodeDefManager: registering content id \""<<id
 				<<"\": name=\""<<def.name<<"\""<<std::endl;
 
@@ -844,6 +855,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			if(i >= m_content_features.size())
 				m_content_features.resize((u32)(i) + 1);
 			m_content_features[i] = f;
+			updateCollisionData(i);
 			addNameIdMapping(i, f.name);
 			verbosestream<<"deserialized "<<f.name<<std::endl;
 		}
@@ -854,6 +866,44 @@ class CNodeDefManager: public IWritableNodeDefManager
 		m_name_id_mapping.set(i, name);
 		m_name_id_mapping_with_aliases.insert(std::make_pair(name, i));
 	}
+	// Builds the cached collision boxes and bouncy value of a content.
+	// The boxes of every param2 value that can change them are stored, so
+	// that collision detection can look them up without allocating.
+	void updateCollisionData(content_t c)
+	{
+		ContentFeatures &f = m_content_features[c];
+		f.bouncy = itemgroup_get(f.groups, "bouncy");
+
+		switch(f.node_box.type)
+		{
+		case NODEBOX_FIXED:
+			f.collision_param2_mask =
+					f.param_type_2 == CPT2_FACEDIR ? 0x1F : 0;
+			break;
+		case NODEBOX_WALLMOUNTED:
+			f.collision_param2_mask =
+					f.param_type_2 == CPT2_WALLMOUNTED ? 0x07 : 0;
+			break;
+		case NODEBOX_LEVELED:
+			f.collision_param2_mask = 0xFF;
+			break;
+		default: // NODEBOX_REGULAR
+			f.collision_param2_mask = 0;
+			break;
+		}
+
+		f.collision_boxes.clear();
+		f.collision_box_offsets.clear();
+		for(u32 param2 = 0; param2 <= f.collision_param2_mask; param2++)
+		{
+			f.collision_box_offsets.push_back(f.collision_boxes.size());
+			std::vector<aabb3f> boxes =
+					MapNode(c, 0, param2).getNodeBoxes(this);
+			f.collision_boxes.insert(f.collision_boxes.end(),
+					boxes.begin(), boxes.end());
+		}
+		f.collision_box_offsets.push_back(f.collision_boxes.size());
+	}
 private:
 	// Features indexed by id
 	std::vector<ContentFeatures> m_content_features;
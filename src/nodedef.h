@@ -173,6 +173,18 @@ struct ContentFeatures
 	bool has_on_destruct;
 	bool has_after_destruct;
 
+	// Collision data cached by the node definition manager from node_box
+	// and groups, see getCollisionBoxes()
+	// Collision boxes of every param2 variant, one variant after another
+	std::vector<aabb3f> collision_boxes;
+	// Index of the first box of each variant in collision_boxes, followed
+	// by collision_boxes.size()
+	std::vector<u32> collision_box_offsets;
+	// Bits of param2 that the collision boxes depend on
+	u8 collision_param2_mask;
+	// Value of the "bouncy" group
+	int bouncy;
+
 	/*
 		Actual data
 	*/
@@ -267,6 +279,15 @@ struct ContentFeatures
 		if(!isLiquid() || !f.isLiquid()) return false;
 		return (liquid_alternative_flowing == f.liquid_alternative_flowing);
 	}
+	// Collision boxes of a node of this type with the given param2,
+	// relative to the node position. Same as MapNode::getNodeBoxes(), but
+	// without allocating. Returns the number of boxes.
+	u32 getCollisionBoxes(u8 param2, const aabb3f **boxes) const{
+		u32 variant = param2 & collision_param2_mask;
+		u32 first = collision_box_offsets[variant];
+		*boxes = collision_boxes.empty() ? NULL : &collision_boxes[0] + first;
+		return collision_box_offsets[variant + 1] - first;
+	}
 };
 
 class INodeDefManager
@@ -24,6 +24,18 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string.h> // memset
 #include "debug.h"
 #include "util/numeric.h"
+#include "util/workerpool.h"
+
+/*
+	The noise map kernels have SSE2 versions, which is always available on
+	x86-64. They do the same float operations in the same order as the
+	scalar code, so the results are the same bit for bit.
+*/
+#if defined(__SSE2__) || defined(_M_X64) || \
+		(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define NOISE_SSE2
+	#include <emmintrin.h>
+#endif
 
 #define NOISE_MAGIC_X    1619
 #define NOISE_MAGIC_Y    31337
@@ -40,21 +52,93 @@ float cos_lookup[16] = {
 
 
 //noise poly:  p(n) = 60493n^3 + 19990303n + 137612589
+/*
+	The hash used to be done with int, relying on wrap-around. Optimized
+	builds assumed the polynomial can't overflow and dropped its final
+	& 0x7fffffff, so the value could be negative and the noise reach 3.
+	Worlds were generated with that, so it is kept; the unsigned
+	arithmetic gives the same result without undefined behaviour.
+*/
 float noise2d(int x, int y, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+	u32 n = ((u32)NOISE_MAGIC_X * x + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_SEED * seed) & 0x7fffffff;
 	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	n = n * (n * n * 60493 + 19990303) + 1376312589;
+	return 1.f - (float)(s32)n / 0x40000000;
 }
 
 
 float noise3d(int x, int y, int z, int seed) {
-	int n = (NOISE_MAGIC_X * x + NOISE_MAGIC_Y * y + NOISE_MAGIC_Z * z
-			+ NOISE_MAGIC_SEED * seed) & 0x7fffffff;
+	u32 n = ((u32)NOISE_MAGIC_X * x + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_Z * z + (u32)NOISE_MAGIC_SEED * seed) & 0x7fffffff;
 	n = (n >> 13) ^ n;
-	n = (n * (n * n * 60493 + 19990303) + 1376312589) & 0x7fffffff;
-	return 1.f - (float)n / 0x40000000;
+	n = n * (n * n * 60493 + 19990303) + 1376312589;
+	return 1.f - (float)(s32)n / 0x40000000;
+}
+
+
+#ifdef NOISE_SSE2
+// SSE2 has no 32-bit multiply that keeps the low halves, so build one
+static inline __m128i mullo_epi32(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd  = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+	return _mm_unpacklo_epi32(
+		_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+		_mm_shuffle_epi32(odd,  _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+// The part of noise2d() and noise3d() after the coordinates are combined
+static inline __m128 noiseHash4(__m128i n) {
+	const __m128i mask = _mm_set1_epi32(0x7fffffff);
+	n = _mm_and_si128(n, mask);
+	n = _mm_xor_si128(_mm_srli_epi32(n, 13), n);
+	__m128i t = mullo_epi32(mullo_epi32(n, n), _mm_set1_epi32(60493));
+	t = mullo_epi32(n, _mm_add_epi32(t, _mm_set1_epi32(19990303)));
+	t = _mm_add_epi32(t, _mm_set1_epi32(1376312589));
+	// Dividing by a power of two is exact, so this is the same as the division
+	__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(t), _mm_set1_ps(1.f / 0x40000000));
+	return _mm_sub_ps(_mm_set1_ps(1.f), f);
+}
+#endif
+
+
+// out[i] = noise2d(x0 + i, y, seed) for i in [0, count)
+static void noise2dRow(float *out, int x0, int y, int count, int seed) {
+	int i = 0;
+#ifdef NOISE_SSE2
+	// Unsigned so that the wrap-around is well-defined
+	u32 n = (u32)NOISE_MAGIC_X * x0 + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_SEED * seed;
+	__m128i nv = _mm_add_epi32(_mm_set1_epi32(n),
+		_mm_setr_epi32(0, NOISE_MAGIC_X, 2 * NOISE_MAGIC_X, 3 * NOISE_MAGIC_X));
+	const __m128i nstep = _mm_set1_epi32(4 * NOISE_MAGIC_X);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(&out[i], noiseHash4(nv));
+		nv = _mm_add_epi32(nv, nstep);
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = noise2d(x0 + i, y, seed);
+}
+
+
+// out[i] = noise3d(x0 + i, y, z, seed) for i in [0, count)
+static void noise3dRow(float *out, int x0, int y, int z, int count, int seed) {
+	int i = 0;
+#ifdef NOISE_SSE2
+	u32 n = (u32)NOISE_MAGIC_X * x0 + (u32)NOISE_MAGIC_Y * y
+			+ (u32)NOISE_MAGIC_Z * z + (u32)NOISE_MAGIC_SEED * seed;
+	__m128i nv = _mm_add_epi32(_mm_set1_epi32(n),
+		_mm_setr_epi32(0, NOISE_MAGIC_X, 2 * NOISE_MAGIC_X, 3 * NOISE_MAGIC_X));
+	const __m128i nstep = _mm_set1_epi32(4 * NOISE_MAGIC_X);
+	for (; i + 4 <= count; i += 4) {
+		_mm_storeu_ps(&out[i], noiseHash4(nv));
+		nv = _mm_add_epi32(nv, nstep);
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = noise3d(x0 + i, y, z, seed);
 }
 
 
@@ -289,10 +373,39 @@ void Noise::init(NoiseParams *np, int seed, int sx, int sy, int sz) {
 	this->sz   = sz;
 
 	this->noisebuf = NULL;
+	this->buf      = NULL;
+	this->result   = NULL;
+	this->colindex = NULL;
+	this->colfrac  = NULL;
+	this->gbuf     = NULL;
+
+	this->noisebuf_size = 0;
+	this->map_size      = 0;
+	this->col_size      = 0;
+	this->gbuf_size     = 0;
+
 	resizeNoiseBuf(sz > 1);
+	resizeMapBufs();
+}
+
+
+// buf and result are only reallocated when they have to grow
+void Noise::resizeMapBufs() {
+	if (sx * sy * sz > map_size) {
+		map_size = sx * sy * sz;
+		delete[] buf;
+		delete[] result;
+		buf    = new float[map_size];
+		result = new float[map_size];
+	}
 
-	this->buf    = new float[sx * sy * sz];
-	this->result = new float[sx * sy * sz];
+	if (sx > col_size) {
+		col_size = sx;
+		delete[] colindex;
+		delete[] colfrac;
+		colindex = new int[col_size];
+		colfrac  = new float[col_size];
+	}
 }
 
 
@@ -300,6 +413,9 @@ Noise::~Noise() {
 	delete[] buf;
 	delete[] result;
 	delete[] noisebuf;
+	delete[] colindex;
+	delete[] colfrac;
+	delete[] gbuf;
 }
 
 
@@ -313,13 +429,8 @@ void Noise::setSize(int sx, int sy, int sz) {
 	this->sy = sy;
 	this->sz = sz;
 
-	this->noisebuf = NULL;
 	resizeNoiseBuf(sz > 1);
-
-	delete[] buf;
-	delete[] result;
-	this->buf    = new float[sx * sy * sz];
-	this->result = new float[sx * sy * sz];
+	resizeMapBufs();
 }
 
 
@@ -352,9 +463,11 @@ void Noise::resizeNoiseBuf(bool is3d) {
 	nly = (int)(sy * ofactor / np->spread.Y) + 3;
 	nlz = is3d ? (int)(sz * ofactor / np->spread.Z) + 3 : 1;
 
-	if (noisebuf)
+	if (nlx * nly * nlz > noisebuf_size) {
+		noisebuf_size = nlx * nly * nlz;
 		delete[] noisebuf;
-	noisebuf = new float[nlx * nly * nlz];
+		noisebuf = new float[noisebuf_size];
+	}
 }
 
 
@@ -369,49 +482,82 @@ void Noise::resizeNoiseBuf(bool is3d) {
  * values from the previous noise lattice as midpoints in the new lattice for the
  * next octave.
  */
+/*
+ * Every row of a map steps through the lattice columns the same way, so the
+ * column and the interpolation factor of each x are worked out once.
+ * This keeps the exact float arithmetic of stepping u one by one.
+ */
+void Noise::calcColumns(float u, float step_x, bool ease) {
+	int noisex = 0;
+	for (int i = 0; i != sx; i++) {
+		colindex[i] = noisex;
+		colfrac[i]  = ease ? easeCurve(u) : u;
+		u += step_x;
+		if (u >= 1.0) {
+			u -= 1.0;
+			noisex++;
+		}
+	}
+}
+
+
 #define idx(x, y) ((y) * nlx + (x))
 void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed) {
-	float v00, v01, v10, v11, u, v, orig_u;
-	int index, i, j, x0, y0, noisex, noisey;
+	float v00, v01, v10, v11, u, v, ty;
+	int index, i, j, x0, y0, noisey;
 	int nlx, nly;
 
 	x0 = floor(x);
 	y0 = floor(y);
 	u = x - (float)x0;
 	v = y - (float)y0;
-	orig_u = u;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
-	index = 0;
 	for (j = 0; j != nly; j++)
-		for (i = 0; i != nlx; i++)
-			noisebuf[index++] = noise2d(x0 + i, y0 + j, seed);
+		noise2dRow(&noisebuf[idx(0, j)], x0, y0 + j, nlx, seed);
+
+	calcColumns(u, step_x, true);
 
 	//calculate interpolations
 	index  = 0;
 	noisey = 0;
 	for (j = 0; j != sy; j++) {
-		v00 = noisebuf[idx(0, noisey)];
-		v10 = noisebuf[idx(1, noisey)];
-		v01 = noisebuf[idx(0, noisey + 1)];
-		v11 = noisebuf[idx(1, noisey + 1)];
-
-		u = orig_u;
-		noisex = 0;
-		for (i = 0; i != sx; i++) {
-			buf[index++] = biLinearInterpolation(v00, v10, v01, v11, u, v);
-			u += step_x;
-			if (u >= 1.0) {
-				u -= 1.0;
-				noisex++;
-				v00 = v10;
-				v01 = v11;
-				v10 = noisebuf[idx(noisex + 1, noisey)];
-				v11 = noisebuf[idx(noisex + 1, noisey + 1)];
-			}
+		const float *row0 = &noisebuf[idx(0, noisey)];
+		const float *row1 = &noisebuf[idx(0, noisey + 1)];
+		ty = easeCurve(v);
+
+		i = 0;
+#ifdef NOISE_SSE2
+		__m128 tyv = _mm_set1_ps(ty);
+		for (; i + 4 <= sx; i += 4) {
+			const int *c = &colindex[i];
+			__m128 tx  = _mm_loadu_ps(&colfrac[i]);
+			__m128 a00 = _mm_setr_ps(row0[c[0]], row0[c[1]], row0[c[2]], row0[c[3]]);
+			__m128 a10 = _mm_setr_ps(row0[c[0] + 1], row0[c[1] + 1],
+									 row0[c[2] + 1], row0[c[3] + 1]);
+			__m128 a01 = _mm_setr_ps(row1[c[0]], row1[c[1]], row1[c[2]], row1[c[3]]);
+			__m128 a11 = _mm_setr_ps(row1[c[0] + 1], row1[c[1] + 1],
+									 row1[c[2] + 1], row1[c[3] + 1]);
+			__m128 iu = _mm_add_ps(a00, _mm_mul_ps(_mm_sub_ps(a10, a00), tx));
+			__m128 iv = _mm_add_ps(a01, _mm_mul_ps(_mm_sub_ps(a11, a01), tx));
+			_mm_storeu_ps(&buf[index + i],
+				_mm_add_ps(iu, _mm_mul_ps(_mm_sub_ps(iv, iu), tyv)));
 		}
+#endif
+		for (; i != sx; i++) {
+			int c = colindex[i];
+			v00 = row0[c];
+			v10 = row0[c + 1];
+			v01 = row1[c];
+			v11 = row1[c + 1];
+			float tx = colfrac[i];
+			buf[index + i] = linearInterpolation(
+				linearInterpolation(v00, v10, tx),
+				linearInterpolation(v01, v11, tx), ty);
+		}
+		index += sx;
 
 		v += step_y;
 		if (v >= 1.0) {
@@ -427,10 +573,8 @@ void Noise::gradientMap2D(float x, float y, float step_x, float step_y, int seed
 void Noise::gradientMap3D(float x, float y, float z,
 						  float step_x, float step_y, float step_z,
 						  int seed) {
-	float v000, v010, v100, v110;
-	float v001, v011, v101, v111;
-	float u, v, w, orig_u, orig_v;
-	int index, i, j, k, x0, y0, z0, noisex, noisey, noisez;
+	float u, v, w, orig_v;
+	int index, i, j, k, x0, y0, z0, noisey, noisez;
 	int nlx, nly, nlz;
 
 	x0 = floor(x);
@@ -439,57 +583,59 @@ void Noise::gradientMap3D(float x, float y, float z,
 	u = x - (float)x0;
 	v = y - (float)y0;
 	w = z - (float)z0;
-	orig_u = u;
 	orig_v = v;
 
 	//calculate noise point lattice
 	nlx = (int)(u + sx * step_x) + 2;
 	nly = (int)(v + sy * step_y) + 2;
 	nlz = (int)(w + sz * step_z) + 2;
-	index = 0;
 	for (k = 0; k != nlz; k++)
 		for (j = 0; j != nly; j++)
-			for (i = 0; i != nlx; i++)
-				noisebuf[index++] = noise3d(x0 + i, y0 + j, z0 + k, seed);
+			noise3dRow(&noisebuf[idx(0, j, k)], x0, y0 + j, z0 + k, nlx, seed);
+
+	calcColumns(u, step_x, false);
 
 	//calculate interpolations
 	index  = 0;
-	noisey = 0;
 	noisez = 0;
 	for (k = 0; k != sz; k++) {
 		v = orig_v;
 		noisey = 0;
 		for (j = 0; j != sy; j++) {
-			v000 = noisebuf[idx(0, noisey,     noisez)];
-			v100 = noisebuf[idx(1, noisey,     noisez)];
-			v010 = noisebuf[idx(0, noisey + 1, noisez)];
-			v110 = noisebuf[idx(1, noisey + 1, noisez)];
-			v001 = noisebuf[idx(0, noisey,     noisez + 1)];
-			v101 = noisebuf[idx(1, noisey,     noisez + 1)];
-			v011 = noisebuf[idx(0, noisey + 1, noisez + 1)];
-			v111 = noisebuf[idx(1, noisey + 1, noisez + 1)];
-
-			u = orig_u;
-			noisex = 0;
-			for (i = 0; i != sx; i++) {
-				buf[index++] = triLinearInterpolation(
-									v000, v100, v010, v110,
-									v001, v101, v011, v111,
-									u, v, w);
-				u += step_x;
-				if (u >= 1.0) {
-					u -= 1.0;
-					noisex++;
-					v000 = v100;
-					v010 = v110;
-					v100 = noisebuf[idx(noisex + 1, noisey,     noisez)];
-					v110 = noisebuf[idx(noisex + 1, noisey + 1, noisez)];
-					v001 = v101;
-					v011 = v111;
-					v101 = noisebuf[idx(noisex + 1, noisey,     noisez + 1)];
-					v111 = noisebuf[idx(noisex + 1, noisey + 1, noisez + 1)];
-				}
+			const float *row00 = &noisebuf[idx(0, noisey,     noisez)];
+			const float *row10 = &noisebuf[idx(0, noisey + 1, noisez)];
+			const float *row01 = &noisebuf[idx(0, noisey,     noisez + 1)];
+			const float *row11 = &noisebuf[idx(0, noisey + 1, noisez + 1)];
+
+			i = 0;
+#ifdef NOISE_SSE2
+			__m128 vv = _mm_set1_ps(v);
+			__m128 wv = _mm_set1_ps(w);
+			for (; i + 4 <= sx; i += 4) {
+				const int *c = &colindex[i];
+				__m128 uv = _mm_loadu_ps(&colfrac[i]);
+#define GATHER(row, o) _mm_setr_ps((row)[c[0] + (o)], (row)[c[1] + (o)], \
+		(row)[c[2] + (o)], (row)[c[3] + (o)])
+#define LERP(a, b, t) _mm_add_ps((a), _mm_mul_ps(_mm_sub_ps((b), (a)), (t)))
+				__m128 a000 = GATHER(row00, 0), a100 = GATHER(row00, 1);
+				__m128 a010 = GATHER(row10, 0), a110 = GATHER(row10, 1);
+				__m128 a001 = GATHER(row01, 0), a101 = GATHER(row01, 1);
+				__m128 a011 = GATHER(row11, 0), a111 = GATHER(row11, 1);
+				__m128 i0 = LERP(LERP(a000, a100, uv), LERP(a010, a110, uv), vv);
+				__m128 i1 = LERP(LERP(a001, a101, uv), LERP(a011, a111, uv), vv);
+				_mm_storeu_ps(&buf[index + i], LERP(i0, i1, wv));
+#undef LERP
+#undef GATHER
+			}
+#endif
+			for (; i != sx; i++) {
+				int c = colindex[i];
+				buf[index + i] = triLinearInterpolation(
+					row00[c], row00[c + 1], row10[c], row10[c + 1],
+					row01[c], row01[c + 1], row11[c], row11[c + 1],
+					colfrac[i], v, w);
 			}
+			index += sx;
 
 			v += step_y;
 			if (v >= 1.0) {
@@ -508,9 +654,42 @@ void Noise::gradientMap3D(float x, float y, float z,
 #undef idx
 
 
+// result[i] += g * buf[i]
+static void accumulateOctave(float *result, const float *buf, float g, int n) {
+	int i = 0;
+#ifdef NOISE_SSE2
+	__m128 gv = _mm_set1_ps(g);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(&result[i], _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(gv, _mm_loadu_ps(&buf[i]))));
+#endif
+	for (; i != n; i++)
+		result[i] += g * buf[i];
+}
+
+
+// result[i] += g[i] * buf[i], then g[i] *= persist_map[i]
+static void accumulateOctaveModulated(float *result, const float *buf,
+		float *g, const float *persist_map, int n) {
+	int i = 0;
+#ifdef NOISE_SSE2
+	for (; i + 4 <= n; i += 4) {
+		__m128 gv = _mm_loadu_ps(&g[i]);
+		_mm_storeu_ps(&result[i], _mm_add_ps(_mm_loadu_ps(&result[i]),
+			_mm_mul_ps(gv, _mm_loadu_ps(&buf[i]))));
+		_mm_storeu_ps(&g[i], _mm_mul_ps(gv, _mm_loadu_ps(&persist_map[i])));
+	}
+#endif
+	for (; i != n; i++) {
+		result[i] += g[i] * buf[i];
+		g[i] *= persist_map[i];
+	}
+}
+
+
 float *Noise::perlinMap2D(float x, float y) {
 	float f = 1.0, g = 1.0;
-	int i, j, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -522,13 +701,7 @@ float *Noise::perlinMap2D(float x, float y) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g * buf[index];
-				index++;
-			}
-		}
+		accumulateOctave(result, buf, g, sx * sy);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -540,14 +713,19 @@ float *Noise::perlinMap2D(float x, float y) {
 
 float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 	float f = 1.0;
-	int i, j, index, oct;
+	int index, oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
 
 	memset(result, 0, sizeof(float) * sx * sy);
 	
-	float *g = new float[sx * sy];
+	if (sx * sy > gbuf_size) {
+		gbuf_size = sx * sy;
+		delete[] gbuf;
+		gbuf = new float[gbuf_size];
+	}
+	float *g = gbuf;
 	for (index = 0; index != sx * sy; index++)
 		g[index] = 1.0;
 
@@ -556,26 +734,18 @@ float *Noise::perlinMap2DModulated(float x, float y, float *persist_map) {
 			f / np->spread.X, f / np->spread.Y,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (j = 0; j != sy; j++) {
-			for (i = 0; i != sx; i++) {
-				result[index] += g[index] * buf[index];
-				g[index] *= persist_map[index];
-				index++;
-			}
-		}
+		accumulateOctaveModulated(result, buf, g, persist_map, sx * sy);
 
 		f *= 2.0;
 	}
 	
-	delete[] g;
 	return result;
 }
 
 
 float *Noise::perlinMap3D(float x, float y, float z) {
 	float f = 1.0, g = 1.0;
-	int i, j, k, index, oct;
+	int oct;
 
 	x /= np->spread.X;
 	y /= np->spread.Y;
@@ -588,15 +758,7 @@ float *Noise::perlinMap3D(float x, float y, float z) {
 			f / np->spread.X, f / np->spread.Y, f / np->spread.Z,
 			seed + np->seed + oct);
 
-		index = 0;
-		for (k = 0; k != sz; k++) {
-			for (j = 0; j != sy; j++) {
-				for (i = 0; i != sx; i++) {
-					result[index] += g * buf[index];
-					index++;
-				}
-			}
-		}
+		accumulateOctave(result, buf, g, sx * sy * sz);
 
 		f *= 2.0;
 		g *= np->persist;
@@ -607,13 +769,182 @@ float *Noise::perlinMap3D(float x, float y, float z) {
 
 
 void Noise::transformNoiseMap() {
+	int n = sx * sy * sz;
 	int i = 0;
-	for (int z = 0; z != sz; z++) {
-		for (int y = 0; y != sy; y++) {
-			for (int x = 0; x != sx; x++) {
-				result[i] = result[i] * np->scale + np->offset;
-				i++;
+#ifdef NOISE_SSE2
+	__m128 scale  = _mm_set1_ps(np->scale);
+	__m128 offset = _mm_set1_ps(np->offset);
+	for (; i + 4 <= n; i += 4)
+		_mm_storeu_ps(&result[i], _mm_add_ps(
+			_mm_mul_ps(_mm_loadu_ps(&result[i]), scale), offset));
+#endif
+	for (; i != n; i++)
+		result[i] = result[i] * np->scale + np->offset;
+}
+
+
+///////////////////////////// [ NoiseMapBatch ] ///////////////////////////////
+
+
+/*
+	Computes one octave of a map into the buf of a Noise of its own, which
+	is reused for whatever map the job gets next.
+*/
+class NoiseOctaveJob : public WorkerPoolJob {
+public:
+	NoiseOctaveJob():
+		noise(NULL),
+		is3d(false),
+		x(0), y(0), z(0),
+		f(1.0),
+		seed(0)
+	{
+	}
+
+	~NoiseOctaveJob()
+	{
+		delete noise;
+	}
+
+	void setup(Noise *src, bool is3d, float x, float y, float z,
+			float f, int seed)
+	{
+		if (noise == NULL) {
+			noise = new Noise(src->np, src->seed, src->sx, src->sy, src->sz);
+		} else {
+			noise->np = src->np;
+			noise->setSize(src->sx, src->sy, src->sz);
+		}
+		this->is3d = is3d;
+		this->x    = x;
+		this->y    = y;
+		this->z    = z;
+		this->f    = f;
+		this->seed = seed;
+	}
+
+	void run()
+	{
+		NoiseParams *np = noise->np;
+		if (is3d)
+			noise->gradientMap3D(x * f, y * f, z * f,
+				f / np->spread.X, f / np->spread.Y, f / np->spread.Z, seed);
+		else
+			noise->gradientMap2D(x * f, y * f,
+				f / np->spread.X, f / np->spread.Y, seed);
+	}
+
+	Noise *noise;
+
+private:
+	bool is3d;
+	float x, y, z;
+	float f;
+	int seed;
+};
+
+
+NoiseMapBatch::NoiseMapBatch() {
+}
+
+
+NoiseMapBatch::~NoiseMapBatch() {
+	for (size_t i = 0; i != m_jobs.size(); i++)
+		delete m_jobs[i];
+}
+
+
+void NoiseMapBatch::add2D(Noise *noise, float x, float y, bool transform) {
+	Entry e = {noise, false, x, y, 0, NULL, transform};
+	m_entries.push_back(e);
+}
+
+
+void NoiseMapBatch::add2DModulated(Noise *noise, float x, float y,
+		float *persist_map, bool transform) {
+	Entry e = {noise, false, x, y, 0, persist_map, transform};
+	m_entries.push_back(e);
+}
+
+
+void NoiseMapBatch::add3D(Noise *noise, float x, float y, float z,
+		bool transform) {
+	Entry e = {noise, true, x, y, z, NULL, transform};
+	m_entries.push_back(e);
+}
+
+
+void NoiseMapBatch::runSerial() {
+	for (size_t i = 0; i != m_entries.size(); i++) {
+		Entry &e = m_entries[i];
+		if (e.is3d)
+			e.noise->perlinMap3D(e.x, e.y, e.z);
+		else if (e.persist_map)
+			e.noise->perlinMap2DModulated(e.x, e.y, e.persist_map);
+		else
+			e.noise->perlinMap2D(e.x, e.y);
+		if (e.transform)
+			e.noise->transformNoiseMap();
+	}
+	m_entries.clear();
+}
+
+
+void NoiseMapBatch::run(WorkerPool *pool) {
+	if (pool == NULL || pool->getThreadCount() == 0) {
+		runSerial();
+		return;
+	}
+
+	// One job per octave; the arguments are worked out exactly like
+	// perlinMap*() does it
+	std::vector<WorkerPoolJob *> job_ptrs;
+	for (size_t i = 0; i != m_entries.size(); i++) {
+		Entry &e = m_entries[i];
+		NoiseParams *np = e.noise->np;
+		float x = e.x / np->spread.X;
+		float y = e.y / np->spread.Y;
+		float z = e.is3d ? e.z / np->spread.Z : 0;
+		float f = 1.0;
+		for (int oct = 0; oct < np->octaves; oct++) {
+			if (job_ptrs.size() == m_jobs.size())
+				m_jobs.push_back(new NoiseOctaveJob());
+			NoiseOctaveJob *job = m_jobs[job_ptrs.size()];
+			job->setup(e.noise, e.is3d, x, y, z, f,
+				e.noise->seed + np->seed + oct);
+			job_ptrs.push_back(job);
+			f *= 2.0;
+		}
+	}
+
+	pool->run(job_ptrs);
+
+	// Sum up the octaves in the same order as perlinMap*()
+	size_t job_i = 0;
+	for (size_t i = 0; i != m_entries.size(); i++) {
+		Entry &e = m_entries[i];
+		Noise *noise = e.noise;
+		NoiseParams *np = noise->np;
+		int n = noise->sx * noise->sy * (e.is3d ? noise->sz : 1);
+
+		memset(noise->result, 0, sizeof(float) * n);
+		if (e.persist_map) {
+			m_gbuf.assign(n, 1.0);
+			for (int oct = 0; oct < np->octaves; oct++) {
+				accumulateOctaveModulated(noise->result,
+					m_jobs[job_i++]->noise->buf, &m_gbuf[0], e.persist_map, n);
+			}
+		} else {
+			float g = 1.0;
+			for (int oct = 0; oct < np->octaves; oct++) {
+				accumulateOctave(noise->result,
+					m_jobs[job_i++]->noise->buf, g, n);
+				g *= np->persist;
 			}
 		}
+
+		if (e.transform)
+			noise->transformNoiseMap();
 	}
+	m_entries.clear();
 }
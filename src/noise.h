@@ -23,6 +23,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 #include "debug.h"
 #include "irr_v3d.h"
+#include <vector>
+
+class WorkerPool;
 
 class PseudoRandom
 {
@@ -85,6 +88,11 @@ class Noise {
 	float *noisebuf;
 	float *buf;
 	float *result;
+	// Lattice column and interpolation factor of each x, see gradientMap*
+	int *colindex;
+	float *colfrac;
+	// Per-point persistence of perlinMap2DModulated
+	float *gbuf;
 
 	Noise(NoiseParams *np, int seed, int sx, int sy);
 	Noise(NoiseParams *np, int seed, int sx, int sy, int sz);
@@ -109,6 +117,57 @@ class Noise {
 	float *perlinMap2DModulated(float x, float y, float *persist_map);
 	float *perlinMap3D(float x, float y, float z);
 	void transformNoiseMap();
+
+private:
+	void calcColumns(float u, float step_x, bool ease);
+	void resizeMapBufs();
+
+	// Allocated lengths of the buffers above; they are only ever grown, so
+	// that reusing a Noise doesn't go through the allocator
+	int noisebuf_size;
+	int map_size;
+	int col_size;
+	int gbuf_size;
+};
+
+class NoiseOctaveJob;
+
+/*
+	Computes a set of independent noise maps, e.g. those of one chunk,
+	with every octave of every map as a separate job on a WorkerPool.
+
+	The results are bit for bit the same as calling perlinMap*() (and
+	transformNoiseMap() if asked to) on each Noise in turn, which is what
+	is done if there is no pool or it has no threads.
+*/
+class NoiseMapBatch {
+public:
+	NoiseMapBatch();
+	~NoiseMapBatch();
+
+	void add2D(Noise *noise, float x, float y, bool transform);
+	void add2DModulated(Noise *noise, float x, float y, float *persist_map,
+		bool transform);
+	void add3D(Noise *noise, float x, float y, float z, bool transform);
+
+	// Fills in the result of every added Noise and clears the batch
+	void run(WorkerPool *pool);
+
+private:
+	struct Entry {
+		Noise *noise;
+		bool is3d;
+		float x, y, z;
+		float *persist_map;
+		bool transform;
+	};
+
+	void runSerial();
+
+	std::vector<Entry> m_entries;
+	// Reused from run to run, so that their buffers are kept around
+	std::vector<NoiseOctaveJob *> m_jobs;
+	std::vector<float> m_gbuf;
 };
 
 // Return value: -1 ... 1
@@ -0,0 +1,344 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+/*
+	Structure of players.sqlite:
+	Tables:
+		players
+			(PK) TEXT name
+			BLOB data (Player::serialize())
+*/
+
+#include "playerdatabase.h"
+#include <fstream>
+#include <sstream>
+#include <map>
+extern "C" {
+	#include "sqlite3.h"
+}
+#include "player.h"
+#include "filesys.h"
+#include "settings.h"
+#include "main.h" // for g_settings
+#include "log.h"
+#include "exceptions.h"
+#include "util/string.h"
+
+/*
+	One file per player in world/players.
+
+	The file names don't tell the player names, so all files are read
+	once to build an index.
+*/
+class PlayerDatabaseFiles : public PlayerDatabase
+{
+public:
+	PlayerDatabaseFiles(const std::string &savedir, IGameDef *gamedef):
+		m_players_path(savedir + DIR_DELIM + "players"),
+		m_gamedef(gamedef),
+		m_index_built(false)
+	{
+	}
+
+	void beginSave() {}
+	void endSave() {}
+
+	bool savePlayer(Player *player)
+	{
+		buildIndex();
+		std::string playername = player->getName();
+		std::string path;
+		std::map<std::string, std::string>::iterator i =
+				m_index.find(playername);
+		if(i != m_index.end()){
+			path = i->second;
+		} else {
+			fs::CreateDir(m_players_path);
+			/*
+				Find a sane filename
+			*/
+			std::string filename = playername;
+			if(string_allowed(filename, PLAYERNAME_ALLOWED_CHARS) == false)
+				filename = "player";
+			path = m_players_path + DIR_DELIM + filename;
+			bool found = false;
+			for(u32 j=0; j<1000; j++)
+			{
+				if(fs::PathExists(path) == false)
+				{
+					found = true;
+					break;
+				}
+				path = m_players_path + DIR_DELIM + filename + itos(j);
+			}
+			if(found == false)
+			{
+				infostream<<"Didn't find free file for player "
+						<<playername<<std::endl;
+				return false;
+			}
+		}
+
+		std::ostringstream ss(std::ios_base::binary);
+		player->serialize(ss);
+		if(!fs::safeWriteToFile(path, ss.str()))
+		{
+			infostream<<"Failed to write "<<path<<std::endl;
+			return false;
+		}
+		m_index[playername] = path;
+		return true;
+	}
+
+	bool loadPlayer(const std::string &name, Player *player)
+	{
+		buildIndex();
+		std::map<std::string, std::string>::iterator i = m_index.find(name);
+		if(i == m_index.end())
+			return false;
+		return readFile(i->second, player);
+	}
+
+	bool playerExists(const std::string &name)
+	{
+		buildIndex();
+		return m_index.find(name) != m_index.end();
+	}
+
+	void listPlayers(std::list<std::string> &dst)
+	{
+		buildIndex();
+		for(std::map<std::string, std::string>::iterator
+				i = m_index.begin(); i != m_index.end(); ++i)
+			dst.push_back(i->first);
+	}
+
+private:
+	bool readFile(const std::string &path, Player *player)
+	{
+		std::ifstream is(path.c_str(), std::ios_base::binary);
+		if(is.good() == false)
+		{
+			infostream<<"Failed to read "<<path<<std::endl;
+			return false;
+		}
+		try{
+			player->deSerialize(is, path);
+		}
+		catch(SerializationError &e){
+			errorstream<<"Failed to read "<<path<<": "<<e.what()<<std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	void buildIndex()
+	{
+		if(m_index_built)
+			return;
+		m_index_built = true;
+
+		std::vector<fs::DirListNode> player_files =
+				fs::GetDirListing(m_players_path);
+		for(u32 i=0; i<player_files.size(); i++)
+		{
+			if(player_files[i].dir || player_files[i].name[0] == '.')
+				continue;
+			std::string path = m_players_path + DIR_DELIM
+					+ player_files[i].name;
+			// Load player to see what is its name
+			RemotePlayer testplayer(m_gamedef);
+			if(!readFile(path, &testplayer))
+				continue;
+			m_index[testplayer.getName()] = path;
+		}
+	}
+
+	std::string m_players_path;
+	IGameDef *m_gamedef;
+	// Player name -> file path
+	std::map<std::string, std::string> m_index;
+	bool m_index_built;
+};
+
+class PlayerDatabaseSQLite3 : public PlayerDatabase
+{
+public:
+	PlayerDatabaseSQLite3(const std::string &savedir):
+		m_database(NULL),
+		m_database_read(NULL),
+		m_database_write(NULL),
+		m_database_list(NULL)
+	{
+		std::string dbp = savedir + DIR_DELIM + "players.sqlite";
+
+		if(sqlite3_open_v2(dbp.c_str(), &m_database,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL) != SQLITE_OK)
+		{
+			errorstream<<"PlayerDatabaseSQLite3: Could not open \""<<dbp
+					<<"\": "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot open player database");
+		}
+
+		if(sqlite3_exec(m_database,
+				"CREATE TABLE IF NOT EXISTS `players` ("
+					"`name` TEXT PRIMARY KEY,"
+					"`data` BLOB NOT NULL"
+				");", NULL, NULL, NULL) != SQLITE_OK)
+		{
+			errorstream<<"PlayerDatabaseSQLite3: Could not create table: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot create player database");
+		}
+
+		std::string querystr = std::string("PRAGMA synchronous = ")
+				+ itos(g_settings->getU16("sqlite_synchronous"));
+		sqlite3_exec(m_database, querystr.c_str(), NULL, NULL, NULL);
+
+		prepare(&m_database_read,
+				"SELECT `data` FROM `players` WHERE `name` = ? LIMIT 1");
+		prepare(&m_database_write,
+				"REPLACE INTO `players` (`name`, `data`) VALUES (?, ?)");
+		prepare(&m_database_list, "SELECT `name` FROM `players`");
+
+		infostream<<"PlayerDatabaseSQLite3: Database opened"<<std::endl;
+	}
+
+	~PlayerDatabaseSQLite3()
+	{
+		sqlite3_finalize(m_database_read);
+		sqlite3_finalize(m_database_write);
+		sqlite3_finalize(m_database_list);
+		sqlite3_close(m_database);
+	}
+
+	void beginSave()
+	{
+		if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: PlayerDatabaseSQLite3: BEGIN failed, "
+					<<"saving might be slow."<<std::endl;
+	}
+
+	void endSave()
+	{
+		if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+			errorstream<<"PlayerDatabaseSQLite3: COMMIT failed: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+	}
+
+	bool savePlayer(Player *player)
+	{
+		std::string name = player->getName();
+		std::ostringstream ss(std::ios_base::binary);
+		player->serialize(ss);
+		std::string data = ss.str();
+
+		sqlite3_bind_text(m_database_write, 1, name.c_str(), name.size(),
+				SQLITE_TRANSIENT);
+		sqlite3_bind_blob(m_database_write, 2, data.c_str(), data.size(),
+				SQLITE_TRANSIENT);
+		bool ok = sqlite3_step(m_database_write) == SQLITE_DONE;
+		if(!ok)
+			errorstream<<"PlayerDatabaseSQLite3: Failed to save player "
+					<<name<<": "<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_reset(m_database_write);
+		return ok;
+	}
+
+	bool loadPlayer(const std::string &name, Player *player)
+	{
+		sqlite3_bind_text(m_database_read, 1, name.c_str(), name.size(),
+				SQLITE_TRANSIENT);
+		bool ok = false;
+		if(sqlite3_step(m_database_read) == SQLITE_ROW)
+		{
+			std::string data(
+					(const char*)sqlite3_column_blob(m_database_read, 0),
+					sqlite3_column_bytes(m_database_read, 0));
+			std::istringstream is(data, std::ios_base::binary);
+			try{
+				player->deSerialize(is, name);
+				ok = true;
+			}
+			catch(SerializationError &e){
+				errorstream<<"PlayerDatabaseSQLite3: Failed to read player "
+						<<name<<": "<<e.what()<<std::endl;
+			}
+		}
+		sqlite3_reset(m_database_read);
+		return ok;
+	}
+
+	bool playerExists(const std::string &name)
+	{
+		sqlite3_bind_text(m_database_read, 1, name.c_str(), name.size(),
+				SQLITE_TRANSIENT);
+		bool exists = sqlite3_step(m_database_read) == SQLITE_ROW;
+		sqlite3_reset(m_database_read);
+		return exists;
+	}
+
+	void listPlayers(std::list<std::string> &dst)
+	{
+		while(sqlite3_step(m_database_list) == SQLITE_ROW)
+		{
+			dst.push_back(std::string(
+					(const char*)sqlite3_column_text(m_database_list, 0),
+					sqlite3_column_bytes(m_database_list, 0)));
+		}
+		sqlite3_reset(m_database_list);
+	}
+
+private:
+	void prepare(sqlite3_stmt **stmt, const char *query)
+	{
+		if(sqlite3_prepare(m_database, query, -1, stmt, NULL) != SQLITE_OK)
+		{
+			errorstream<<"PlayerDatabaseSQLite3: Could not prepare \""
+					<<query<<"\": "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare player statement");
+		}
+	}
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+};
+
+PlayerDatabase *createPlayerDatabase(const std::string &backend,
+		const std::string &savedir, IGameDef *gamedef)
+{
+	if(backend == "files")
+		return new PlayerDatabaseFiles(savedir, gamedef);
+	if(backend == "sqlite3")
+		return new PlayerDatabaseSQLite3(savedir);
+	return NULL;
+}
+
+std::string getPlayerDatabaseBackend(const std::string &savedir)
+{
+	Settings conf;
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	if(conf.readConfigFile(conf_path.c_str()) && conf.exists("player_backend"))
+		return conf.get("player_backend");
+	// Worlds made before the setting existed
+	return "files";
+}
+
@@ -0,0 +1,62 @@
+/*
+Minetest
+Copyright (C) 2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PLAYERDATABASE_HEADER
+#define PLAYERDATABASE_HEADER
+
+#include <string>
+#include <list>
+
+class Player;
+class IGameDef;
+
+/*
+	Storage of the players of a world.
+
+	Players are identified by name. Backends are selected with
+	player_backend in world.mt:
+		files    - one file per player in world/players (default)
+		sqlite3  - world/players.sqlite
+*/
+class PlayerDatabase
+{
+public:
+	virtual ~PlayerDatabase() {}
+
+	// Saves done between these are written at once
+	virtual void beginSave() = 0;
+	virtual void endSave() = 0;
+
+	// Writes the player, replacing a stored player with the same name
+	virtual bool savePlayer(Player *player) = 0;
+	// Reads the stored player called name into player
+	virtual bool loadPlayer(const std::string &name, Player *player) = 0;
+	virtual bool playerExists(const std::string &name) = 0;
+	virtual void listPlayers(std::list<std::string> &dst) = 0;
+};
+
+// Returns NULL if the backend is not known
+PlayerDatabase *createPlayerDatabase(const std::string &backend,
+		const std::string &savedir, IGameDef *gamedef);
+
+// Backend of the world as set in world.mt
+std::string getPlayerDatabaseBackend(const std::string &savedir);
+
+#endif
+
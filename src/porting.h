@@ -100,6 +100,34 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 namespace porting
 {
 
+/*
+	Load and store of a u32 shared between threads without a lock.
+	They are not reordered with any memory access before or after them.
+*/
+inline void memoryBarrier()
+{
+#ifdef _MSC_VER
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+}
+
+inline u32 atomicLoad(volatile u32 *p)
+{
+	memoryBarrier();
+	u32 v = *p;
+	memoryBarrier();
+	return v;
+}
+
+inline void atomicStore(volatile u32 *p, u32 v)
+{
+	memoryBarrier();
+	*p = v;
+	memoryBarrier();
+}
+
 /*
 	Signal handler (grabs Ctrl-C on POSIX systems)
 */
@@ -17,17 +17,43 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
 */
 
+/*
+	Rollback actions are stored in rollback.sqlite in the world directory.
+
+	Tables:
+		actions
+			(PK) INTEGER id (increasing in the order of the actions)
+			INT time
+			TEXT actor
+			INT actor_is_guess
+			INT block (block position as in map.sqlite, NULL if none)
+			INT x, y, z (node position, NULL if none)
+			TEXT data (RollbackAction::toString())
+
+	The indexes on time, actor and block position let the queries read
+	only the rows they return.
+
+	Older worlds have their actions in the text file rollback.txt; it is
+	imported when rollback.sqlite is created.
+*/
+
 #include "rollback.h"
 #include <fstream>
 #include <list>
 #include <sstream>
+extern "C" {
+	#include "sqlite3.h"
+}
 #include "log.h"
+#include "filesys.h"
+#include "exceptions.h"
 #include "mapnode.h"
 #include "gamedef.h"
 #include "nodedef.h"
 #include "util/serialize.h"
 #include "util/string.h"
 #include "util/numeric.h"
+#include "constants.h"
 #include "inventorymanager.h" // deserializing InventoryLocations
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
@@ -140,13 +166,10 @@ class RollbackManager: public IRollbackManager
 	}
 	void flush()
 	{
-		infostream<<"RollbackManager::flush()"<<std::endl;
-		std::ofstream of(m_filepath.c_str(), std::ios::app);
-		if(!of.good()){
-			errorstream<<"RollbackManager::flush(): Could not open file "
-					<<"for appending: \""<<m_filepath<<"\""<<std::endl;
+		if(m_action_todisk_buffer.empty())
 			return;
-		}
+		infostream<<"RollbackManager::flush()"<<std::endl;
+		beginSave();
 		for(std::list<RollbackAction>::const_iterator
 				i = m_action_todisk_buffer.begin();
 				i != m_action_todisk_buffer.end(); i++)
@@ -154,34 +177,35 @@ class RollbackManager: public IRollbackManager
 			// Do not save stuff that does not have an actor
 			if(i->actor == "")
 				continue;
-			of<<i->unix_time;
-			of<<" ";
-			of<<serializeJsonString(i->actor);
-			of<<" ";
-			of<<i->toString();
-			if(i->actor_is_guess){
-				of<<" ";
-				of<<"actor_is_guess";
-			}
-			of<<std::endl;
+			writeAction(*i);
 		}
+		endSave();
 		m_action_todisk_buffer.clear();
 	}
 	
 	// Other
 
-	RollbackManager(const std::string &filepath, IGameDef *gamedef):
-		m_filepath(filepath),
+	RollbackManager(const std::string &path_world, IGameDef *gamedef):
+		m_path_world(path_world),
 		m_gamedef(gamedef),
-		m_current_actor_is_guess(false)
+		m_current_actor_is_guess(false),
+		m_database(NULL),
+		m_database_write(NULL),
+		m_database_by_actor(NULL),
+		m_database_by_block(NULL)
 	{
-		infostream<<"RollbackManager::RollbackManager("<<filepath<<")"
+		infostream<<"RollbackManager::RollbackManager("<<path_world<<")"
 				<<std::endl;
+		openDatabase();
 	}
 	~RollbackManager()
 	{
 		infostream<<"RollbackManager::~RollbackManager()"<<std::endl;
 		flush();
+		sqlite3_finalize(m_database_write);
+		sqlite3_finalize(m_database_by_actor);
+		sqlite3_finalize(m_database_by_block);
+		sqlite3_close(m_database);
 	}
 
 	void addAction(const RollbackAction &action)
@@ -189,20 +213,168 @@ class RollbackManager: public IRollbackManager
 		m_action_todisk_buffer.push_back(action);
 		m_action_latest_buffer.push_back(action);
 
+		// getSuspect() doesn't look further back than 100 seconds
+		while(m_action_latest_buffer.front().unix_time
+				< action.unix_time - 100)
+			m_action_latest_buffer.pop_front();
+
 		// Flush to disk sometimes
 		if(m_action_todisk_buffer.size() >= 100)
 			flush();
 	}
-	
-	bool readFile(std::list<RollbackAction> &dst)
+
+	void openDatabase()
 	{
-		// Load whole file to memory
-		std::ifstream f(m_filepath.c_str(), std::ios::in);
-		if(!f.good()){
-			errorstream<<"RollbackManager::readFile(): Could not open "
-					<<"file for reading: \""<<m_filepath<<"\""<<std::endl;
+		std::string dbp = m_path_world + DIR_DELIM + "rollback.sqlite";
+		bool needs_create = !fs::PathExists(dbp);
+
+		int d = sqlite3_open_v2(dbp.c_str(), &m_database,
+				SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+		if(d != SQLITE_OK){
+			errorstream<<"RollbackManager: Could not open database \""
+					<<dbp<<"\": "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot open rollback database");
+		}
+
+		if(needs_create){
+			d = sqlite3_exec(m_database,
+				"CREATE TABLE IF NOT EXISTS `actions` ("
+					"`id` INTEGER PRIMARY KEY,"
+					"`time` INT NOT NULL,"
+					"`actor` TEXT NOT NULL,"
+					"`actor_is_guess` INT NOT NULL,"
+					"`block` INT,"
+					"`x` INT,"
+					"`y` INT,"
+					"`z` INT,"
+					"`data` TEXT NOT NULL"
+				");"
+				"CREATE INDEX IF NOT EXISTS `actions_time` "
+					"ON `actions` (`time`);"
+				"CREATE INDEX IF NOT EXISTS `actions_actor` "
+					"ON `actions` (`actor`, `time`);"
+				"CREATE INDEX IF NOT EXISTS `actions_block` "
+					"ON `actions` (`block`, `time`);",
+				NULL, NULL, NULL);
+			if(d != SQLITE_OK){
+				errorstream<<"RollbackManager: Could not create tables: "
+						<<sqlite3_errmsg(m_database)<<std::endl;
+				throw FileNotGoodException("Cannot create rollback database");
+			}
+		}
+
+		prepare(&m_database_write, "INSERT INTO `actions` "
+				"(`time`, `actor`, `actor_is_guess`, `block`, `x`, `y`, `z`,"
+				" `data`) VALUES (?, ?, ?, ?, ?, ?, ?, ?)");
+		prepare(&m_database_by_actor, "SELECT `time`, `actor`,"
+				" `actor_is_guess`, `data` FROM `actions`"
+				" WHERE `actor` = ? AND `time` >= ? ORDER BY `id` DESC");
+		prepare(&m_database_by_block, "SELECT `id`, `time`, `actor`,"
+				" `actor_is_guess`, `data` FROM `actions`"
+				" WHERE `block` = ? AND `time` >= ?");
+
+		infostream<<"RollbackManager: Database opened"<<std::endl;
+
+		if(needs_create)
+			importTextFile();
+	}
+
+	void prepare(sqlite3_stmt **stmt, const char *query)
+	{
+		int d = sqlite3_prepare(m_database, query, -1, stmt, NULL);
+		if(d != SQLITE_OK){
+			errorstream<<"RollbackManager: Could not prepare statement \""
+					<<query<<"\": "<<sqlite3_errmsg(m_database)<<std::endl;
+			throw FileNotGoodException("Cannot prepare rollback statement");
+		}
+	}
+
+	void beginSave()
+	{
+		if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+			infostream<<"WARNING: RollbackManager: BEGIN failed, "
+					<<"saving might be slow."<<std::endl;
+	}
+
+	void endSave()
+	{
+		if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+			errorstream<<"RollbackManager: COMMIT failed: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+	}
+
+	static s64 getBlockAsInteger(v3s16 blockpos)
+	{
+		return (s64)blockpos.Z * 0x1000000 +
+				(s64)blockpos.Y * 0x1000 +
+				(s64)blockpos.X;
+	}
+
+	void writeAction(const RollbackAction &action)
+	{
+		std::string data = action.toString();
+		sqlite3_bind_int(m_database_write, 1, action.unix_time);
+		sqlite3_bind_text(m_database_write, 2, action.actor.c_str(),
+				action.actor.size(), SQLITE_TRANSIENT);
+		sqlite3_bind_int(m_database_write, 3, action.actor_is_guess ? 1 : 0);
+		v3s16 p;
+		if(action.getPosition(&p)){
+			sqlite3_bind_int64(m_database_write, 4,
+					getBlockAsInteger(getContainerPos(p, MAP_BLOCKSIZE)));
+			sqlite3_bind_int(m_database_write, 5, p.X);
+			sqlite3_bind_int(m_database_write, 6, p.Y);
+			sqlite3_bind_int(m_database_write, 7, p.Z);
+		} else {
+			for(int i=4; i<=7; i++)
+				sqlite3_bind_null(m_database_write, i);
+		}
+		sqlite3_bind_text(m_database_write, 8, data.c_str(), data.size(),
+				SQLITE_TRANSIENT);
+		if(sqlite3_step(m_database_write) != SQLITE_DONE)
+			errorstream<<"RollbackManager: Failed to save action: "
+					<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_reset(m_database_write);
+	}
+
+	// Reads an action from the current row of stmt, starting at column col
+	// (time, actor, actor_is_guess, data)
+	bool readAction(sqlite3_stmt *stmt, int col, RollbackAction &action)
+	{
+		action.unix_time = sqlite3_column_int(stmt, col);
+		action.actor = std::string(
+				(const char*)sqlite3_column_text(stmt, col + 1),
+				sqlite3_column_bytes(stmt, col + 1));
+		action.actor_is_guess = sqlite3_column_int(stmt, col + 2) != 0;
+		std::string data(
+				(const char*)sqlite3_column_text(stmt, col + 3),
+				sqlite3_column_bytes(stmt, col + 3));
+		std::istringstream is(data);
+		try{
+			action.fromStream(is);
+		}
+		catch(SerializationError &e){
+			errorstream<<"RollbackManager: Error deserializing action: "
+					<<data<<": "<<e.what()<<std::endl;
 			return false;
 		}
+		return true;
+	}
+
+	// Imports the text file used by older versions
+	void importTextFile()
+	{
+		std::string path = m_path_world + DIR_DELIM + "rollback.txt";
+		if(!fs::PathExists(path))
+			return;
+		std::ifstream f(path.c_str(), std::ios::in);
+		if(!f.good()){
+			errorstream<<"RollbackManager::importTextFile(): Could not open "
+					<<"file for reading: \""<<path<<"\""<<std::endl;
+			return;
+		}
+		infostream<<"RollbackManager: Importing \""<<path<<"\""<<std::endl;
+		u32 count = 0;
+		beginSave();
 		for(;;){
 			if(f.eof() || !f.good())
 				break;
@@ -230,46 +402,24 @@ class RollbackManager: public IRollbackManager
 				int c = is.get();
 				if(c != ' '){
 					is.putback(c);
-					throw SerializationError("readFile(): second ' ' not found");
+					throw SerializationError("importTextFile(): second ' ' not found");
 				}
 				action.fromStream(is);
-				/*infostream<<"RollbackManager::readFile(): Action from disk: "
-						<<action.toString()<<std::endl;*/
-				dst.push_back(action);
+				std::string rest;
+				std::getline(is, rest);
+				action.actor_is_guess = trim(rest) == "actor_is_guess";
+				writeAction(action);
+				count++;
 			}
 			catch(SerializationError &e){
 				errorstream<<"RollbackManager: Error on line: "<<line<<std::endl;
 				errorstream<<"RollbackManager: ^ error: "<<e.what()<<std::endl;
 			}
 		}
-		return true;
+		endSave();
+		infostream<<"RollbackManager: Imported "<<count<<" actions"<<std::endl;
 	}
 
-	std::list<RollbackAction> getEntriesSince(int first_time)
-	{
-		infostream<<"RollbackManager::getEntriesSince("<<first_time<<")"<<std::endl;
-		// Collect enough data to this buffer
-		std::list<RollbackAction> action_buffer;
-		// Use the latest buffer if it is long enough
-		if(!m_action_latest_buffer.empty() &&
-				m_action_latest_buffer.begin()->unix_time <= first_time){
-			action_buffer = m_action_latest_buffer;
-		}
-		else
-		{
-			// Save all remaining stuff
-			flush();
-			// Load whole file to memory
-			bool good = readFile(action_buffer);
-			if(!good){
-				errorstream<<"RollbackManager::getEntriesSince(): Failed to"
-						<<" open file; using data in memory."<<std::endl;
-				action_buffer = m_action_latest_buffer;
-			}
-		}
-		return action_buffer;
-	}
-	
 	std::string getLastNodeActor(v3s16 p, int range, int seconds,
 			v3s16 *act_p, int *act_seconds)
 	{
@@ -279,39 +429,59 @@ class RollbackManager: public IRollbackManager
 		int cur_time = time(0);
 		int first_time = cur_time - seconds;
 
-		std::list<RollbackAction> action_buffer = getEntriesSince(first_time);
-		
-		std::list<RollbackAction> result;
+		// Save all remaining stuff
+		flush();
 
-		for(std::list<RollbackAction>::const_reverse_iterator
-				i = action_buffer.rbegin();
-				i != action_buffer.rend(); i++)
-		{
-			if(i->unix_time < first_time)
-				break;
+		if(range < 0)
+			range = 0;
+		v3s16 r(range, range, range);
+		v3s16 bp_min = getContainerPos(p - r, MAP_BLOCKSIZE);
+		v3s16 bp_max = getContainerPos(p + r, MAP_BLOCKSIZE);
 
-			// Find position of action or continue
-			v3s16 action_p;
-			if(!i->getPosition(&action_p))
-				continue;
+		// Find the latest action in the range from the blocks it touches
+		s64 last_id = -1;
+		RollbackAction last_action;
+		v3s16 last_p;
+		v3s16 bp;
+		for(bp.X = bp_min.X; bp.X <= bp_max.X; bp.X++)
+		for(bp.Y = bp_min.Y; bp.Y <= bp_max.Y; bp.Y++)
+		for(bp.Z = bp_min.Z; bp.Z <= bp_max.Z; bp.Z++)
+		{
+			sqlite3_bind_int64(m_database_by_block, 1, getBlockAsInteger(bp));
+			sqlite3_bind_int(m_database_by_block, 2, first_time);
+			while(sqlite3_step(m_database_by_block) == SQLITE_ROW)
+			{
+				s64 id = sqlite3_column_int64(m_database_by_block, 0);
+				if(id <= last_id)
+					continue;
+				RollbackAction action;
+				if(!readAction(m_database_by_block, 1, action))
+					continue;
 
-			if(range == 0){
-				if(action_p != p)
+				// Find position of action or continue
+				v3s16 action_p;
+				if(!action.getPosition(&action_p))
 					continue;
-			} else {
+
 				if(abs(action_p.X - p.X) > range ||
 						abs(action_p.Y - p.Y) > range ||
 						abs(action_p.Z - p.Z) > range)
 					continue;
+
+				last_id = id;
+				last_action = action;
+				last_p = action_p;
 			}
-			
-			if(act_p)
-				*act_p = action_p;
-			if(act_seconds)
-				*act_seconds = cur_time - i->unix_time;
-			return i->actor;
+			sqlite3_reset(m_database_by_block);
 		}
-		return "";
+
+		if(last_id == -1)
+			return "";
+		if(act_p)
+			*act_p = last_p;
+		if(act_seconds)
+			*act_seconds = cur_time - last_action.unix_time;
+		return last_action.actor;
 	}
 
 	std::list<RollbackAction> getRevertActions(const std::string &actor_filter,
@@ -323,42 +493,42 @@ class RollbackManager: public IRollbackManager
 		int cur_time = time(0);
 		int first_time = cur_time - seconds;
 		
-		std::list<RollbackAction> action_buffer = getEntriesSince(first_time);
-		
+		// Save all remaining stuff
+		flush();
+
 		std::list<RollbackAction> result;
 
-		for(std::list<RollbackAction>::const_reverse_iterator
-				i = action_buffer.rbegin();
-				i != action_buffer.rend(); i++)
+		// Latest action comes first
+		sqlite3_bind_text(m_database_by_actor, 1, actor_filter.c_str(),
+				actor_filter.size(), SQLITE_TRANSIENT);
+		sqlite3_bind_int(m_database_by_actor, 2, first_time);
+		while(sqlite3_step(m_database_by_actor) == SQLITE_ROW)
 		{
-			if(i->unix_time < first_time)
-				break;
-			if(i->actor != actor_filter)
-				continue;
-			const RollbackAction &action = *i;
-			/*infostream<<"RollbackManager::revertAction(): Should revert"
-					<<" time="<<action.unix_time
-					<<" actor=\""<<action.actor<<"\""
-					<<" action="<<action.toString()
-					<<std::endl;*/
-			result.push_back(action);
+			RollbackAction action;
+			if(readAction(m_database_by_actor, 0, action))
+				result.push_back(action);
 		}
+		sqlite3_reset(m_database_by_actor);
 
 		return result;
 	}
 
 private:
-	std::string m_filepath;
+	std::string m_path_world;
 	IGameDef *m_gamedef;
 	std::string m_current_actor;
 	bool m_current_actor_is_guess;
 	std::list<RollbackAction> m_action_todisk_buffer;
+	// Actions of the last 100 seconds, for getSuspect()
 	std::list<RollbackAction> m_action_latest_buffer;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_by_actor;
+	sqlite3_stmt *m_database_by_block;
 };
 
-IRollbackManager *createRollbackManager(const std::string &filepath, IGameDef *gamedef)
+IRollbackManager *createRollbackManager(const std::string &path_world, IGameDef *gamedef)
 {
-	return new RollbackManager(filepath, gamedef);
+	return new RollbackManager(path_world, gamedef);
 }
-
-
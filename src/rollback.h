@@ -49,6 +49,7 @@ class IRollbackManager: public IRollbackReportSink
 			int seconds) = 0;
 };
 
-IRollbackManager *createRollbackManager(const std::string &filepath, IGameDef *gamedef);
+// Stores the actions in rollback.sqlite in the world directory
+IRollbackManager *createRollbackManager(const std::string &path_world, IGameDef *gamedef);
 
 #endif
@@ -351,8 +351,8 @@ bool RollbackAction::applyRevert(Map *map, InventoryManager *imgr, IGameDef *gam
 				// Inform other things that the metadata has changed
 				v3s16 blockpos = getContainerPos(p, MAP_BLOCKSIZE);
 				MapEditEvent event;
-				event.type = MEET_BLOCK_NODE_METADATA_CHANGED;
-				event.p = blockpos;
+				event.type = MEET_NODE_METADATA_CHANGED;
+				event.p = p;
 				map->dispatchEvent(&event);
 				// Set the block to be saved
 				MapBlock *block = map->getBlockNoCreateNoEx(blockpos);
@@ -136,6 +136,24 @@ int LuaPerlinNoiseMap::gc_object(lua_State *L)
 	return 0;
 }
 
+// Pushes the table at index buf if there is one, so that callers can reuse
+// it from call to call, otherwise a new table with room for len values.
+// Entries of a reused table past len are cleared.
+void LuaPerlinNoiseMap::pushMapBuffer(lua_State *L, int buf, int len)
+{
+	if (!lua_istable(L, buf)) {
+		lua_createtable(L, len, 0);
+		return;
+	}
+
+	lua_pushvalue(L, buf);
+	int old_len = lua_objlen(L, -1);
+	for (int i = len + 1; i <= old_len; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+}
+
 int LuaPerlinNoiseMap::l_get2dMap(lua_State *L)
 {
 	NO_MAP_LOCK_REQUIRED;
@@ -172,7 +190,7 @@ int LuaPerlinNoiseMap::l_get2dMap_flat(lua_State *L)
 
 	int maplen = n->sx * n->sy;
 	
-	lua_newtable(L);
+	pushMapBuffer(L, 3, maplen);
 	for (int i = 0; i != maplen; i++) {
 		float noiseval = n->np->offset + n->np->scale * n->result[i];
 		lua_pushnumber(L, noiseval);
@@ -221,7 +239,7 @@ int LuaPerlinNoiseMap::l_get3dMap_flat(lua_State *L)
 
 	int maplen = n->sx * n->sy * n->sz;
 	
-	lua_newtable(L);
+	pushMapBuffer(L, 3, maplen);
 	for (int i = 0; i != maplen; i++) {
 		float noiseval = n->np->offset + n->np->scale * n->result[i];
 		lua_pushnumber(L, noiseval);
@@ -70,6 +70,8 @@ class LuaPerlinNoiseMap : public ModApiBase {
 
 	static int gc_object(lua_State *L);
 
+	static void pushMapBuffer(lua_State *L, int buf, int len);
+
 	static int l_get2dMap(lua_State *L);
 	static int l_get2dMap_flat(lua_State *L);
 	static int l_get3dMap(lua_State *L);
@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "map.h"
 #include "server.h"
 #include "mapgen.h"
+#include <new>
 
 // garbage collector
 int LuaVoxelManip::gc_object(lua_State *L)
@@ -54,48 +55,165 @@ int LuaVoxelManip::l_read_from_map(lua_State *L)
 	return 2;
 }
 
-int LuaVoxelManip::l_get_data(lua_State *L)
+static inline u16 get_node_field(const MapNode &n,
+	LuaVoxelManipView::Field field)
 {
-	NO_MAP_LOCK_REQUIRED;
+	switch (field) {
+	case LuaVoxelManipView::FIELD_PARAM1:
+		return n.param1;
+	case LuaVoxelManipView::FIELD_PARAM2:
+		return n.param2;
+	default:
+		return n.getContent();
+	}
+}
 
-	LuaVoxelManip *o = checkobject(L, 1);
-	ManualMapVoxelManipulator *vm = o->vm;
-	
+static inline void set_node_field(MapNode &n,
+	LuaVoxelManipView::Field field, u16 value)
+{
+	switch (field) {
+	case LuaVoxelManipView::FIELD_PARAM1:
+		n.param1 = value;
+		break;
+	case LuaVoxelManipView::FIELD_PARAM2:
+		n.param2 = value;
+		break;
+	default:
+		n.setContent(value);
+	}
+}
+
+int LuaVoxelManipView::pushFieldArray(lua_State *L, VoxelManipulator *vm,
+	Field field, int buffer_idx)
+{
 	int volume = vm->m_area.getVolume();
-	
-	lua_newtable(L);
+	int old_len = 0;
+
+	if (lua_istable(L, buffer_idx)) {
+		lua_pushvalue(L, buffer_idx);
+		old_len = lua_objlen(L, -1);
+	} else {
+		lua_createtable(L, volume, 0);
+	}
+
 	for (int i = 0; i != volume; i++) {
-		lua_Integer cid = vm->m_data[i].getContent();
-		lua_pushinteger(L, cid);
+		lua_pushinteger(L, get_node_field(vm->m_data[i], field));
 		lua_rawseti(L, -2, i + 1);
 	}
-	
+
+	// Don't leave the tail of a bigger buffer behind
+	for (int i = volume + 1; i <= old_len; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, -2, i);
+	}
+
 	return 1;
 }
 
+void LuaVoxelManipView::readFieldArray(lua_State *L, VoxelManipulator *vm,
+	Field field, int table_idx)
+{
+	int volume = vm->m_area.getVolume();
+	for (int i = 0; i != volume; i++) {
+		lua_rawgeti(L, table_idx, i + 1);
+		set_node_field(vm->m_data[i], field, lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+int LuaVoxelManip::l_get_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	return LuaVoxelManipView::pushFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_CONTENT, 2);
+}
+
 int LuaVoxelManip::l_set_data(lua_State *L)
 {
 	NO_MAP_LOCK_REQUIRED;
 	
 	LuaVoxelManip *o = checkobject(L, 1);
-	ManualMapVoxelManipulator *vm = o->vm;
 	
 	if (!lua_istable(L, 2))
 		return 0;
 	
-	int volume = vm->m_area.getVolume();
-	for (int i = 0; i != volume; i++) {
-		lua_rawgeti(L, 2, i + 1);
-		content_t c = lua_tointeger(L, -1);
+	LuaVoxelManipView::readFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_CONTENT, 2);
 		
-		vm->m_data[i].setContent(c);
+	return 0;
+}
+
+int LuaVoxelManip::l_get_light_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	return LuaVoxelManipView::pushFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_PARAM1, 2);
+}
+
+int LuaVoxelManip::l_set_light_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	if (!lua_istable(L, 2))
+		return 0;
+
+	LuaVoxelManipView::readFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_PARAM1, 2);
+
+	return 0;
+}
+
+int LuaVoxelManip::l_get_param2_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	return LuaVoxelManipView::pushFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_PARAM2, 2);
+}
+
+int LuaVoxelManip::l_set_param2_data(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = checkobject(L, 1);
+
+	if (!lua_istable(L, 2))
+		return 0;
+
+	LuaVoxelManipView::readFieldArray(L, o->vm,
+		LuaVoxelManipView::FIELD_PARAM2, 2);
 
-		lua_pop(L, 1);
-	}
-		
 	return 0;
 }
 
+int LuaVoxelManip::l_get_data_view(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	checkobject(L, 1);
+
+	LuaVoxelManipView::Field field = LuaVoxelManipView::FIELD_CONTENT;
+	std::string fieldname = luaL_optstring(L, 2, "content");
+	if (fieldname == "light")
+		field = LuaVoxelManipView::FIELD_PARAM1;
+	else if (fieldname == "param2")
+		field = LuaVoxelManipView::FIELD_PARAM2;
+	else if (fieldname != "content")
+		luaL_argerror(L, 2, "expected \"content\", \"light\" or \"param2\"");
+
+	return LuaVoxelManipView::create_object(L, 1, field);
+}
+
 int LuaVoxelManip::l_write_to_map(lua_State *L)
 {
 	LuaVoxelManip *o = checkobject(L, 1);
@@ -294,6 +412,11 @@ const luaL_reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, read_from_map),
 	luamethod(LuaVoxelManip, get_data),
 	luamethod(LuaVoxelManip, set_data),
+	luamethod(LuaVoxelManip, get_light_data),
+	luamethod(LuaVoxelManip, set_light_data),
+	luamethod(LuaVoxelManip, get_param2_data),
+	luamethod(LuaVoxelManip, set_param2_data),
+	luamethod(LuaVoxelManip, get_data_view),
 	luamethod(LuaVoxelManip, write_to_map),
 	luamethod(LuaVoxelManip, update_map),
 	luamethod(LuaVoxelManip, update_liquids),
@@ -301,3 +424,117 @@ const luaL_reg LuaVoxelManip::methods[] = {
 	luamethod(LuaVoxelManip, set_lighting),
 	{0,0}
 };
+
+/*
+  VoxelManipView
+ */
+
+int LuaVoxelManipView::l_index(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipView *view = checkobject(L, 1);
+	ManualMapVoxelManipulator *vm = view->o->vm;
+
+	if (!lua_isnumber(L, 2))
+		return 0;
+	int i = lua_tointeger(L, 2) - 1;
+	if (i < 0 || i >= vm->m_area.getVolume())
+		return 0;
+
+	lua_pushinteger(L, get_node_field(vm->m_data[i], view->field));
+	return 1;
+}
+
+int LuaVoxelManipView::l_newindex(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipView *view = checkobject(L, 1);
+	ManualMapVoxelManipulator *vm = view->o->vm;
+
+	int i = luaL_checkint(L, 2) - 1;
+	if (i < 0 || i >= vm->m_area.getVolume())
+		luaL_argerror(L, 2, "index out of range");
+
+	set_node_field(vm->m_data[i], view->field, luaL_checkint(L, 3));
+	return 0;
+}
+
+int LuaVoxelManipView::l_len(lua_State *L)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManipView *view = checkobject(L, 1);
+
+	lua_pushinteger(L, view->o->vm->m_area.getVolume());
+	return 1;
+}
+
+LuaVoxelManipView::LuaVoxelManipView(LuaVoxelManip *o, Field field):
+	o(o),
+	field(field)
+{
+}
+
+int LuaVoxelManipView::create_object(lua_State *L, int vm_idx, Field field)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	LuaVoxelManip *o = LuaVoxelManip::checkobject(L, vm_idx);
+	if (vm_idx < 0)
+		vm_idx = lua_gettop(L) + vm_idx + 1;
+
+	LuaVoxelManipView *view = (LuaVoxelManipView *)lua_newuserdata(L,
+		sizeof(LuaVoxelManipView));
+	new (view) LuaVoxelManipView(o, field);
+	luaL_getmetatable(L, className);
+	lua_setmetatable(L, -2);
+
+	// Keep the VoxelManip alive as long as the view exists
+	lua_createtable(L, 1, 0);
+	lua_pushvalue(L, vm_idx);
+	lua_rawseti(L, -2, 1);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+LuaVoxelManipView *LuaVoxelManipView::checkobject(lua_State *L, int narg)
+{
+	NO_MAP_LOCK_REQUIRED;
+
+	luaL_checktype(L, narg, LUA_TUSERDATA);
+
+	void *ud = luaL_checkudata(L, narg, className);
+	if (!ud)
+		luaL_typerror(L, narg, className);
+
+	return (LuaVoxelManipView *)ud;
+}
+
+void LuaVoxelManipView::Register(lua_State *L)
+{
+	luaL_newmetatable(L, className);
+	int metatable = lua_gettop(L);
+
+	lua_pushliteral(L, "__metatable");
+	lua_pushboolean(L, false);
+	lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+	lua_pushliteral(L, "__index");
+	lua_pushcfunction(L, l_index);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__newindex");
+	lua_pushcfunction(L, l_newindex);
+	lua_settable(L, metatable);
+
+	lua_pushliteral(L, "__len");
+	lua_pushcfunction(L, l_len);
+	lua_settable(L, metatable);
+
+	lua_pop(L, 1);  // drop metatable
+}
+
+const char LuaVoxelManipView::className[] = "VoxelManipView";
@@ -27,6 +27,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 class Map;
 class MapBlock;
 class ManualMapVoxelManipulator;
+class VoxelManipulator;
 
 /*
   VoxelManip
@@ -45,6 +46,11 @@ class LuaVoxelManip : public ModApiBase {
 	static int l_read_from_map(lua_State *L);
 	static int l_get_data(lua_State *L);
 	static int l_set_data(lua_State *L);
+	static int l_get_light_data(lua_State *L);
+	static int l_set_light_data(lua_State *L);
+	static int l_get_param2_data(lua_State *L);
+	static int l_set_param2_data(lua_State *L);
+	static int l_get_data_view(lua_State *L);
 	static int l_write_to_map(lua_State *L);
 
 	static int l_update_map(lua_State *L);
@@ -64,6 +70,53 @@ class LuaVoxelManip : public ModApiBase {
 	static LuaVoxelManip *checkobject(lua_State *L, int narg);
 
 	static void Register(lua_State *L);
+
+	friend class LuaVoxelManipView;
+};
+
+/*
+  VoxelManipView
+
+  Indexable view of one field of the nodes of a VoxelManip.
+  Reads and writes go straight to the VoxelManip, no table is built.
+ */
+class LuaVoxelManipView : public ModApiBase {
+public:
+	enum Field {
+		FIELD_CONTENT,
+		FIELD_PARAM1,
+		FIELD_PARAM2
+	};
+
+private:
+	LuaVoxelManip *o;
+	Field field;
+
+	static const char className[];
+
+	static int l_index(lua_State *L);
+	static int l_newindex(lua_State *L);
+	static int l_len(lua_State *L);
+
+public:
+	LuaVoxelManipView(LuaVoxelManip *o, Field field);
+
+	// Creates a view of the VoxelManip at index vm_idx
+	// and leaves it on top of stack
+	static int create_object(lua_State *L, int vm_idx, Field field);
+
+	static LuaVoxelManipView *checkobject(lua_State *L, int narg);
+
+	// Pushes an array of one field of all nodes in vm.
+	// If the value at buffer_idx is a table, it is reused: filled from 1
+	// and cleared past the volume of vm.
+	static int pushFieldArray(lua_State *L, VoxelManipulator *vm,
+		Field field, int buffer_idx);
+	// Sets one field of all nodes in vm from the array at table_idx
+	static void readFieldArray(lua_State *L, VoxelManipulator *vm,
+		Field field, int table_idx);
+
+	static void Register(lua_State *L);
 };
 
 #endif /* L_VMANIP_H_ */
@@ -63,6 +63,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "rollback.h"
 #include "util/serialize.h"
 #include "util/thread.h"
+#include "util/workerpool.h"
 #include "defaultsettings.h"
 
 class ClientNotFoundException : public BaseException
@@ -178,8 +179,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		return;
 
 	// Won't send anything if already sending
-	if(m_blocks_sending.size() >= g_settings->getU16
-			("max_simultaneous_block_sends_per_client"))
+	if(m_blocks_sending.size() >= server->m_max_simul_sends_per_client.get())
 	{
 		//infostream<<"Not sending any blocks, Queue full."<<std::endl;
 		return;
@@ -235,8 +235,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 
 	//infostream<<"d_start="<<d_start<<std::endl;
 
-	u16 max_simul_sends_setting = g_settings->getU16
-			("max_simultaneous_block_sends_per_client");
+	u16 max_simul_sends_setting = server->m_max_simul_sends_per_client.get();
 	u16 max_simul_sends_usually = max_simul_sends_setting;
 
 	/*
@@ -245,8 +244,8 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		Decrease send rate if player is building stuff.
 	*/
 	m_time_from_building += dtime;
-	if(m_time_from_building < g_settings->getFloat(
-				"full_block_send_enable_min_time_from_building"))
+	if(m_time_from_building <
+			server->m_full_block_send_min_time_from_building.get())
 	{
 		max_simul_sends_usually
 			= LIMITED_MAX_SIMULTANEOUS_BLOCK_SENDS;
@@ -266,8 +265,8 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	*/
 	s32 new_nearest_unsent_d = -1;
 
-	s16 d_max = g_settings->getS16("max_block_send_distance");
-	s16 d_max_gen = g_settings->getS16("max_block_generate_distance");
+	s16 d_max = server->m_max_block_send_distance.get();
+	s16 d_max_gen = server->m_max_block_generate_distance.get();
 
 	// Don't loop very much at a time
 	s16 max_d_increment_at_time = 2;
@@ -430,7 +429,8 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 			if(block != NULL)
 			{
 				// Reset usage timer, this block will be of use in the future.
-				block->resetUsageTimer();
+				// Done later by UpdateUsedBlocks().
+				m_blocks_used.push_back(block);
 
 				// Block is dummy if data doesn't exist.
 				// It means it has been not found from disk and not generated
@@ -469,7 +469,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				*/
 				if(d >= 4)
 				{
-					if(block->getDayNightDiff() == false)
+					if(block->getDayNightDiffNoUpdate() == false)
 						continue;
 				}
 #endif
@@ -562,7 +562,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 	} else if(nearest_emergefull_d != -1){
 		new_nearest_unsent_d = nearest_emergefull_d;
 	} else {
-		if(d > g_settings->getS16("max_block_send_distance")){
+		if(d > server->m_max_block_send_distance.get()){
 			new_nearest_unsent_d = 0;
 			m_nothing_to_send_pause_timer = 2.0;
 			/*infostream<<"GetNextBlocks(): d wrapped around for "
@@ -584,6 +584,20 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 		infostream<<"GetNextBlocks timeout: "<<timer_result<<" (!=0)"<<std::endl;*/
 }
 
+void RemoteClient::UpdateUsedBlocks()
+{
+	for(std::vector<MapBlock*>::iterator
+			i = m_blocks_used.begin();
+			i != m_blocks_used.end(); ++i)
+	{
+		MapBlock *block = *i;
+		block->resetUsageTimer();
+		// Store the flag so that it doesn't have to be calculated again
+		block->getDayNightDiff();
+	}
+	m_blocks_used.clear();
+}
+
 void RemoteClient::GotBlock(v3s16 p)
 {
 	if(m_blocks_sending.find(p) != m_blocks_sending.end())
@@ -654,6 +668,23 @@ Server::Server(
 	m_rollback_sink_enabled(true),
 	m_enable_rollback_recording(false),
 	m_emerge(NULL),
+	m_block_selection_pool(NULL),
+	m_max_simul_sends_per_client(g_settings,
+			"max_simultaneous_block_sends_per_client", &Settings::getU16),
+	m_max_simul_sends_server_total(g_settings,
+			"max_simultaneous_block_sends_server_total", &Settings::getS32),
+	m_full_block_send_min_time_from_building(g_settings,
+			"full_block_send_enable_min_time_from_building",
+			&Settings::getFloat),
+	m_max_block_send_distance(g_settings,
+			"max_block_send_distance", &Settings::getS16),
+	m_max_block_generate_distance(g_settings,
+			"max_block_generate_distance", &Settings::getS16),
+	m_active_object_send_range(g_settings,
+			"active_object_send_range_blocks", &Settings::getS16),
+	m_time_speed(g_settings, "time_speed", &Settings::getFloat),
+	m_map_save_interval(g_settings,
+			"server_map_save_interval", &Settings::getFloat),
 	m_script(NULL),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
@@ -672,6 +703,7 @@ Server::Server(
 	m_masterserver_timer = 0.0;
 	m_objectdata_timer = 0.0;
 	m_emergethread_trigger_timer = 0.0;
+	m_emerge_priority_timer = 0.0;
 	m_savemap_timer = 0.0;
 	m_clients_number = 0;
 
@@ -712,8 +744,7 @@ Server::Server(
 	m_banmanager = new BanManager(ban_path);
 
 	// Create rollback manager
-	std::string rollback_path = m_path_world+DIR_DELIM+"rollback.txt";
-	m_rollback = createRollbackManager(rollback_path, this);
+	m_rollback = createRollbackManager(m_path_world, this);
 
 	// Create world if it doesn't exist
 	if(!initializeWorld(m_path_world, m_gamespec.id))
@@ -851,6 +882,9 @@ Server::Server(
 	add_legacy_abms(m_env, m_nodedef);
 
 	m_liquid_transform_every = g_settings->getFloat("liquid_update");
+
+	m_block_selection_pool = new WorkerPool("BlockSelection",
+			g_settings->getU16("block_selection_threads"));
 }
 
 Server::~Server()
@@ -918,6 +952,8 @@ Server::~Server()
 	stop();
 	delete m_thread;
 
+	delete m_block_selection_pool;
+
 	//shutdown all emerge threads first!
 	delete m_emerge;
 
@@ -1077,7 +1113,7 @@ void Server::AsyncRunStep()
 	{
 		JMutexAutoLock envlock(m_env_mutex);
 
-		m_env->setTimeOfDaySpeed(g_settings->getFloat("time_speed"));
+		m_env->setTimeOfDaySpeed(m_time_speed.get());
 
 		/*
 			Send to clients at constant intervals
@@ -1092,7 +1128,7 @@ void Server::AsyncRunStep()
 			JMutexAutoLock conlock(m_con_mutex);
 
 			u16 time = m_env->getTimeOfDay();
-			float time_speed = g_settings->getFloat("time_speed");
+			float time_speed = m_time_speed.get();
 
 			for(std::map<u16, RemoteClient*>::iterator
 				i = m_clients.begin();
@@ -1291,7 +1327,7 @@ void Server::AsyncRunStep()
 		ScopeProfiler sp(g_profiler, "Server: checking added and deleted objs");
 
 		// Radius inside which objects are active
-		s16 radius = g_settings->getS16("active_object_send_range_blocks");
+		s16 radius = m_active_object_send_range.get();
 		radius *= MAP_BLOCKSIZE;
 
 		for(std::map<u16, RemoteClient*>::iterator
@@ -1574,6 +1610,9 @@ void Server::AsyncRunStep()
 		// We'll log the amount of each
 		Profiler prof;
 
+		// Changed node metadata is collected and sent in one batch
+		std::set<v3s16> node_meta_updates;
+
 		while(m_unsent_map_edit_queue.size() != 0)
 		{
 			MapEditEvent* event = m_unsent_map_edit_queue.pop_front();
@@ -1611,6 +1650,11 @@ void Server::AsyncRunStep()
 				prof.add("MEET_BLOCK_NODE_METADATA_CHANGED", 1);
 				setBlockNotSent(event->p);
 			}
+			else if(event->type == MEET_NODE_METADATA_CHANGED)
+			{
+				prof.add("MEET_NODE_METADATA_CHANGED", 1);
+				node_meta_updates.insert(event->p);
+			}
 			else if(event->type == MEET_OTHER)
 			{
 				infostream<<"Server: MEET_OTHER"<<std::endl;
@@ -1664,6 +1708,9 @@ void Server::AsyncRunStep()
 				break;*/
 		}
 
+		if(!node_meta_updates.empty())
+			sendMetadataChanged(node_meta_updates);
+
 		if(event_count >= 5){
 			infostream<<"Server: MapEditEvents:"<<std::endl;
 			prof.print(infostream);
@@ -1693,11 +1740,41 @@ void Server::AsyncRunStep()
 		}
 	}
 
+	/*
+		Re-sort the emerge queue by the current player positions and
+		drop blocks the players have already left behind
+	*/
+	{
+		float &counter = m_emerge_priority_timer;
+		counter += dtime;
+		if(counter >= 0.5)
+		{
+			counter = 0.0;
+
+			std::vector<v3s16> points;
+			{
+				JMutexAutoLock envlock(m_env_mutex);
+				std::list<Player*> players = m_env->getPlayers(true);
+				for(std::list<Player*>::iterator
+						i = players.begin();
+						i != players.end(); ++i)
+				{
+					v3s16 p = floatToInt((*i)->getPosition(), BS);
+					points.push_back(getNodeBlockPos(p));
+				}
+			}
+
+			s16 cancel_d = MYMAX(m_max_block_send_distance.get(),
+					m_max_block_generate_distance.get()) + 2;
+			m_emerge->updateInterestPoints(points, cancel_d);
+		}
+	}
+
 	// Save map, players and auth stuff
 	{
 		float &counter = m_savemap_timer;
 		counter += dtime;
-		if(counter >= g_settings->getFloat("server_map_save_interval"))
+		if(counter >= m_map_save_interval.get())
 		{
 			counter = 0.0;
 			JMutexAutoLock lock(m_env_mutex);
@@ -1725,18 +1802,18 @@ void Server::Receive()
 	DSTACK(__FUNCTION_NAME);
 	SharedBuffer<u8> data;
 	u16 peer_id;
-	u32 datasize;
 	try{
 		{
 			JMutexAutoLock conlock(m_con_mutex);
-			datasize = m_con.Receive(peer_id, data);
+			if(!m_con.ReceiveNoEx(peer_id, data))
+				return;
 		}
 
 		// This has to be called so that the client list gets synced
 		// with the peer list of the connection
 		handlePeerChanges();
 
-		ProcessData(*data, datasize, peer_id);
+		ProcessData(*data, data.getSize(), peer_id);
 	}
 	catch(con::InvalidIncomingDataException &e)
 	{
@@ -2146,7 +2223,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 
 		// Send inventory
 		UpdateCrafting(peer_id);
-		SendInventory(peer_id);
+		SendInventory(peer_id, true);
 
 		// Send HP
 		if(g_settings->getBool("enable_damage"))
@@ -3291,7 +3368,11 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 		if(block)
 			block->raiseModified(MOD_STATE_WRITE_NEEDED);
 
-		setBlockNotSent(blockpos);
+		// Send only the metadata of the node to the clients
+		MapEditEvent event;
+		event.type = MEET_NODE_METADATA_CHANGED;
+		event.p = loc.p;
+		m_env->getMap().dispatchEvent(&event);
 	}
 	break;
 	case InventoryLocation::DETACHED:
@@ -3481,7 +3562,7 @@ void Server::SendNodeDef(con::Connection &con, u16 peer_id,
 	Non-static send methods
 */
 
-void Server::SendInventory(u16 peer_id)
+void Server::SendInventory(u16 peer_id, bool full)
 {
 	DSTACK(__FUNCTION_NAME);
 
@@ -3490,12 +3571,40 @@ void Server::SendInventory(u16 peer_id)
 
 	playersao->m_inventory_not_sent = false;
 
+	Inventory *inv = playersao->getInventory();
+
+	/*
+		Send only what changed if the client supports it.
+		This is sent even if nothing changed: the client may have
+		predicted an action that was rejected, and it drops such
+		predictions when it gets any inventory update.
+	*/
+	if(!full)
+	{
+		RemoteClient *client = getClientNoEx(peer_id);
+		if(client && client->net_proto_version >= 22)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			writeU16(os, TOCLIENT_INVENTORY_DELTA);
+			if(inv->serializeChanges(os))
+			{
+				std::string s = os.str();
+				SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+				// Send as reliable
+				m_con.Send(peer_id, 0, data, true);
+				inv->clearChanges();
+				return;
+			}
+		}
+	}
+
 	/*
 		Serialize it
 	*/
 
 	std::ostringstream os;
-	playersao->getInventory()->serialize(os);
+	inv->serialize(os);
+	inv->clearChanges();
 
 	std::string s = os.str();
 
@@ -4070,6 +4179,107 @@ void Server::sendRemoveNode(v3s16 p, u16 ignore_id,
 	}
 }
 
+void Server::sendMetadataChanged(const std::set<v3s16> &meta_updates)
+{
+	/*
+		Serialize each entry once; the packets only differ in which
+		entries they contain. Nodes whose block is not loaded anymore
+		can't be looked up and get their block resent instead.
+	*/
+	std::map<v3s16, std::string> entries;
+	std::set<v3s16> unloaded_blocks;
+	for(std::set<v3s16>::const_iterator
+			i = meta_updates.begin();
+			i != meta_updates.end(); ++i)
+	{
+		v3s16 p = *i;
+		v3s16 blockpos = getNodeBlockPos(p);
+		if(m_env->getMap().getBlockNoCreateNoEx(blockpos) == NULL)
+		{
+			unloaded_blocks.insert(blockpos);
+			continue;
+		}
+		std::ostringstream os(std::ios_base::binary);
+		writeV3S16(os, p);
+		NodeMetadata *meta = m_env->getMap().getNodeMetadata(p);
+		if(meta)
+		{
+			writeU8(os, 1);
+			meta->serialize(os);
+		}
+		else
+		{
+			writeU8(os, 0);
+		}
+		entries[p] = os.str();
+	}
+
+	for(std::map<u16, RemoteClient*>::iterator
+		i = m_clients.begin();
+		i != m_clients.end(); ++i)
+	{
+		// Get client and check that it is valid
+		RemoteClient *client = i->second;
+		assert(client->peer_id == i->first);
+		if(client->serialization_version == SER_FMT_VER_INVALID)
+			continue;
+
+		for(std::set<v3s16>::iterator
+				j = unloaded_blocks.begin();
+				j != unloaded_blocks.end(); ++j)
+			client->SetBlockNotSent(*j);
+
+		// Older clients only understand whole blocks
+		if(client->net_proto_version < 22)
+		{
+			for(std::map<v3s16, std::string>::iterator
+					j = entries.begin();
+					j != entries.end(); ++j)
+				client->SetBlockNotSent(getNodeBlockPos(j->first));
+			continue;
+		}
+
+		// Blocks the client doesn't have will be sent with the new
+		// metadata anyway
+		std::ostringstream tmp_os(std::ios::binary);
+		u16 count = 0;
+		for(std::map<v3s16, std::string>::iterator
+				j = entries.begin();
+				j != entries.end(); ++j)
+		{
+			v3s16 blockpos = getNodeBlockPos(j->first);
+			if(!client->isBlockSent(blockpos))
+				continue;
+			if(count == 0xffff)
+			{
+				client->SetBlockNotSent(blockpos);
+				continue;
+			}
+			tmp_os<<j->second;
+			count++;
+		}
+		if(count == 0)
+			continue;
+
+		std::ostringstream tmp_os2(std::ios::binary);
+		writeU16(tmp_os2, count);
+		tmp_os2<<tmp_os.str();
+		std::ostringstream tmp_os3(std::ios::binary);
+		compressZlib(tmp_os2.str(), tmp_os3);
+
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, TOCLIENT_NODEMETA_CHANGED);
+		os<<serializeLongString(tmp_os3.str());
+
+		// Make data buffer
+		std::string s = os.str();
+		SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+		// Send as reliable on the block data channel so that it is
+		// applied after any block still on the line
+		m_con.Send(client->peer_id, 1, data, true);
+	}
+}
+
 void Server::sendAddNode(v3s16 p, MapNode n, u16 ignore_id,
 		std::list<u16> *far_players, float far_d_nodes)
 {
@@ -4159,32 +4369,56 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver, u16 net_proto
 #endif
 
 	/*
-		Create a packet with the block in the right format
+		Use the packet cached in the block if it is still up to date;
+		otherwise create a packet with the block in the right format.
+		The same data is used for all clients that use the same
+		serialization and protocol version.
 	*/
 
-	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
-	block->serializeNetworkSpecific(os, net_proto_version);
-	std::string s = os.str();
-	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
+	std::string s;
+	if(!block->getNetworkCache(ver, net_proto_version, s))
+	{
+		std::ostringstream os(std::ios_base::binary);
+		writeU16(os, TOCLIENT_BLOCKDATA);
+		writeV3S16(os, p);
+		block->serialize(os, ver, false);
+		block->serializeNetworkSpecific(os, net_proto_version);
+		s = os.str();
 
-	u32 replysize = 8 + blockdata.getSize();
-	SharedBuffer<u8> reply(replysize);
-	writeU16(&reply[0], TOCLIENT_BLOCKDATA);
-	writeS16(&reply[2], p.X);
-	writeS16(&reply[4], p.Y);
-	writeS16(&reply[6], p.Z);
-	memcpy(&reply[8], *blockdata, blockdata.getSize());
+		block->setNetworkCache(ver, net_proto_version, s);
 
-	/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
-			<<":  \tpacket size: "<<replysize<<std::endl;*/
+		/*infostream<<"Server: Sending block ("<<p.X<<","<<p.Y<<","<<p.Z<<")"
+				<<":  \tpacket size: "<<s.size()<<std::endl;*/
+	}
 
 	/*
 		Send packet
 	*/
+	// Every send gets a buffer of its own
+	SharedBuffer<u8> reply((u8*)s.c_str(), s.size());
 	m_con.Send(peer_id, 1, reply, true);
 }
 
+class BlockSelectionJob : public WorkerPoolJob
+{
+public:
+	BlockSelectionJob(Server *server, RemoteClient *client, float dtime):
+		server(server),
+		client(client),
+		dtime(dtime)
+	{}
+
+	void run()
+	{
+		client->GetNextBlocks(server, dtime, dest);
+	}
+
+	Server *server;
+	RemoteClient *client;
+	float dtime;
+	std::vector<PrioritySortedBlockTransfer> dest;
+};
+
 void Server::SendBlocks(float dtime)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -4201,6 +4435,9 @@ void Server::SendBlocks(float dtime)
 	{
 		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
 
+		std::vector<BlockSelectionJob> jobs;
+		jobs.reserve(m_clients.size());
+
 		for(std::map<u16, RemoteClient*>::iterator
 			i = m_clients.begin();
 			i != m_clients.end(); ++i)
@@ -4218,7 +4455,23 @@ void Server::SendBlocks(float dtime)
 			if(client->serialization_version == SER_FMT_VER_INVALID)
 				continue;
 
-			client->GetNextBlocks(this, dtime, queue);
+			jobs.push_back(BlockSelectionJob(this, client, dtime));
+		}
+
+		/*
+			The environment lock keeps the map unmodified, so the
+			clients can be handled in parallel.
+		*/
+		std::vector<WorkerPoolJob*> job_ptrs;
+		for(u32 i=0; i<jobs.size(); i++)
+			job_ptrs.push_back(&jobs[i]);
+		m_block_selection_pool->run(job_ptrs);
+
+		for(u32 i=0; i<jobs.size(); i++)
+		{
+			jobs[i].client->UpdateUsedBlocks();
+			queue.insert(queue.end(), jobs[i].dest.begin(),
+					jobs[i].dest.end());
 		}
 	}
 
@@ -4230,8 +4483,7 @@ void Server::SendBlocks(float dtime)
 	for(u32 i=0; i<queue.size(); i++)
 	{
 		//TODO: Calculate limit dynamically
-		if(total_sending >= g_settings->getS32
-				("max_simultaneous_block_sends_server_total"))
+		if(total_sending >= m_max_simul_sends_server_total.get())
 			break;
 
 		PrioritySortedBlockTransfer q = queue[i];
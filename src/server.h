@@ -33,6 +33,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h"
 #include "util/thread.h"
 #include "environment.h"
+#include "settings.h" // CachedSetting
 #include <string>
 #include <list>
 #include <map>
@@ -52,6 +53,7 @@ class IRollbackManager;
 class EmergeManager;
 class GameScripting;
 class ServerEnvironment;
+class WorkerPool;
 struct SimpleSoundSpec;
 
 
@@ -250,10 +252,21 @@ class RemoteClient
 		Finds block that should be sent next to the client.
 		Environment should be locked when this is called.
 		dtime is used for resetting send radius at slow interval
+
+		The map is only read, so this can be called for several
+		clients at once. Changes to the looked-at blocks are left
+		for UpdateUsedBlocks().
 	*/
 	void GetNextBlocks(Server *server, float dtime,
 			std::vector<PrioritySortedBlockTransfer> &dest);
 
+	/*
+		Resets the usage timers of the blocks looked at by the last
+		GetNextBlocks() call.
+		Environment should be locked when this is called.
+	*/
+	void UpdateUsedBlocks();
+
 	void GotBlock(v3s16 p);
 
 	void SentBlock(v3s16 p);
@@ -261,6 +274,13 @@ class RemoteClient
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(std::map<v3s16, MapBlock*> &blocks);
 
+	// Returns true if the block has been sent or is on the line
+	bool isBlockSent(v3s16 p)
+	{
+		return (m_blocks_sent.find(p) != m_blocks_sent.end() ||
+				m_blocks_sending.find(p) != m_blocks_sending.end());
+	}
+
 	s32 SendingCount()
 	{
 		return m_blocks_sending.size();
@@ -322,6 +342,9 @@ class RemoteClient
 	*/
 	std::map<v3s16, float> m_blocks_sending;
 
+	// Blocks looked at by GetNextBlocks(), see UpdateUsedBlocks()
+	std::vector<MapBlock*> m_blocks_used;
+
 	/*
 		Count of excess GotBlocks().
 		There is an excess amount because the client sometimes
@@ -531,7 +554,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	*/
 
 	// Envlock and conlock should be locked when calling these
-	void SendInventory(u16 peer_id);
+	// Sends only the changed lists and slots if possible, unless full
+	void SendInventory(u16 peer_id, bool full=false);
 	void SendChatMessage(u16 peer_id, const std::wstring &message);
 	void BroadcastChatMessage(const std::wstring &message);
 	void SendTimeOfDay(u16 peer_id, u16 time, f32 time_speed);
@@ -557,6 +581,13 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			std::list<u16> *far_players=NULL, float far_d_nodes=100);
 	void sendAddNode(v3s16 p, MapNode n, u16 ignore_id=0,
 			std::list<u16> *far_players=NULL, float far_d_nodes=100);
+	/*
+		Send the current metadata of the given nodes to all clients that
+		have the containing blocks. Clients too old to understand it get
+		the blocks resent instead.
+	*/
+	// Envlock and conlock should be locked when calling this
+	void sendMetadataChanged(const std::set<v3s16> &meta_updates);
 	void setBlockNotSent(v3s16 p);
 
 	// Environment and Connection must be locked when called
@@ -670,6 +701,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	float m_masterserver_timer;
 	float m_objectdata_timer;
 	float m_emergethread_trigger_timer;
+	float m_emerge_priority_timer;
 	float m_savemap_timer;
 	IntervalLimiter m_map_timer_and_unload_interval;
 
@@ -698,6 +730,19 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Emerge manager
 	EmergeManager *m_emerge;
 
+	// Threads that select the blocks to send for each client
+	WorkerPool *m_block_selection_pool;
+
+	// Settings read in every step or for every client
+	CachedSetting<u16> m_max_simul_sends_per_client;
+	CachedSetting<s32> m_max_simul_sends_server_total;
+	CachedSetting<float> m_full_block_send_min_time_from_building;
+	CachedSetting<s16> m_max_block_send_distance;
+	CachedSetting<s16> m_max_block_generate_distance;
+	CachedSetting<s16> m_active_object_send_range;
+	CachedSetting<float> m_time_speed;
+	CachedSetting<float> m_map_save_interval;
+
 	// Scripting
 	// Envlock and conlock should be locked when using Lua
 	GameScripting *m_script;
@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <fstream>
 #include "inventory.h"
 #include "constants.h" // BS
+#include "environment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
@@ -38,6 +39,13 @@ ServerActiveObject::~ServerActiveObject()
 {
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	m_base_position = pos;
+	if(m_env)
+		m_env->activeObjectMoved(m_id, pos);
+}
+
 ServerActiveObject* ServerActiveObject::create(u8 type,
 		ServerEnvironment *env, u16 id, v3f pos,
 		const std::string &data)
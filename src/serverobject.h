@@ -82,7 +82,9 @@ class ServerActiveObject : public ActiveObject
 		Some simple getters/setters
 	*/
 	v3f getBasePosition(){ return m_base_position; }
-	void setBasePosition(v3f pos){ m_base_position = pos; }
+	// Also keeps the environment's spatial index up to date; always
+	// use this instead of writing m_base_position directly
+	void setBasePosition(v3f pos);
 	ServerEnvironment* getEnv(){ return m_env; }
 	
 	/*
@@ -58,7 +58,8 @@ struct ValueSpec
 class Settings
 {
 public:
-	Settings()
+	Settings():
+		m_generation(1)
 	{
 		m_mutex.Init();
 	}
@@ -92,9 +93,18 @@ class Settings
 	// remove a setting
 	bool remove(const std::string& name)
 	{
+		JMutexAutoLock lock(m_mutex);
+
+		bumpGeneration();
 		return m_settings.erase(name);
 	}
 
+	// Changes whenever any setting or default changes; see CachedSetting
+	u32 getGeneration()
+	{
+		return porting::atomicLoad(&m_generation);
+	}
+
 
 	bool parseConfigLine(const std::string &line)
 	{
@@ -123,6 +133,7 @@ class Settings
 				<<value<<"\""<<std::endl;*/
 
 		m_settings[name] = value;
+		bumpGeneration();
 
 		return true;
 	}
@@ -426,6 +437,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		bumpGeneration();
 	}
 
 	void set(std::string name, const char *value)
@@ -433,6 +445,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_settings[name] = value;
+		bumpGeneration();
 	}
 
 
@@ -441,6 +454,7 @@ class Settings
 		JMutexAutoLock lock(m_mutex);
 
 		m_defaults[name] = value;
+		bumpGeneration();
 	}
 
 	bool exists(std::string name)
@@ -897,6 +911,7 @@ class Settings
 
 		m_settings.clear();
 		m_defaults.clear();
+		bumpGeneration();
 	}
 
 	void updateValue(Settings &other, const std::string &name)
@@ -909,6 +924,7 @@ class Settings
 		try{
 			std::string val = other.get(name);
 			m_settings[name] = val;
+			bumpGeneration();
 		} catch(SettingNotFoundException &e){
 		}
 
@@ -925,6 +941,7 @@ class Settings
 
 		m_settings.insert(other.m_settings.begin(), other.m_settings.end());
 		m_defaults.insert(other.m_defaults.begin(), other.m_defaults.end());
+		bumpGeneration();
 
 		return;
 	}
@@ -962,6 +979,88 @@ class Settings
 	std::map<std::string, std::string> m_defaults;
 	// All methods that access m_settings/m_defaults directly should lock this.
 	JMutex m_mutex;
+	void bumpGeneration()
+	{
+		porting::atomicStore(&m_generation, m_generation + 1);
+	}
+
+	// Incremented under m_mutex after every change. Stored with
+	// porting::atomicStore() so that it can be read without the lock.
+	volatile u32 m_generation;
+};
+
+/*
+	A typed setting value for hot paths.
+
+	The value is parsed with the given Settings getter, and parsed again
+	only after a setting has changed. The usual get() takes no lock: it
+	compares Settings::getGeneration() with the generation of the cached
+	value, which is checked again after copying the value so that a
+	concurrent refresh is noticed. Changes made in any way, including
+	from Lua, are picked up at the next get().
+
+	Example:
+		CachedSetting<u16> max_users(g_settings, "max_users",
+				&Settings::getU16);
+		if(count >= max_users.get())
+*/
+template<typename T>
+class CachedSetting
+{
+public:
+	typedef T (Settings::*Getter)(std::string name);
+
+	CachedSetting(Settings *settings, const std::string &name,
+			Getter getter):
+		m_settings(settings),
+		m_name(name),
+		m_getter(getter),
+		m_value(),
+		m_generation(0)
+	{
+		m_mutex.Init();
+	}
+
+	T get()
+	{
+		u32 generation = m_settings->getGeneration();
+		if(porting::atomicLoad(&m_generation) == generation)
+		{
+			T value = m_value;
+			// A refresh clears m_generation before changing m_value
+			if(porting::atomicLoad(&m_generation) == generation)
+				return value;
+		}
+		return refresh();
+	}
+
+private:
+	T refresh()
+	{
+		JMutexAutoLock lock(m_mutex);
+
+		// Only ever moves forward, so a reader can't see the same
+		// generation before and after a change of m_value
+		u32 generation = m_settings->getGeneration();
+		if(m_generation == generation)
+			return m_value;
+		porting::atomicStore(&m_generation, 0);
+		// The generation is read before the value, so a change in
+		// between only causes another refresh later
+		T value = (m_settings->*m_getter)(m_name);
+		m_value = value;
+		porting::atomicStore(&m_generation, generation);
+		return value;
+	}
+
+	Settings *m_settings;
+	std::string m_name;
+	Getter m_getter;
+	T m_value;
+	// Generation of m_value; 0 while it is being changed
+	volatile u32 m_generation;
+	// Serializes refreshes
+	JMutex m_mutex;
 };
 
 #endif
@@ -242,7 +242,8 @@ bool initializeWorld(const std::string &path, const std::string &gameid)
 		infostream<<"Creating world.mt ("<<worldmt_path<<")"<<std::endl;
 		fs::CreateAllDirs(path);
 		std::ostringstream ss(std::ios_base::binary);
-		ss<<"gameid = "<<gameid<<"\nbackend = sqlite3\n";
+		ss<<"gameid = "<<gameid<<"\nbackend = sqlite3\n"
+				<<"player_backend = sqlite3\n";
 		fs::safeWriteToFile(worldmt_path, ss.str());
 	}
 	return true;
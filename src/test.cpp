@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes_extrabloated.h"
 #include "debug.h"
 #include "map.h"
+#include "mapblock.h"
 #include "player.h"
 #include "main.h"
 #include "socket.h"
@@ -39,10 +40,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "filesys.h"
 #include "voxelalgorithms.h"
 #include "inventory.h"
+#include "environment.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
-#include "noise.h" // PseudoRandom used for random data for compression
+#include "util/workerpool.h"
+#include "database.h"
+#include "noise.h"
 #include "clientserver.h" // LATEST_PROTOCOL_VERSION
+#include "lua_api/l_vmanip.h"
 #include <algorithm>
 
 /*
@@ -409,6 +414,14 @@ struct TestSettings: public TestBase
 		UASSERT(fabs(s.getV3F("coord2").X - 1.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Y - 2.0) < 0.001);
 		UASSERT(fabs(s.getV3F("coord2").Z - 3.3) < 0.001);
+		// Cached settings follow changes
+		CachedSetting<s32> leet(&s, "leet", &Settings::getS32);
+		UASSERT(leet.get() == 1337);
+		s.set("leet", "7331");
+		UASSERT(leet.get() == 7331);
+		s.remove("leet");
+		s.setDefault("leet", "42");
+		UASSERT(leet.get() == 42);
 	}
 };
 
@@ -545,6 +558,46 @@ struct TestNodedefSerialization: public TestBase
 	}
 };
 
+struct TestNodeCollisionBoxes: public TestBase
+{
+	void Run()
+	{
+		IWritableNodeDefManager *ndef = createNodeDefManager();
+
+		ContentFeatures f;
+		f.name = "test:stair";
+		f.param_type_2 = CPT2_FACEDIR;
+		f.groups["bouncy"] = 40;
+		f.node_box.type = NODEBOX_FIXED;
+		f.node_box.fixed.push_back(aabb3f(-BS/2,-BS/2,-BS/2,BS/2,0,BS/2));
+		f.node_box.fixed.push_back(aabb3f(-BS/2,0,0,BS/2,BS/2,BS/2));
+		content_t c = ndef->set(f.name, f);
+		UASSERT(ndef->get(c).bouncy == 40);
+
+		// The cached boxes must match the generic transformation
+		for(u32 param2 = 0; param2 < 256; param2++)
+		{
+			MapNode n(c, 0, param2);
+			std::vector<aabb3f> boxes = n.getNodeBoxes(ndef);
+			const aabb3f *cached;
+			u32 count = ndef->get(c).getCollisionBoxes(param2, &cached);
+			UASSERT(count == boxes.size());
+			for(u32 i = 0; i < count; i++)
+			{
+				UASSERT(cached[i].MinEdge == boxes[i].MinEdge);
+				UASSERT(cached[i].MaxEdge == boxes[i].MaxEdge);
+			}
+		}
+
+		// Regular nodes have a single full box
+		const aabb3f *cached;
+		UASSERT(ndef->get(CONTENT_UNKNOWN).getCollisionBoxes(3, &cached) == 1);
+		UASSERT(cached[0] == aabb3f(-BS/2,-BS/2,-BS/2,BS/2,BS/2,BS/2));
+
+		delete ndef;
+	}
+};
+
 struct TestCompress: public TestBase
 {
 	void Run()
@@ -923,6 +976,65 @@ struct TestVoxelAlgorithms: public TestBase
 	}
 };
 
+struct TestVoxelManipArrays: public TestBase
+{
+	void setGetField(lua_State *L, VoxelManipulator &v,
+			LuaVoxelManipView::Field field)
+	{
+		int volume = v.m_area.getVolume();
+
+		// Set the field of every node
+		lua_createtable(L, volume, 0);
+		for(int i = 0; i < volume; i++){
+			lua_pushinteger(L, (i * 7 + field) % 256);
+			lua_rawseti(L, -2, i + 1);
+		}
+		LuaVoxelManipView::readFieldArray(L, &v, field, lua_gettop(L));
+		lua_pop(L, 1);
+
+		// Get it back into a buffer that is bigger than the VoxelManip
+		lua_createtable(L, volume * 2, 0);
+		for(int i = 0; i < volume * 2; i++){
+			lua_pushinteger(L, 1000);
+			lua_rawseti(L, -2, i + 1);
+		}
+		LuaVoxelManipView::pushFieldArray(L, &v, field, lua_gettop(L));
+		UASSERT(lua_rawequal(L, -1, -2));
+		UASSERT((int)lua_objlen(L, -1) == volume);
+		for(int i = 0; i < volume; i++){
+			lua_rawgeti(L, -1, i + 1);
+			UASSERT(lua_tointeger(L, -1) == (i * 7 + field) % 256);
+			lua_pop(L, 1);
+		}
+		for(int i = volume; i < volume * 2; i++){
+			lua_rawgeti(L, -1, i + 1);
+			UASSERT(lua_isnil(L, -1));
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 2);
+
+		// Get it into a new table
+		lua_pushnil(L);
+		LuaVoxelManipView::pushFieldArray(L, &v, field, lua_gettop(L));
+		UASSERT(lua_istable(L, -1));
+		UASSERT((int)lua_objlen(L, -1) == volume);
+		lua_pop(L, 2);
+	}
+
+	void Run()
+	{
+		VoxelManipulator v;
+		v.addArea(VoxelArea(v3s16(-1,-1,-1), v3s16(1,1,1)));
+
+		lua_State *L = luaL_newstate();
+		setGetField(L, v, LuaVoxelManipView::FIELD_PARAM1);
+		setGetField(L, v, LuaVoxelManipView::FIELD_PARAM2);
+		setGetField(L, v, LuaVoxelManipView::FIELD_CONTENT);
+		UASSERT(lua_gettop(L) == 0);
+		lua_close(L);
+	}
+};
+
 struct TestInventory: public TestBase
 {
 	void Run(IItemDefManager *idef)
@@ -1016,6 +1128,44 @@ struct TestInventory: public TestBase
 		std::ostringstream inv_os(std::ios::binary);
 		inv.serialize(inv_os);
 		UASSERT(inv_os.str() == serialized_inventory_2);
+
+		/*
+			Change tracking
+		*/
+		Inventory inv2(inv);
+		inv.clearChanges();
+		UASSERT(!inv.isChanged());
+		InventoryList *list = inv.getList("main");
+		list->changeItem(0, ItemStack("default:dirt", 5, 0, "meta", idef));
+		list->takeItem(9, 60);
+		UASSERT(inv.isChanged());
+		std::ostringstream delta_os(std::ios::binary);
+		UASSERT(inv.serializeChanges(delta_os));
+		std::istringstream delta_is(delta_os.str(), std::ios::binary);
+		inv2.deSerializeChanges(delta_is);
+		UASSERT(inv2 == inv);
+		inv.clearChanges();
+		UASSERT(!inv.isChanged());
+
+		/*
+			A move the client predicted but the server rejected: the
+			delta is empty, and applying it the way the client does
+			drops the prediction
+		*/
+		Inventory from_server(inv);
+		Inventory client_inv(inv);
+		client_inv.getList("main")->moveItem(24, client_inv.getList("main"), 3);
+		UASSERT(!(client_inv == inv));
+		std::ostringstream delta_os3(std::ios::binary);
+		UASSERT(inv.serializeChanges(delta_os3));
+		std::istringstream delta_is3(delta_os3.str(), std::ios::binary);
+		from_server.deSerializeChanges(delta_is3);
+		client_inv = from_server;
+		UASSERT(client_inv == inv);
+
+		inv.deleteList("main");
+		std::ostringstream delta_os2(std::ios::binary);
+		UASSERT(!inv.serializeChanges(delta_os2));
 	}
 };
 
@@ -1497,6 +1647,232 @@ struct TestCollision: public TestBase
 	}
 };
 
+struct TestActiveObjectIndex: public TestBase
+{
+	bool found(std::vector<u16> &ids, u16 id)
+	{
+		return std::find(ids.begin(), ids.end(), id) != ids.end();
+	}
+
+	void Run()
+	{
+		ActiveObjectIndex index;
+		index.insert(1, v3f(0, 0, 0));
+		index.insert(2, v3f(100*BS, 0, 0));
+		index.insert(3, v3f(5*BS, -3*BS, 7*BS));
+		UASSERT(index.size() == 3);
+
+		std::vector<u16> ids;
+		index.getObjectsNear(v3f(0, 0, 0), 10*BS, ids);
+		UASSERT(found(ids, 1));
+		UASSERT(!found(ids, 2));
+		UASSERT(found(ids, 3));
+
+		// Moving an object moves it between buckets
+		index.update(1, v3f(95*BS, 0, 0));
+		ids.clear();
+		index.getObjectsNear(v3f(100*BS, 0, 0), 10*BS, ids);
+		UASSERT(found(ids, 1));
+		UASSERT(found(ids, 2));
+		UASSERT(!found(ids, 3));
+
+		// Unknown ids are ignored
+		index.update(4, v3f(0, 0, 0));
+		UASSERT(index.size() == 3);
+
+		// Huge radii and positions outside the map still work
+		index.insert(5, v3f(1e9, -1e9, 0));
+		ids.clear();
+		index.getObjectsNear(v3f(0, 0, 0), 1e10, ids);
+		UASSERT(ids.size() == 4);
+
+		index.remove(2);
+		index.remove(5);
+		ids.clear();
+		index.getObjectsNear(v3f(100*BS, 0, 0), 10*BS, ids);
+		UASSERT(found(ids, 1));
+		UASSERT(!found(ids, 2));
+		UASSERT(index.size() == 2);
+	}
+};
+
+struct TestBlockPosFilter: public TestBase
+{
+	void Run()
+	{
+		BlockPosFilter filter;
+		// An unsized filter can't rule anything out
+		UASSERT(filter.mayContain(1234));
+
+		filter.reset(1000);
+		UASSERT(!filter.mayContain(1234));
+
+		// No false negatives
+		for(s64 i=0; i<100000; i++)
+			filter.insert(i * 4099 - 50000);
+		for(s64 i=0; i<100000; i++)
+			UASSERT(filter.mayContain(i * 4099 - 50000));
+
+		// Few false positives
+		u32 false_positives = 0;
+		for(s64 i=0; i<10000; i++)
+		{
+			if(filter.mayContain(i * 4099 + 1))
+				false_positives++;
+		}
+		UASSERT(false_positives < 500);
+	}
+};
+
+struct TestMapBlockIndex: public TestBase
+{
+	void Run()
+	{
+		MapBlockIndex index;
+		std::vector<MapBlock*> blocks;
+		for(s16 z=-8; z<8; z++)
+		for(s16 y=-8; y<8; y++)
+		for(s16 x=-8; x<8; x++)
+		{
+			// Spread out so that the packed keys differ in all parts
+			v3s16 p(x * 97, y * 31000 / 8, z);
+			MapBlock *block = new MapBlock(NULL, p, NULL, true);
+			blocks.push_back(block);
+			index.set(p, block);
+		}
+		// Grown well past the initial size
+		UASSERT(index.size() == blocks.size());
+		for(u32 i=0; i<blocks.size(); i++)
+			UASSERT(index.get(blocks[i]->getPos()) == blocks[i]);
+		UASSERT(index.get(v3s16(1, 2, 3)) == NULL);
+
+		// Removing keeps the rest findable
+		for(u32 i=0; i<blocks.size(); i+=3)
+			index.remove(blocks[i]->getPos());
+		for(u32 i=0; i<blocks.size(); i++)
+		{
+			MapBlock *expected = (i % 3 == 0) ? NULL : blocks[i];
+			UASSERT(index.get(blocks[i]->getPos()) == expected);
+		}
+
+		// Replacing doesn't add an entry
+		u32 size = index.size();
+		index.set(blocks[1]->getPos(), blocks[2]);
+		UASSERT(index.size() == size);
+		UASSERT(index.get(blocks[1]->getPos()) == blocks[2]);
+
+		index.clear();
+		UASSERT(index.size() == 0);
+		UASSERT(index.get(blocks[1]->getPos()) == NULL);
+
+		for(u32 i=0; i<blocks.size(); i++)
+			delete blocks[i];
+	}
+};
+
+struct TestNoise: public TestBase
+{
+	void Run()
+	{
+		// Values from release builds before the hash was made unsigned;
+		// the terrain of existing worlds depends on them
+		struct { int x, y, seed; float v; } points2[] = {
+			{0, 0, 0, -0.281790972f},
+			{-300, -299, 1234, 2.7573123f},
+			{-300, -297, 1234, 2.98647642f},
+			{17, -5, 42, 2.34091306f},
+			{100000, -7, -1, 2.01911592f},
+			{-2000000, 3, 1337, -0.950885296f},
+		};
+		for(u32 i=0; i<sizeof(points2)/sizeof(points2[0]); i++)
+			UASSERT(noise2d(points2[i].x, points2[i].y,
+					points2[i].seed) == points2[i].v);
+		struct { int x, y, z, seed; float v; } points3[] = {
+			{0, 0, 0, 0, -0.281790972f},
+			{-300, -299, 5, 1234, 2.60623074f},
+			{1, 2, 3, 4, 1.38765121f},
+			{-20, 333, -1000, 1241, -0.0395721197f},
+			{65536, -65536, 31000, -99, 2.46602535f},
+			{-7, -8, -9, 123456789, -0.610361695f},
+		};
+		for(u32 i=0; i<sizeof(points3)/sizeof(points3[0]); i++)
+			UASSERT(noise3d(points3[i].x, points3[i].y, points3[i].z,
+					points3[i].seed) == points3[i].v);
+
+		// With a spread of 1 the map samples land exactly on the
+		// lattice, so they must equal the single point noise
+		NoiseParams np = {0, 1, v3f(1, 1, 1), 1234, 1, 0.5};
+		Noise noise2(&np, 7, 37, 5);
+		noise2.perlinMap2D(-20, 333);
+		for(s32 y=0; y<5; y++)
+		for(s32 x=0; x<37; x++)
+			UASSERT(noise2.result[y * 37 + x] ==
+					noise2d(-20 + x, 333 + y, 7 + 1234));
+
+		Noise noise3(&np, 7, 37, 5, 3);
+		noise3.perlinMap3D(-20, 333, -1000);
+		for(s32 z=0; z<3; z++)
+		for(s32 y=0; y<5; y++)
+		for(s32 x=0; x<37; x++)
+			UASSERT(noise3.result[(z * 5 + y) * 37 + x] ==
+					noise3d(-20 + x, 333 + y, -1000 + z, 7 + 1234));
+
+		// A batch spread over threads must match the serial maps exactly
+		NoiseParams np5 = {0.5, 2.0, v3f(25, 25, 25), 55, 5, 0.6};
+		Noise serial2(&np5, 3, 21, 9), serial3(&np5, 3, 21, 9, 4);
+		Noise batch2(&np5, 3, 21, 9), batch3(&np5, 3, 21, 9, 4);
+		serial2.perlinMap2D(-77.5, 12);
+		serial2.transformNoiseMap();
+		serial3.perlinMap3D(-77.5, 12, 400);
+		WorkerPool pool("TestNoise", 2);
+		NoiseMapBatch batch;
+		batch.add2D(&batch2, -77.5, 12, true);
+		batch.add3D(&batch3, -77.5, 12, 400, false);
+		batch.run(&pool);
+		UASSERT(memcmp(serial2.result, batch2.result,
+				sizeof(float) * 21 * 9) == 0);
+		UASSERT(memcmp(serial3.result, batch3.result,
+				sizeof(float) * 21 * 9 * 4) == 0);
+	}
+};
+
+struct TestWorkerPool: public TestBase
+{
+	struct SumJob: public WorkerPoolJob
+	{
+		SumJob(u32 n): n(n), sum(0) {}
+		void run()
+		{
+			for(u32 i=1; i<=n; i++)
+				sum += i;
+		}
+		u32 n;
+		u32 sum;
+	};
+
+	void Run()
+	{
+		for(u32 num_threads=0; num_threads<=3; num_threads++)
+		{
+			WorkerPool pool("TestWorkerPool", num_threads);
+			UASSERT(pool.getThreadCount() == num_threads);
+			// Run a few batches to see that the threads are reused
+			for(u32 batch=0; batch<3; batch++)
+			{
+				std::vector<SumJob> jobs;
+				for(u32 i=0; i<20; i++)
+					jobs.push_back(SumJob(i * 100));
+				std::vector<WorkerPoolJob*> job_ptrs;
+				for(u32 i=0; i<jobs.size(); i++)
+					job_ptrs.push_back(&jobs[i]);
+				pool.run(job_ptrs);
+				for(u32 i=0; i<jobs.size(); i++)
+					UASSERT(jobs[i].sum == jobs[i].n * (jobs[i].n + 1) / 2);
+			}
+		}
+	}
+};
+
 struct TestSocket: public TestBase
 {
 	void Run()
@@ -1999,13 +2375,20 @@ void run_tests()
 	TEST(TestCompress);
 	TEST(TestSerialization);
 	TEST(TestNodedefSerialization);
+	TEST(TestNodeCollisionBoxes);
 	TESTPARAMS(TestMapNode, ndef);
 	TESTPARAMS(TestVoxelManipulator, ndef);
 	TESTPARAMS(TestVoxelAlgorithms, ndef);
+	TEST(TestVoxelManipArrays);
 	TESTPARAMS(TestInventory, idef);
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestActiveObjectIndex);
+	TEST(TestBlockPosFilter);
+	TEST(TestMapBlockIndex);
+	TEST(TestNoise);
+	TEST(TestWorkerPool);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
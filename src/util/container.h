@@ -266,6 +266,14 @@ class MutexedQueue
 		m_list.push_back(t);
 	}
 	T pop_front(u32 wait_time_max_ms=0)
+	{
+		T t;
+		if(!pop_frontNoEx(t, wait_time_max_ms))
+			throw ItemNotFoundException("MutexedQueue: queue is empty");
+		return t;
+	}
+	// Returns false if the queue stays empty for wait_time_max_ms
+	bool pop_frontNoEx(T &t, u32 wait_time_max_ms=0)
 	{
 		u32 wait_time_ms = 0;
 
@@ -277,13 +285,13 @@ class MutexedQueue
 				if(!m_list.empty())
 				{
 					typename std::list<T>::iterator begin = m_list.begin();
-					T t = *begin;
+					t = *begin;
 					m_list.erase(begin);
-					return t;
+					return true;
 				}
 
 				if(wait_time_ms >= wait_time_max_ms)
-					throw ItemNotFoundException("MutexedQueue: queue is empty");
+					return false;
 			}
 
 			// Wait a while before trying again
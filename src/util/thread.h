@@ -170,7 +170,9 @@ class RequestQueue
 		JMutexAutoLock lock(m_queue.getMutex());
 		
 		/*
-			If the caller is already on the list, only update CallerData
+			If the caller is already on the list, only update CallerData.
+			Requests of other threads wait on other result queues, so they
+			are only merged when the destination is the same.
 		*/
 		for(typename std::list< GetRequest<Key, T, Caller, CallerData> >::iterator
 				i = m_queue.getList().begin();
@@ -178,7 +180,7 @@ class RequestQueue
 		{
 			GetRequest<Key, T, Caller, CallerData> &request = *i;
 
-			if(request.key == key)
+			if(request.key == key && request.dest == dest)
 			{
 				for(typename std::list< CallerInfo<Caller, CallerData> >::iterator
 						i = request.callers.begin();
@@ -0,0 +1,153 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "workerpool.h"
+#include "../porting.h"
+#include "container.h"
+#include "thread.h"
+#include "../debug.h"
+#include "../log.h"
+#include "numeric.h"
+#include "string.h"
+
+class WorkerPoolThread : public SimpleThread
+{
+public:
+	WorkerPoolThread(WorkerPool *pool, const std::string &name):
+		SimpleThread(),
+		m_pool(pool),
+		m_name(name)
+	{
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+		log_register_thread(m_name);
+		DSTACK(__FUNCTION_NAME);
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		for(;;)
+		{
+			m_start.wait();
+			if(getRun() == false)
+				break;
+			m_pool->work();
+			m_done.signal();
+		}
+
+		END_DEBUG_EXCEPTION_HANDLER(errorstream)
+		return NULL;
+	}
+
+	// Signaled when a batch starts or the thread should quit
+	Event m_start;
+	// Signaled when the thread has run out of jobs
+	Event m_done;
+
+private:
+	WorkerPool *m_pool;
+	std::string m_name;
+};
+
+WorkerPool::WorkerPool(const std::string &name, u32 num_threads):
+	m_jobs(NULL),
+	m_next_job(0)
+{
+	m_mutex.Init();
+	for(u32 i = 0; i < num_threads; i++)
+	{
+		WorkerPoolThread *thread = new WorkerPoolThread(this,
+				name + itos(i));
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_threads[i]->setRun(false);
+	// Wake up every thread so that it notices it should quit
+	for(u32 i = 0; i < m_threads.size(); i++)
+		m_threads[i]->m_start.signal();
+	for(u32 i = 0; i < m_threads.size(); i++)
+	{
+		while(m_threads[i]->IsRunning())
+			sleep_ms(1);
+		delete m_threads[i];
+	}
+}
+
+void WorkerPool::run(const std::vector<WorkerPoolJob*> &jobs)
+{
+	if(jobs.empty())
+		return;
+
+	bool busy = false;
+	{
+		JMutexAutoLock lock(m_mutex);
+		if(m_jobs != NULL)
+		{
+			busy = true;
+		}
+		else
+		{
+			m_jobs = &jobs;
+			m_next_job = 0;
+		}
+	}
+
+	if(busy)
+	{
+		for(u32 i = 0; i < jobs.size(); i++)
+			jobs[i]->run();
+		return;
+	}
+
+	// Don't wake up more threads than there are jobs for; the calling
+	// thread takes a share too
+	u32 num_woken = MYMIN(m_threads.size(), jobs.size() - 1);
+	for(u32 i = 0; i < num_woken; i++)
+		m_threads[i]->m_start.signal();
+
+	work();
+
+	for(u32 i = 0; i < num_woken; i++)
+		m_threads[i]->m_done.wait();
+
+	JMutexAutoLock lock(m_mutex);
+	m_jobs = NULL;
+}
+
+void WorkerPool::work()
+{
+	for(;;)
+	{
+		WorkerPoolJob *job = NULL;
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_jobs == NULL || m_next_job >= m_jobs->size())
+				return;
+			job = (*m_jobs)[m_next_job];
+			m_next_job++;
+		}
+		job->run();
+	}
+}
@@ -0,0 +1,76 @@
+/*
+Minetest
+Copyright (C) 2010-2013 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef UTIL_WORKERPOOL_HEADER
+#define UTIL_WORKERPOOL_HEADER
+
+#include "../irrlichttypes.h"
+#include "../jthread/jmutex.h"
+#include <string>
+#include <vector>
+
+/*
+	A fixed set of threads that run batches of independent jobs.
+
+	run() hands the jobs out to the worker threads and to the calling
+	thread, and returns only after every job of the batch has finished.
+	A pool with zero threads runs everything in the calling thread.
+
+	A pool may be shared by several threads. While one batch is running,
+	another thread calling run() just runs its jobs itself.
+*/
+
+class WorkerPoolJob
+{
+public:
+	virtual ~WorkerPoolJob() {}
+	virtual void run() = 0;
+};
+
+class WorkerPoolThread;
+
+class WorkerPool
+{
+public:
+	WorkerPool(const std::string &name, u32 num_threads);
+	~WorkerPool();
+
+	u32 getThreadCount()
+	{
+		return m_threads.size();
+	}
+
+	void run(const std::vector<WorkerPoolJob*> &jobs);
+
+private:
+	friend class WorkerPoolThread;
+
+	// Runs jobs of the current batch until none are left
+	void work();
+
+	std::vector<WorkerPoolThread*> m_threads;
+
+	// Current batch, protected by m_mutex
+	JMutex m_mutex;
+	const std::vector<WorkerPoolJob*> *m_jobs;
+	u32 m_next_job;
+};
+
+#endif
+